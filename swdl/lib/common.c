@@ -17,26 +17,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
 
 #define NIMG_DECLARE_PTYPE_NAMES
 #include "nImage.h"
 
 #define BLOCK_SIZE ((size_t)16384)
-
-static inline void set_fd_nonblock(int fd)
-{
-    int flags = fcntl(fd, F_GETFL);
-    flags |= O_NONBLOCK;
-    fcntl(fd, F_SETFL, flags);
-}
+// how much of the input file file_copy_crc32_zerocopy maps at once
+#define ZEROCOPY_WINDOW ((size_t)64 << 20)
 
 nimg_ptype_e part_type_from_name(const char *name)
 {
@@ -57,10 +52,10 @@ void nimg_hdr_init(nimg_hdr_t *h)
 {
     memset(h, 0, sizeof(*h));
     h->magic = NIMG_HDR_MAGIC;
-    h->version = NIMG_HDR_VERSION;
+    h->version = NIMG_HDR_VERSION_COMPAT;
 }
 
-void print_part_info(nimg_phdr_t *p, const char *prefix, FILE *fp)
+void print_part_info(const nimg_phdr_t *p, const char *prefix, FILE *fp)
 {
     if (prefix == NULL)
         prefix = "";
@@ -80,6 +75,15 @@ nimg_hdr_check_e nimg_hdr_check(const nimg_hdr_t *h)
         return NIMG_HDR_CHECK_BAD_VERSION;
     if (h->n_parts > NIMG_MAX_PARTS)
         return NIMG_HDR_CHECK_TOO_MANY_PARTS;
+    if (h->version >= 3 && h->blk_shift != 0)
+    {
+        if (h->blk_shift < NIMG_BLK_SHIFT_MIN || h->blk_shift > NIMG_BLK_SHIFT_MAX)
+            return NIMG_HDR_CHECK_BAD_BLKTAB;
+    }
+    // images without block CRCs must not claim a table, it would never be read
+    // and everything after the header would be taken from the wrong offset
+    if (h->blktab_size != nimg_blktab_size(h))
+        return NIMG_HDR_CHECK_BAD_BLKTAB;
 
     uint32_t crc = 0;
     xcrc32(&crc, (const uint8_t*)h, NIMG_HDR_SIZE-4);
@@ -95,7 +99,7 @@ nimg_phdr_check_e nimg_phdr_check(const nimg_phdr_t *h, uint8_t hdr_version)
         return NIMG_PHDR_CHECK_BAD_MAGIC;
     if (h->type > NIMG_PTYPE_LAST)
         return NIMG_PHDR_CHECK_BAD_TYPE;
-    if (hdr_version < 2 && h->type > NIMG_PTYPE_ROOTFS_RW)
+    if (hdr_version < nimg_ptype_version(h->type))
         return NIMG_PHDR_CHECK_WRONG_VERSION;
 
     return NIMG_PHDR_CHECK_SUCCESS;
@@ -115,6 +119,8 @@ const char* nimg_hdr_check_str(nimg_hdr_check_e status)
             return "Too many partitions in image";
         case NIMG_HDR_CHECK_BAD_CRC:
             return "Invalid header CRC32";
+        case NIMG_HDR_CHECK_BAD_BLKTAB:
+            return "Invalid block CRC table size";
     }
     return NULL;
 }
@@ -135,6 +141,183 @@ const char* nimg_phdr_check_str(nimg_phdr_check_e status)
     return NULL;
 }
 
+// minimum image header version which supports a part type
+uint8_t nimg_ptype_version(nimg_ptype_e type)
+{
+    if (type > NIMG_PTYPE_BOOT_IMG_ZSTD)
+        return 3;
+    if (type > NIMG_PTYPE_ROOTFS_RW)
+        return 2;
+    return 1;
+}
+
+bool nimg_ptype_is_sparse(nimg_ptype_e type)
+{
+    return (type == NIMG_PTYPE_ROOTFS_SPARSE) || (type == NIMG_PTYPE_ROOTFS_RW_SPARSE);
+}
+
+// validate the header and extent table of a sparse part. Returns 0 if OK, -1 if not
+int nimg_sparse_check(const nimg_sparse_hdr_t *sh, const nimg_extent_t *extents, uint64_t part_size)
+{
+    if (sh->magic != NIMG_SPARSE_MAGIC)
+        return -1;
+
+    uint64_t data_size = sizeof(*sh) + (uint64_t)sh->n_extents * sizeof(nimg_extent_t);
+    uint64_t end = 0;
+    for (uint32_t i = 0; i < sh->n_extents; i++)
+    {
+        const nimg_extent_t *e = &extents[i];
+        if (e->offset < end || e->offset > sh->image_size || e->len == 0 || e->len > sh->image_size - e->offset)
+            return -1;
+        end = e->offset + e->len;
+        data_size += e->len;
+    }
+    return (data_size == part_size) ? 0 : -1;
+}
+
+// compressed rootfs types, which use the nimg_frames_hdr_t format
+bool nimg_ptype_is_framed(nimg_ptype_e type)
+{
+    return (type >= NIMG_PTYPE_ROOTFS_GZ) && (type <= NIMG_PTYPE_ROOTFS_RW_ZSTD);
+}
+
+// validate the header and frame size table of a compressed rootfs part.
+// Returns 0 if OK, -1 if not
+int nimg_frames_check(const nimg_frames_hdr_t *fh, const uint32_t *frame_sizes, uint64_t part_size)
+{
+    if (fh->magic != NIMG_FRAMES_MAGIC || fh->frame_size == 0 || fh->frame_size > NIMG_FRAME_SIZE_MAX)
+        return -1;
+    if (fh->n_frames != (fh->image_size + fh->frame_size - 1) / fh->frame_size)
+        return -1;
+
+    uint64_t data_size = sizeof(*fh) + (uint64_t)fh->n_frames * sizeof(uint32_t);
+    for (uint32_t i = 0; i < fh->n_frames; i++)
+    {
+        if (frame_sizes[i] == 0)
+            return -1;
+        data_size += frame_sizes[i];
+    }
+    return (data_size == part_size) ? 0 : -1;
+}
+
+// boot tar types which start with a nimg_fileidx_hdr_t file index
+bool nimg_ptype_is_indexed(nimg_ptype_e type)
+{
+    return (type >= NIMG_PTYPE_BOOT_TAR_IDX) && (type <= NIMG_PTYPE_BOOT_TARXZ_IDX);
+}
+
+// validate the header and entries of the file index of an indexed boot tar part.
+// entries points to the (ih->size - sizeof(*ih)) bytes after the header.
+// Returns 0 if OK, -1 if not
+int nimg_fileidx_check(const nimg_fileidx_hdr_t *ih, const uint8_t *entries, uint64_t part_size)
+{
+    if (ih->magic != NIMG_FILEIDX_MAGIC || ih->size < sizeof(*ih) || ih->size > NIMG_FILEIDX_SIZE_MAX ||
+        ih->size > part_size)
+        return -1;
+
+    const size_t len = ih->size - sizeof(*ih);
+    size_t off = 0;
+    for (uint32_t i = 0; i < ih->n_files; i++)
+    {
+        nimg_fileidx_entry_t e;
+        if (len - off < sizeof(e))
+            return -1;
+        memcpy(&e, entries + off, sizeof(e));
+        off += sizeof(e);
+        if (e.name_len == 0 || len - off < e.name_len || memchr(entries + off, '\0', e.name_len))
+            return -1;
+        off += e.name_len;
+    }
+    return (off == len) ? 0 : -1;
+}
+
+bool nimg_ptype_is_delta(nimg_ptype_e type)
+{
+    return (type == NIMG_PTYPE_ROOTFS_DELTA);
+}
+
+// number of bytes of the new image covered by a delta run of n_blocks blocks,
+// starting at block first_block. Only the last run can be short
+uint64_t nimg_delta_op_len(const nimg_delta_hdr_t *dh, uint64_t first_block, uint32_t n_blocks)
+{
+    uint64_t start = first_block * dh->block_size;
+    if (start >= dh->image_size)
+        return 0;
+    return min((uint64_t)n_blocks * dh->block_size, dh->image_size - start);
+}
+
+// validate the header and op table of a delta rootfs part. Returns 0 if OK, -1 if not
+int nimg_delta_check(const nimg_delta_hdr_t *dh, const nimg_delta_op_t *ops, uint64_t part_size)
+{
+    if (dh->magic != NIMG_DELTA_MAGIC || dh->block_size == 0 || dh->block_size > NIMG_DELTA_BLOCK_SIZE_MAX)
+        return -1;
+
+    const uint64_t n_blocks = (dh->image_size + dh->block_size - 1) / dh->block_size;
+    uint64_t data_size = sizeof(*dh) + (uint64_t)dh->n_ops * sizeof(nimg_delta_op_t);
+    uint64_t block = 0;
+    for (uint32_t i = 0; i < dh->n_ops; i++)
+    {
+        const nimg_delta_op_t *op = &ops[i];
+        if (op->n_blocks == 0 || op->n_blocks > n_blocks - block)
+            return -1;
+        uint64_t len = nimg_delta_op_len(dh, block, op->n_blocks);
+        if (op->src_offset == NIMG_DELTA_STORED)
+            data_size += len;
+        else if (op->src_offset > dh->base_size || len > dh->base_size - op->src_offset)
+            return -1;
+        block += op->n_blocks;
+    }
+    return (block == n_blocks && data_size == part_size) ? 0 : -1;
+}
+
+// block size for the version 3 block CRC table, or 0 if the image doesn't have one
+uint32_t nimg_block_size(const nimg_hdr_t *h)
+{
+    if (h->version < 3 || h->blk_shift == 0)
+        return 0;
+    return (uint32_t)1 << h->blk_shift;
+}
+
+// number of block CRCs in the table for part p
+uint64_t nimg_part_nblocks(const nimg_hdr_t *h, const nimg_phdr_t *p)
+{
+    uint32_t bs = nimg_block_size(h);
+    if (bs == 0)
+        return 0;
+    return (p->size + bs - 1) / bs;
+}
+
+// expected size in bytes of the block CRC table for h, including the trailing
+// table CRC. 0 if the image has no block CRCs.
+uint64_t nimg_blktab_size(const nimg_hdr_t *h)
+{
+    if (nimg_block_size(h) == 0)
+        return 0;
+    uint64_t n = 1; // table CRC
+    for (int i = 0; i < h->n_parts && i < NIMG_MAX_PARTS; i++)
+        n += nimg_part_nblocks(h, &h->parts[i]);
+    return n * sizeof(uint32_t);
+}
+
+// pointer to the first block CRC of a part in the table
+const uint32_t* nimg_part_blkcrcs(const nimg_hdr_t *h, const uint32_t *blktab, int part)
+{
+    for (int i = 0; i < part; i++)
+        blktab += nimg_part_nblocks(h, &h->parts[i]);
+    return blktab;
+}
+
+// check the CRC at the end of the block CRC table. Returns 0 if OK, -1 if not
+int nimg_blktab_check(const nimg_hdr_t *h, const uint32_t *blktab)
+{
+    size_t n = nimg_blktab_size(h) / sizeof(uint32_t);
+    if (n == 0)
+        return 0;
+    uint32_t crc = 0;
+    xcrc32(&crc, (const uint8_t*)blktab, (n - 1) * sizeof(uint32_t));
+    return (crc == blktab[n - 1]) ? 0 : -1;
+}
+
 /* Copy len bytes from fd_in to fd_out, calculating the CRC32 along the way.
  * If len is negative, read until EOF.
  * If fd_out is -1, don't copy, just read and CRC.
@@ -178,216 +361,97 @@ ssize_t file_copy_crc32(uint32_t *crc, ssize_t len, int fd_in, int fd_out)
     return total_read;
 }
 
-/* Copy len bytes from fd_in, pipe through compressor program, calculating CRC32 of
- * compressed data along the way.
- * crc, len, fd_in, and fd_out work as in file_copy_crc32, except that len must be
- * positive (read to EOF isn't supported).
- * compress_prog is the compressor program (probably "gzip" or "xz").
- * the size of compressed data written to fd_out is returned through compressed_size
- * Returns the number of bytes read from fd_in, which is always len on success, or -1
- * on failure.
+/* Like file_copy_crc32, but for a regular file fd_in the data is never copied
+ * through a userspace buffer: the CRC is calculated from an mmap of the input
+ * (using n_threads threads, see crc32_ranges_parallel), and the data is copied
+ * with copy_file_range, which lets the kernel share extents (reflink) on
+ * filesystems like btrfs and xfs when both files are on the same filesystem and
+ * the offsets are block-aligned.
+ * If copy_file_range isn't supported between these files, the data is written
+ * directly from the mapping instead.
+ * Falls back to file_copy_crc32 if fd_in isn't a regular file with at least len
+ * bytes left. fd_in must not shrink while it's copied: the mapping would raise
+ * SIGBUS, so that isn't supported, though copy_file_range finding the end of the
+ * file early is reported as a read error. The file offsets of fd_in and fd_out
+ * are advanced by len.
+ * Returns len, -1 on read error, or -2 on write error.
  */
-ssize_t file_copy_crc32_compress(uint32_t *crc, ssize_t len, int fd_in, int fd_out,
-                                 const char **compressor, size_t *compressed_size)
+ssize_t file_copy_crc32_zerocopy(uint32_t *crc, size_t len, int fd_in, int fd_out, int n_threads)
 {
-    // true streaming would make this function even more complicated, so cheat
-    // by buffering all the file data first
-    uint8_t *data = malloc(len);
-    assert(data != NULL);
-
-    ssize_t read_from_in = read_n(fd_in, data, len);
-    if (read_from_in != len)
+    struct stat sb;
+    off_t in_off = lseek(fd_in, 0, SEEK_CUR);
+    if ((in_off == (off_t)-1) || (fstat(fd_in, &sb) < 0) || !S_ISREG(sb.st_mode) ||
+        ((uint64_t)in_off + len > (uint64_t)sb.st_size))
     {
-        free(data);
-        return -1;
+        return file_copy_crc32(crc, len, fd_in, fd_out);
     }
 
-    int inpipe[2]; // pipe from fd_in to the compressor (buffered by us)
-    if (pipe2(inpipe, O_CLOEXEC) < 0)
+    const off_t page_mask = ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    bool use_cfr = true;
+    size_t done = 0;
+    while (done < len)
     {
-        log_error("inpipe pipe() failed: %s", strerror(errno));
-        free(data);
-        return -1;
-    }
-    set_fd_nonblock(inpipe[1]); // set write end of pipe to non-blocking for parent
-
-    int outpipe[2]; // pipe from the compressor to fd_out (buffered and crc'd by us)
-    if (pipe2(outpipe, O_CLOEXEC) < 0)
-    {
-        log_error("outpipe pipe() failed: %s", strerror(errno));
-        close(inpipe[0]); close(inpipe[1]);
-        free(data);
-        return -1;
-    }
-    set_fd_nonblock(outpipe[0]); // set read end of pipe to non-blocking for parent
-
-    pid_t cpid = fork();
-    if (cpid < 0)
-    {
-        log_error("fork() failed: %s", strerror(errno));
-        close(inpipe[0]); close(inpipe[1]);
-        close(outpipe[0]); close(outpipe[1]);
-        free(data);
-        return -1;
-    }
-    else if (cpid == 0)
-    {
-        // child process
-        dup2(inpipe[0], STDIN_FILENO);
-        dup2(outpipe[1], STDOUT_FILENO);
-        execvp(compressor[0], (char *const*)compressor);
-        fprintf(stderr, "execvp failed to run '%s': %s\n", compressor[0], strerror(errno));
-        _exit(99);
-    }
-
-    // main process
-    close(inpipe[0]);
-    close(outpipe[1]);
-
-    uint8_t *buf = malloc(BLOCK_SIZE);
-    assert(buf != NULL);
-    ssize_t comp_read = 0;
-    ssize_t comp_written = 0;
-    bool success = false;
-
-    while (true)
-    {
-        // write as much as we can to the pipe
-        while (comp_written < len)
+        const off_t pos = in_off + done;
+        const off_t map_start = pos & page_mask;
+        const size_t map_skip = pos - map_start;
+        const size_t chunk = min(ZEROCOPY_WINDOW, len - done);
+        void *map = mmap(NULL, map_skip + chunk, PROT_READ, MAP_SHARED, fd_in, map_start);
+        if (map == MAP_FAILED)
         {
-            const size_t to_write = min(BLOCK_SIZE, (size_t)(len - comp_written));
-            const ssize_t nwritten = write(inpipe[1], data + comp_written, to_write);
-            if (nwritten > 0)
-            {
-                // write success, keep going
-                //log_debug("wrote %zd bytes to compressor", nwritten);
-                comp_written += nwritten;
-                if (comp_written == len)
-                {
-                    log_debug("finished writing to compressor");
-                    // change the compressor read pipe to blocking mode so
-                    // that the read loop waits for compression to finish
-                    int flags = fcntl(outpipe[0], F_GETFL);
-                    flags &= ~O_NONBLOCK;
-                    fcntl(outpipe[0], F_SETFL, flags);
-
-                    // close the compressor's input so it knows to finish.
-                    // set to -1 so we don't try to close it again below
-                    close(inpipe[1]);
-                    inpipe[1] = -1;
-                }
-            }
-            else if (errno == EAGAIN)
-                break; // write would block, done for now
-            else
+            if (done == 0)
             {
-                log_error("write to compressor pipe failed: %s", strerror(errno));
-                goto done_error;
+                log_debug("mmap failed (%s), using read/write", strerror(errno));
+                return file_copy_crc32(crc, len, fd_in, fd_out);
             }
+            return -1;
         }
+        madvise(map, map_skip + chunk, MADV_SEQUENTIAL);
+        const uint8_t *data = (const uint8_t*)map + map_skip;
 
-        // read as much as we can from the pipe and write it to fd_out
-        while (true)
+        xcrc32_parallel(crc, data, chunk, n_threads);
+
+        size_t copied = 0;
+        while ((fd_out != -1) && (copied < chunk))
         {
-            const ssize_t nread = read(outpipe[0], buf, BLOCK_SIZE);
-            if (nread > 0)
+            ssize_t n;
+            if (use_cfr)
             {
-                //log_debug("read %zd bytes from compressor", nread);
-                // write that to fd_out. Assume we can write it all at once to avoid another loop
-                if (write(fd_out, buf, nread) != nread)
+                loff_t cfr_off = pos + copied;
+                n = copy_file_range(fd_in, &cfr_off, fd_out, NULL, chunk - copied, 0);
+                if ((n < 0) && (done + copied == 0) &&
+                    (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
                 {
-                    log_error("write failed: %s", strerror(errno));
-                    goto done_error;
+                    log_debug("copy_file_range not supported (%s), using write", strerror(errno));
+                    use_cfr = false;
+                    continue;
                 }
-                xcrc32(crc, buf, nread);
-                comp_read += nread;
-            }
-            else if ((nread == 0) || (errno == EAGAIN))
-            {
-                // EOF or read would block
-                if (comp_written < len)
-                    break; // not done writing, do more of that
-                else
-                    goto done; // EOF and we done writing to the compressor
             }
             else
-            {
-                log_error("read from compressor pipe failed: %s", strerror(errno));
-                goto done_error;
-            }
-        }
-    }
-
-done:
-    success = true;
-done_error:
-    free(data);
-    free(buf);
-    close(outpipe[0]);
-    if (inpipe[1] != -1)
-        close(inpipe[1]);
+                n = write(fd_out, data + copied, chunk - copied);
 
-    log_debug("compressor: wrote %zd bytes, read %zd bytes", comp_written, comp_read);
-
-    int wstatus;
-    pid_t waitret = waitpid(cpid, &wstatus, 0);
-    if (waitret > 0)
-    {
-        if (WIFEXITED(wstatus))
-        {
-            int status = WEXITSTATUS(wstatus);
-            if (status == 0)
-                log_debug("compressor process %d exited successfully", cpid);
-            else
+            if ((n < 0) && (errno == EINTR))
+                continue;
+            if (n <= 0)
             {
-                log_error("compressor process %d exited non-zero (%d)", cpid, status);
-                success = false;
+                munmap(map, map_skip + chunk);
+                if (use_cfr && (n == 0))
+                {
+                    // the input ended early, it was truncated after the size check
+                    errno = ENODATA;
+                    return -1;
+                }
+                return -2;
             }
+            copied += n;
         }
-        else if (WIFSIGNALED(wstatus))
-        {
-            log_error("child process %d killed by signal %d", cpid, WTERMSIG(wstatus));
-            success = false;
-        }
-        else
-            log_warn("compressor process %d exited, but not normally or by signal???", cpid);
-    }
-
-    *compressed_size = (size_t)comp_read;
-    return success ? len : -1;
-}
-
-// turn arg0 and null-terminated vargs into a null-terminated string array
-// returns a malloc'd pointer which should be free
-// strings are not strdup'd, so pointers passed here should be valid for the
-// lifetime of the returned array
-const char** make_str_array(const char *arg0, ...)
-{
-    int argc = 0;
-    const char **argv = NULL;
-    va_list ap;
-
-    va_start(ap, arg0);
-    for (argc = 0; va_arg(ap, const char*) != NULL; argc++);
-    va_end(ap);
 
-    argv = calloc(argc + 2, sizeof(const char*));
-    if (!argv)
-    {
-        log_error("failed to allocate memory for compressor args");
-        return NULL;
-    }
-
-    argv[0] = arg0;
-    va_start(ap, arg0);
-    for (int i = 1; i <= argc; i++)
-    {
-        argv[i] = va_arg(ap, const char*);
+        munmap(map, map_skip + chunk);
+        done += chunk;
     }
-    va_end(ap);
-    argv[argc+1] = NULL;
 
-    return argv;
+    if (lseek(fd_in, in_off + len, SEEK_SET) == (off_t)-1)
+        return -1;
+    return len;
 }
 
 // check the weird error handling of strtol, returning 0 or negative
@@ -402,6 +466,31 @@ int check_strtol(const char *str, int base, long *value)
     return (errno || endptr == str) ? -1 : 0;
 }
 
+// parse a size in bytes with an optional K, M, or G suffix (powers of 1024)
+// returns 0 on success or -1 if str isn't valid
+int check_strtosize(const char *str, uint64_t *value)
+{
+    char *endptr = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(str, &endptr, 0);
+    if (errno || endptr == str || *str == '-')
+        return -1;
+
+    int shift = 0;
+    switch (*endptr)
+    {
+        case '\0':           break;
+        case 'k': case 'K':  shift = 10; endptr++; break;
+        case 'm': case 'M':  shift = 20; endptr++; break;
+        case 'g': case 'G':  shift = 30; endptr++; break;
+        default:             return -1;
+    }
+    if (*endptr != '\0' || (v << shift) >> shift != v)
+        return -1;
+    *value = v << shift;
+    return 0;
+}
+
 // read count bytes from fd into buf, retrying indefinitely as long as we get
 // at least one byte.
 // If read returns 0, we assume EOF and set errno to 0.
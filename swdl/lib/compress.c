@@ -0,0 +1,983 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "nImage.h"
+
+// size of the input and output buffers for compression. Memory use doesn't
+// depend on the amount of data, only on these and the codec's own window.
+#define CODEC_BUF_SIZE ((size_t)256 * 1024)
+
+// compression levels, these match what the command-line tools were
+// called with before the library backends existed
+#define GZIP_LEVEL 6
+#define XZ_PRESET  6
+#define ZSTD_LEVEL 15
+
+// memory a zstd worker needs at ZSTD_LEVEL: the compression context for a
+// 4 MiB window plus its input and output job buffers
+#define ZSTD_WORKER_MEM ((uint64_t)64 << 20)
+
+struct codec {
+    const char      *name;
+    void            *state;
+    codec_output_fn output;
+    void            *output_arg;
+    uint64_t        total_in;
+    uint64_t        total_out;
+    uint8_t         *outbuf;
+    bool            stream_end; // decoders: a complete stream has been decoded
+
+    int  (*update)(codec_t *c, const uint8_t *in, size_t len, bool finish);
+    void (*destroy)(codec_t *c);
+};
+
+static inline int codec_emit(codec_t *c, size_t len)
+{
+    if (len == 0)
+        return 0;
+    c->total_out += len;
+    return c->output(c->output_arg, c->outbuf, len);
+}
+
+/*******************************************************************************
+ * ZLIB (GZIP)
+ ******************************************************************************/
+#ifdef HAVE_ZLIB
+static int zlib_update(codec_t *c, const uint8_t *in, size_t len, bool finish)
+{
+    z_stream *zs = c->state;
+    zs->next_in = (Bytef*)in;
+    zs->avail_in = len;
+
+    int ret;
+    do
+    {
+        zs->next_out = c->outbuf;
+        zs->avail_out = CODEC_BUF_SIZE;
+        ret = deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR)
+        {
+            log_error("zlib deflate failed: %s", zs->msg ? zs->msg : "stream error");
+            return -1;
+        }
+        if (codec_emit(c, CODEC_BUF_SIZE - zs->avail_out) < 0)
+            return -1;
+    } while ((zs->avail_out == 0) || (finish && ret != Z_STREAM_END));
+    return 0;
+}
+
+static void zlib_destroy(codec_t *c)
+{
+    deflateEnd(c->state);
+    free(c->state);
+}
+
+static int zlib_init(codec_t *c)
+{
+    z_stream *zs = calloc(1, sizeof(*zs));
+    assert(zs != NULL);
+    // windowBits 15+16 writes a gzip header/trailer rather than zlib
+    if (deflateInit2(zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        log_error("zlib deflateInit2 failed");
+        free(zs);
+        return -1;
+    }
+    c->state = zs;
+    c->update = zlib_update;
+    c->destroy = zlib_destroy;
+    return 0;
+}
+
+static int zlib_inflate_update(codec_t *c, const uint8_t *in, size_t len, bool finish)
+{
+    z_stream *zs = c->state;
+    if (finish)
+    {
+        if (!c->stream_end)
+        {
+            log_error("gzip data ended unexpectedly");
+            return -1;
+        }
+        return 0;
+    }
+
+    zs->next_in = (Bytef*)in;
+    zs->avail_in = len;
+    do
+    {
+        // like gzip -d, decode any concatenated gzip members
+        if (c->stream_end && zs->avail_in > 0)
+        {
+            inflateReset(zs);
+            c->stream_end = false;
+        }
+        zs->next_out = c->outbuf;
+        zs->avail_out = CODEC_BUF_SIZE;
+        int ret = inflate(zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+        {
+            log_error("zlib inflate failed: %s", zs->msg ? zs->msg : "data error");
+            return -1;
+        }
+        if (codec_emit(c, CODEC_BUF_SIZE - zs->avail_out) < 0)
+            return -1;
+        if (ret == Z_STREAM_END)
+            c->stream_end = true;
+        else if (ret == Z_BUF_ERROR)
+            break; // no progress possible, needs more input
+    } while ((zs->avail_in > 0) || (zs->avail_out == 0));
+    return 0;
+}
+
+static void zlib_inflate_destroy(codec_t *c)
+{
+    inflateEnd(c->state);
+    free(c->state);
+}
+
+static int zlib_inflate_init(codec_t *c)
+{
+    z_stream *zs = calloc(1, sizeof(*zs));
+    assert(zs != NULL);
+    if (inflateInit2(zs, 15 + 16) != Z_OK)
+    {
+        log_error("zlib inflateInit2 failed");
+        free(zs);
+        return -1;
+    }
+    c->state = zs;
+    c->update = zlib_inflate_update;
+    c->destroy = zlib_inflate_destroy;
+    return 0;
+}
+#endif // HAVE_ZLIB
+
+// set by compressor_set_limits
+static int max_encoder_threads = 0;
+static int n_concurrent_encoders = 1;
+
+void compressor_set_limits(int max_threads, int n_concurrent)
+{
+    max_encoder_threads = max_threads;
+    n_concurrent_encoders = max(n_concurrent, 1);
+}
+
+#if defined(HAVE_LZMA) || defined(HAVE_ZSTD)
+// total physical memory, 0 if unknown
+static uint64_t physmem(void)
+{
+    long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+    return (pages > 0 && page_size > 0) ? (uint64_t)pages * page_size : 0;
+}
+
+// Threads for a multithreaded encoder: one per CPU, but no more than fit in a
+// quarter of physical memory at mem_per_thread each, which is the limit xz -T0 uses.
+// With compressor_set_limits, at most max_encoder_threads, and the memory is
+// shared with the other encoders running at the same time.
+static int encoder_threads(uint64_t mem_per_thread)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = (ncpus > 0) ? (int)ncpus : 1;
+    if (max_encoder_threads > 0)
+        n = min(n, max_encoder_threads);
+    uint64_t limit = physmem() / 4 / n_concurrent_encoders;
+    if (limit && mem_per_thread)
+        n = (int)min((uint64_t)n, max(limit / mem_per_thread, (uint64_t)1));
+    return n;
+}
+#endif
+
+/*******************************************************************************
+ * LIBLZMA (XZ)
+ ******************************************************************************/
+#ifdef HAVE_LZMA
+static int lzma_update(codec_t *c, const uint8_t *in, size_t len, bool finish)
+{
+    lzma_stream *ls = c->state;
+    ls->next_in = in;
+    ls->avail_in = len;
+
+    lzma_ret ret;
+    do
+    {
+        ls->next_out = c->outbuf;
+        ls->avail_out = CODEC_BUF_SIZE;
+        ret = lzma_code(ls, finish ? LZMA_FINISH : LZMA_RUN);
+        if ((ret != LZMA_OK) && (ret != LZMA_STREAM_END))
+        {
+            log_error("liblzma encoder failed with code %d", (int)ret);
+            return -1;
+        }
+        if (codec_emit(c, CODEC_BUF_SIZE - ls->avail_out) < 0)
+            return -1;
+    } while ((ls->avail_in > 0) || (ls->avail_out == 0) || (finish && ret != LZMA_STREAM_END));
+    return 0;
+}
+
+static void lzma_destroy(codec_t *c)
+{
+    lzma_end(c->state);
+    free(c->state);
+}
+
+static int lzma_init(codec_t *c)
+{
+    lzma_stream *ls = calloc(1, sizeof(*ls));
+    assert(ls != NULL);
+    *ls = (lzma_stream)LZMA_STREAM_INIT;
+
+    lzma_ret ret;
+#if LZMA_VERSION >= 50020002
+    // equivalent of xz -T0, about 100 MB per thread at preset 6
+    lzma_mt mt = {
+        .preset = XZ_PRESET,
+        .check = LZMA_CHECK_CRC64,
+        .threads = 1,
+    };
+    uint64_t thread_mem = lzma_stream_encoder_mt_memusage(&mt);
+    mt.threads = encoder_threads(thread_mem != UINT64_MAX ? thread_mem : 0);
+    ret = lzma_stream_encoder_mt(ls, &mt);
+    if (ret == LZMA_OPTIONS_ERROR || ret == LZMA_UNSUPPORTED_CHECK)
+#endif
+        ret = lzma_easy_encoder(ls, XZ_PRESET, LZMA_CHECK_CRC64);
+    if (ret != LZMA_OK)
+    {
+        log_error("liblzma encoder init failed with code %d", (int)ret);
+        free(ls);
+        return -1;
+    }
+    c->state = ls;
+    c->update = lzma_update;
+    c->destroy = lzma_destroy;
+    return 0;
+}
+
+static int lzma_decoder_update(codec_t *c, const uint8_t *in, size_t len, bool finish)
+{
+    lzma_stream *ls = c->state;
+    ls->next_in = in;
+    ls->avail_in = len;
+
+    lzma_ret ret;
+    do
+    {
+        ls->next_out = c->outbuf;
+        ls->avail_out = CODEC_BUF_SIZE;
+        ret = lzma_code(ls, finish ? LZMA_FINISH : LZMA_RUN);
+        if ((ret != LZMA_OK) && (ret != LZMA_STREAM_END))
+        {
+            if (ret == LZMA_BUF_ERROR)
+                log_error("xz data ended unexpectedly");
+            else
+                log_error("liblzma decoder failed with code %d", (int)ret);
+            return -1;
+        }
+        if (codec_emit(c, CODEC_BUF_SIZE - ls->avail_out) < 0)
+            return -1;
+        if (ret == LZMA_STREAM_END)
+        {
+            c->stream_end = true;
+            break;
+        }
+    } while ((ls->avail_in > 0) || (ls->avail_out == 0) || finish);
+    return 0;
+}
+
+static int lzma_decoder_init(codec_t *c)
+{
+    lzma_stream *ls = calloc(1, sizeof(*ls));
+    assert(ls != NULL);
+    *ls = (lzma_stream)LZMA_STREAM_INIT;
+
+    // LZMA_CONCATENATED decodes multiple .xz streams like xz -d
+    lzma_ret ret = lzma_stream_decoder(ls, UINT64_MAX, LZMA_CONCATENATED);
+    if (ret != LZMA_OK)
+    {
+        log_error("liblzma decoder init failed with code %d", (int)ret);
+        free(ls);
+        return -1;
+    }
+    c->state = ls;
+    c->update = lzma_decoder_update;
+    c->destroy = lzma_destroy;
+    return 0;
+}
+#endif // HAVE_LZMA
+
+/*******************************************************************************
+ * LIBZSTD
+ ******************************************************************************/
+#ifdef HAVE_ZSTD
+static int zstd_update(codec_t *c, const uint8_t *in, size_t len, bool finish)
+{
+    ZSTD_inBuffer inb = { in, len, 0 };
+    size_t remaining;
+    do
+    {
+        ZSTD_outBuffer outb = { c->outbuf, CODEC_BUF_SIZE, 0 };
+        remaining = ZSTD_compressStream2(c->state, &outb, &inb, finish ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(remaining))
+        {
+            log_error("zstd compression failed: %s", ZSTD_getErrorName(remaining));
+            return -1;
+        }
+        if (codec_emit(c, outb.pos) < 0)
+            return -1;
+    } while ((inb.pos < inb.size) || (finish && remaining != 0));
+    return 0;
+}
+
+static void zstd_destroy(codec_t *c)
+{
+    ZSTD_freeCCtx(c->state);
+}
+
+static int zstd_init(codec_t *c)
+{
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (cctx == NULL)
+    {
+        log_error("ZSTD_createCCtx failed");
+        return -1;
+    }
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+    // equivalent of zstd -T0, limited by memory like xz. Always use the multithreaded
+    // mode, even with one worker: its output doesn't depend on the number of workers,
+    // but differs from nbWorkers=0, so parts compressed with create -p must use it too.
+    // This fails harmlessly if libzstd was built without threading support.
+    int workers = encoder_threads(ZSTD_WORKER_MEM);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, max(workers, 1));
+    c->state = cctx;
+    c->update = zstd_update;
+    c->destroy = zstd_destroy;
+    return 0;
+}
+
+static int zstd_decoder_update(codec_t *c, const uint8_t *in, size_t len, bool finish)
+{
+    if (finish)
+    {
+        if (!c->stream_end)
+        {
+            log_error("zstd data ended unexpectedly");
+            return -1;
+        }
+        return 0;
+    }
+
+    ZSTD_inBuffer inb = { in, len, 0 };
+    ZSTD_outBuffer outb;
+    do
+    {
+        outb = (ZSTD_outBuffer){ c->outbuf, CODEC_BUF_SIZE, 0 };
+        size_t ret = ZSTD_decompressStream(c->state, &outb, &inb);
+        if (ZSTD_isError(ret))
+        {
+            log_error("zstd decompression failed: %s", ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (codec_emit(c, outb.pos) < 0)
+            return -1;
+        // 0 means a frame was completely decoded and flushed
+        c->stream_end = (ret == 0);
+    } while ((inb.pos < inb.size) || (outb.pos == outb.size));
+    return 0;
+}
+
+static void zstd_decoder_destroy(codec_t *c)
+{
+    ZSTD_freeDCtx(c->state);
+}
+
+static int zstd_decoder_init(codec_t *c)
+{
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (dctx == NULL)
+    {
+        log_error("ZSTD_createDCtx failed");
+        return -1;
+    }
+    c->state = dctx;
+    c->update = zstd_decoder_update;
+    c->destroy = zstd_decoder_destroy;
+    return 0;
+}
+#endif // HAVE_ZSTD
+
+/*******************************************************************************
+ * GENERIC CODEC INTERFACE
+ ******************************************************************************/
+
+const char* compression_name(nimg_comp_e comp)
+{
+    switch (comp)
+    {
+        case NIMG_COMP_NONE: return "none";
+        case NIMG_COMP_GZIP: return "gzip";
+        case NIMG_COMP_XZ:   return "xz";
+        case NIMG_COMP_ZSTD: return "zstd";
+    }
+    return NULL;
+}
+
+nimg_comp_e part_compression(nimg_ptype_e type)
+{
+    switch (type)
+    {
+        case NIMG_PTYPE_BOOT_IMG_GZ:
+        case NIMG_PTYPE_ROOTFS_GZ:
+        case NIMG_PTYPE_ROOTFS_RW_GZ:
+            return NIMG_COMP_GZIP;
+        case NIMG_PTYPE_BOOT_IMG_XZ:
+        case NIMG_PTYPE_ROOTFS_XZ:
+        case NIMG_PTYPE_ROOTFS_RW_XZ:
+            return NIMG_COMP_XZ;
+        case NIMG_PTYPE_BOOT_IMG_ZSTD:
+        case NIMG_PTYPE_ROOTFS_ZSTD:
+        case NIMG_PTYPE_ROOTFS_RW_ZSTD:
+            return NIMG_COMP_ZSTD;
+        default:
+            return NIMG_COMP_NONE;
+    }
+}
+
+// compression of the tarball in a boot_tar part. These aren't compressed by
+// mknImage so they aren't included in part_compression
+nimg_comp_e boot_tar_compression(nimg_ptype_e type)
+{
+    switch (type)
+    {
+        case NIMG_PTYPE_BOOT_TARGZ:
+        case NIMG_PTYPE_BOOT_TARGZ_IDX:
+            return NIMG_COMP_GZIP;
+        case NIMG_PTYPE_BOOT_TARXZ:
+        case NIMG_PTYPE_BOOT_TARXZ_IDX:
+            return NIMG_COMP_XZ;
+        default:
+            return NIMG_COMP_NONE;
+    }
+}
+
+typedef int (*codec_init_fn)(codec_t *c);
+
+static codec_t* codec_new(nimg_comp_e comp, bool decode, codec_output_fn output, void *output_arg)
+{
+    codec_t *c = calloc(1, sizeof(*c));
+    assert(c != NULL);
+    c->name = compression_name(comp);
+    c->output = output;
+    c->output_arg = output_arg;
+
+    (void)decode; // unused without any libraries
+    codec_init_fn init = NULL;
+    switch (comp)
+    {
+#ifdef HAVE_ZLIB
+        case NIMG_COMP_GZIP:
+            init = decode ? zlib_inflate_init : zlib_init;
+            break;
+#endif
+#ifdef HAVE_LZMA
+        case NIMG_COMP_XZ:
+            init = decode ? lzma_decoder_init : lzma_init;
+            break;
+#endif
+#ifdef HAVE_ZSTD
+        case NIMG_COMP_ZSTD:
+            init = decode ? zstd_decoder_init : zstd_init;
+            break;
+#endif
+        default:
+            log_debug("no %s compression library available", c->name ? c->name : "(invalid)");
+            break;
+    }
+
+    if (init != NULL && init(c) == 0)
+    {
+        c->outbuf = malloc(CODEC_BUF_SIZE);
+        assert(c->outbuf != NULL);
+        return c;
+    }
+    free(c);
+    return NULL;
+}
+
+/* Create a streaming compressor. Compressed data is passed to output as it's
+ * produced, in chunks of at most CODEC_BUF_SIZE bytes.
+ * Returns NULL if no library backend was compiled in for comp, or if the
+ * backend failed to initialize (an error will have been logged).
+ */
+codec_t* compressor_new(nimg_comp_e comp, codec_output_fn output, void *output_arg)
+{
+    return codec_new(comp, false, output, output_arg);
+}
+
+/* Create a streaming decompressor, which works the same way as a compressor.
+ * Concatenated streams are decoded like the command-line tools do, and
+ * codec_finish fails if the input ended in the middle of a stream.
+ */
+codec_t* decompressor_new(nimg_comp_e comp, codec_output_fn output, void *output_arg)
+{
+    return codec_new(comp, true, output, output_arg);
+}
+
+// feed len bytes to the codec. Returns 0 on success or -1 on error
+int codec_update(codec_t *c, const uint8_t *in, size_t len)
+{
+    c->total_in += len;
+    return c->update(c, in, len, false);
+}
+
+// flush all remaining output. Returns 0 on success or -1 on error
+int codec_finish(codec_t *c)
+{
+    return c->update(c, NULL, 0, true);
+}
+
+uint64_t codec_total_out(const codec_t *c)
+{
+    return c->total_out;
+}
+
+void codec_free(codec_t *c)
+{
+    if (c != NULL)
+    {
+        c->destroy(c);
+        free(c->outbuf);
+        free(c);
+    }
+}
+
+/*******************************************************************************
+ * FILE COMPRESSION WITH CRC32
+ ******************************************************************************/
+
+typedef struct {
+    uint32_t    *crc;
+    int         fd;
+} crc_output_t;
+
+// write all of buf to fd, retrying partial writes. Returns 0 or -1
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int crc_output(void *arg, const uint8_t *buf, size_t len)
+{
+    crc_output_t *out = arg;
+    if (write_all(out->fd, buf, len) < 0)
+    {
+        log_error("write failed: %s", strerror(errno));
+        return -1;
+    }
+    xcrc32(out->crc, buf, len);
+    return 0;
+}
+
+/* Fallback when there's no library for a compression type: pipe the data
+ * through the command-line compressor. Input is streamed through a fixed
+ * size buffer so memory use doesn't depend on len.
+ */
+static ssize_t compress_exec(uint32_t *crc, ssize_t len, int fd_in, int fd_out,
+                             nimg_comp_e comp, size_t *compressed_size)
+{
+    static const char *const gzip_argv[] = { "gzip", NULL };
+    static const char *const xz_argv[]   = { "xz", "-T0", NULL };
+    static const char *const zstd_argv[] = { "zstd", "-15", "-T0", NULL };
+    const char *const *compressor = NULL;
+    switch (comp)
+    {
+        case NIMG_COMP_GZIP: compressor = gzip_argv; break;
+        case NIMG_COMP_XZ:   compressor = xz_argv;   break;
+        case NIMG_COMP_ZSTD: compressor = zstd_argv; break;
+        case NIMG_COMP_NONE: break;
+    }
+    if (compressor == NULL)
+    {
+        log_error("BUG: no compressor program for compression type %d", (int)comp);
+        return -1;
+    }
+    log_debug("compressing with external program %s", compressor[0]);
+
+    int inpipe[2]; // pipe from fd_in to the compressor (buffered by us)
+    if (pipe2(inpipe, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        log_error("inpipe pipe() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    int outpipe[2]; // pipe from the compressor to fd_out (buffered and crc'd by us)
+    if (pipe2(outpipe, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        log_error("outpipe pipe() failed: %s", strerror(errno));
+        close(inpipe[0]); close(inpipe[1]);
+        return -1;
+    }
+
+    pid_t cpid = fork();
+    if (cpid < 0)
+    {
+        log_error("fork() failed: %s", strerror(errno));
+        close(inpipe[0]); close(inpipe[1]);
+        close(outpipe[0]); close(outpipe[1]);
+        return -1;
+    }
+    else if (cpid == 0)
+    {
+        // child process. dup2 clears O_CLOEXEC, but O_NONBLOCK is shared with
+        // the parent's end of the pipe so it has to be cleared too
+        dup2(inpipe[0], STDIN_FILENO);
+        dup2(outpipe[1], STDOUT_FILENO);
+        fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) & ~O_NONBLOCK);
+        fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) & ~O_NONBLOCK);
+        execvp(compressor[0], (char *const*)compressor);
+        fprintf(stderr, "execvp failed to run '%s': %s\n", compressor[0], strerror(errno));
+        _exit(99);
+    }
+
+    // main process
+    close(inpipe[0]);
+    close(outpipe[1]);
+
+    uint8_t *inbuf = malloc(CODEC_BUF_SIZE);
+    uint8_t *outbuf = malloc(CODEC_BUF_SIZE);
+    assert(inbuf != NULL && outbuf != NULL);
+    size_t in_pos = 0, in_len = 0;  // pending data in inbuf
+    ssize_t total_in = 0;           // bytes read from fd_in
+    ssize_t comp_read = 0;          // bytes read from the compressor
+    bool success = false;
+
+    while (true)
+    {
+        // refill the input buffer once the compressor has taken all of it
+        if ((in_pos == in_len) && (total_in < len))
+        {
+            size_t n = read_n(fd_in, inbuf, min(CODEC_BUF_SIZE, (size_t)(len - total_in)));
+            if (n == 0)
+            {
+                log_error("read failed: %s", errno ? strerror(errno) : "unexpected EOF");
+                goto done_error;
+            }
+            in_pos = 0;
+            in_len = n;
+            total_in += n;
+        }
+        // close the compressor's input so it knows to finish.
+        if ((in_pos == in_len) && (total_in == len) && (inpipe[1] != -1))
+        {
+            log_debug("finished writing to compressor");
+            close(inpipe[1]);
+            inpipe[1] = -1;
+        }
+
+        struct pollfd pfds[2] = {
+            { .fd = outpipe[0], .events = POLLIN },
+            { .fd = inpipe[1],  .events = POLLOUT },
+        };
+        if (poll(pfds, (inpipe[1] != -1) ? 2 : 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_error("poll failed: %s", strerror(errno));
+            goto done_error;
+        }
+
+        if (pfds[1].revents & (POLLOUT | POLLERR))
+        {
+            ssize_t nwritten = write(inpipe[1], inbuf + in_pos, in_len - in_pos);
+            if (nwritten > 0)
+                in_pos += nwritten;
+            else if (errno != EAGAIN)
+            {
+                log_error("write to compressor pipe failed: %s", strerror(errno));
+                goto done_error;
+            }
+        }
+
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t nread = read(outpipe[0], outbuf, CODEC_BUF_SIZE);
+            if (nread > 0)
+            {
+                if (write_all(fd_out, outbuf, nread) < 0)
+                {
+                    log_error("write failed: %s", strerror(errno));
+                    goto done_error;
+                }
+                xcrc32(crc, outbuf, nread);
+                comp_read += nread;
+            }
+            else if (nread == 0)
+            {
+                if (inpipe[1] == -1)
+                    break; // EOF and we're done writing to the compressor
+                log_error("compressor closed its output early");
+                goto done_error;
+            }
+            else if (errno != EAGAIN)
+            {
+                log_error("read from compressor pipe failed: %s", strerror(errno));
+                goto done_error;
+            }
+        }
+    }
+
+    success = true;
+done_error:
+    free(inbuf);
+    free(outbuf);
+    close(outpipe[0]);
+    if (inpipe[1] != -1)
+        close(inpipe[1]);
+
+    log_debug("compressor: wrote %zd bytes, read %zd bytes", total_in, comp_read);
+
+    int wstatus;
+    pid_t waitret = waitpid(cpid, &wstatus, 0);
+    if (waitret > 0)
+    {
+        if (WIFEXITED(wstatus))
+        {
+            int status = WEXITSTATUS(wstatus);
+            if (status == 0)
+                log_debug("compressor process %d exited successfully", cpid);
+            else
+            {
+                log_error("compressor process %d exited non-zero (%d)", cpid, status);
+                success = false;
+            }
+        }
+        else if (WIFSIGNALED(wstatus))
+        {
+            log_error("child process %d killed by signal %d", cpid, WTERMSIG(wstatus));
+            success = false;
+        }
+        else
+            log_warn("compressor process %d exited, but not normally or by signal???", cpid);
+    }
+
+    *compressed_size = (size_t)comp_read;
+    return success ? len : -1;
+}
+
+/* Copy len bytes from fd_in, compress them, and write the compressed data to fd_out,
+ * calculating CRC32 of compressed data along the way.
+ * crc, len, fd_in, and fd_out work as in file_copy_crc32, except that len must be
+ * positive (read to EOF isn't supported).
+ * Compression is done in-process if a library for comp was available at build time,
+ * otherwise the data is piped through the gzip/xz/zstd command.
+ * the size of compressed data written to fd_out is returned through compressed_size
+ * Returns the number of bytes read from fd_in, which is always len on success, or -1
+ * on failure.
+ */
+ssize_t file_copy_crc32_compress(uint32_t *crc, ssize_t len, int fd_in, int fd_out,
+                                 nimg_comp_e comp, size_t *compressed_size)
+{
+    crc_output_t out = { .crc = crc, .fd = fd_out };
+    codec_t *c = compressor_new(comp, crc_output, &out);
+    if (c == NULL)
+        return compress_exec(crc, len, fd_in, fd_out, comp, compressed_size);
+
+    log_debug("compressing with built-in %s", c->name);
+    uint8_t *buf = malloc(CODEC_BUF_SIZE);
+    assert(buf != NULL);
+
+    ssize_t total = 0;
+    while (total < len)
+    {
+        size_t n = read_n(fd_in, buf, min(CODEC_BUF_SIZE, (size_t)(len - total)));
+        if (n == 0)
+        {
+            log_error("read failed: %s", errno ? strerror(errno) : "unexpected EOF");
+            break;
+        }
+        if (codec_update(c, buf, n) < 0)
+            break;
+        total += n;
+    }
+    if ((total == len) && (codec_finish(c) < 0))
+        total = -1;
+
+    *compressed_size = codec_total_out(c);
+    free(buf);
+    codec_free(c);
+    return (total == len) ? len : -1;
+}
+
+/*******************************************************************************
+ * ONE-SHOT FRAME COMPRESSION
+ ******************************************************************************/
+
+/* Compress in_len bytes of in as one complete gzip/xz/zstd stream. On success,
+ * *out is a malloc'd buffer of *out_len bytes which the caller must free.
+ * These are single threaded, the caller compresses multiple frames at once.
+ * Returns 0 on success, or -1 on failure or if there's no library for comp.
+ */
+int compress_frame(nimg_comp_e comp, const uint8_t *in, size_t in_len, uint8_t **out, size_t *out_len)
+{
+    *out = NULL;
+    switch (comp)
+    {
+#ifdef HAVE_ZLIB
+        case NIMG_COMP_GZIP:
+        {
+            z_stream zs = {0};
+            if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                break;
+            size_t bound = deflateBound(&zs, in_len);
+            *out = malloc(bound);
+            assert(*out != NULL);
+            zs.next_in = (Bytef*)in;
+            zs.avail_in = in_len;
+            zs.next_out = *out;
+            zs.avail_out = bound;
+            int ret = deflate(&zs, Z_FINISH);
+            *out_len = zs.total_out;
+            deflateEnd(&zs);
+            if (ret == Z_STREAM_END)
+                return 0;
+            break;
+        }
+#endif
+#ifdef HAVE_LZMA
+        case NIMG_COMP_XZ:
+        {
+            size_t bound = lzma_stream_buffer_bound(in_len);
+            *out = malloc(bound);
+            assert(*out != NULL);
+            *out_len = 0;
+            if (lzma_easy_buffer_encode(XZ_PRESET, LZMA_CHECK_CRC64, NULL, in, in_len,
+                                        *out, out_len, bound) == LZMA_OK)
+                return 0;
+            break;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case NIMG_COMP_ZSTD:
+        {
+            size_t bound = ZSTD_compressBound(in_len);
+            *out = malloc(bound);
+            assert(*out != NULL);
+            size_t ret = ZSTD_compress(*out, bound, in, in_len, ZSTD_LEVEL);
+            if (!ZSTD_isError(ret))
+            {
+                *out_len = ret;
+                return 0;
+            }
+            break;
+        }
+#endif
+        default:
+            log_error("no %s compression library available", compression_name(comp));
+            return -1;
+    }
+
+    log_error("%s frame compression failed", compression_name(comp));
+    free(*out);
+    *out = NULL;
+    return -1;
+}
+
+/* Decompress one complete gzip/xz/zstd stream from in, which must decompress
+ * to exactly out_len bytes. Returns 0 on success, or -1 on failure or if
+ * there's no library for comp.
+ */
+int decompress_frame(nimg_comp_e comp, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len)
+{
+    switch (comp)
+    {
+#ifdef HAVE_ZLIB
+        case NIMG_COMP_GZIP:
+        {
+            z_stream zs = {0};
+            if (inflateInit2(&zs, 15 + 16) != Z_OK)
+                break;
+            zs.next_in = (Bytef*)in;
+            zs.avail_in = in_len;
+            zs.next_out = out;
+            zs.avail_out = out_len;
+            int ret = inflate(&zs, Z_FINISH);
+            bool ok = (ret == Z_STREAM_END) && (zs.total_out == out_len) && (zs.avail_in == 0);
+            inflateEnd(&zs);
+            if (ok)
+                return 0;
+            break;
+        }
+#endif
+#ifdef HAVE_LZMA
+        case NIMG_COMP_XZ:
+        {
+            uint64_t memlimit = UINT64_MAX;
+            size_t in_pos = 0, out_pos = 0;
+            lzma_ret ret = lzma_stream_buffer_decode(&memlimit, 0, NULL, in, &in_pos, in_len,
+                                                     out, &out_pos, out_len);
+            if ((ret == LZMA_OK) && (in_pos == in_len) && (out_pos == out_len))
+                return 0;
+            break;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case NIMG_COMP_ZSTD:
+        {
+            size_t ret = ZSTD_decompress(out, out_len, in, in_len);
+            if (!ZSTD_isError(ret) && (ret == out_len))
+                return 0;
+            break;
+        }
+#endif
+        default:
+            log_error("no %s decompression library available", compression_name(comp));
+            return -1;
+    }
+
+    log_error("%s frame decompression failed", compression_name(comp));
+    return -1;
+}
@@ -30,11 +30,32 @@
  *   - removed libiberty header includes
  *   - use types from stdint.h
  *   - update crc value through pointer rather than returning
+ *   - add slicing-by-8/16 and carry-less multiply folding (x86 PCLMULQDQ,
+ *     ARMv8 PMULL) implementations, selected at startup based on CPU features
+ *   - add xcrc32_combine
  */
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32_HAVE_PCLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define CRC32_HAVE_PMULL
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_PMULL
+#define HWCAP_PMULL (1 << 4)
+#endif
+#endif
+
+#include "nImage.h"
+
 /* This table was generated by the following program.
 
    #include <stdio.h>
@@ -168,8 +189,21 @@ make it easy to compose the values of multiple blocks.
 
 */
 
-void
-xcrc32 (uint32_t *_crc, const uint8_t *buf, ssize_t len)
+/* Slicing tables, crc32_slice_table[k][i] is the CRC contribution of byte i
+   followed by k zero bytes.  crc32_slice_table[0] is crc32_table.  Filled in
+   by crc32_init at startup.  */
+static uint32_t crc32_slice_table[16][256];
+
+static inline uint32_t
+load_be32 (const uint8_t *p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof (v));
+  return __builtin_bswap32 (v);
+}
+
+static void
+crc32_bytewise (uint32_t *_crc, const uint8_t *buf, size_t len)
 {
   uint32_t crc = *_crc;
   while (len--)
@@ -179,3 +213,340 @@ xcrc32 (uint32_t *_crc, const uint8_t *buf, ssize_t len)
     }
   *_crc = crc;
 }
+
+#define SLICE(k, v, shift) crc32_slice_table[k][((v) >> (shift)) & 255]
+
+static void
+crc32_slice8 (uint32_t *_crc, const uint8_t *buf, size_t len)
+{
+  const uint32_t (*t)[256] = crc32_slice_table;
+  uint32_t crc = *_crc;
+  while (len >= 8)
+    {
+      uint32_t a = load_be32 (buf) ^ crc;
+      uint32_t b = load_be32 (buf + 4);
+      crc = SLICE (7, a, 24) ^ SLICE (6, a, 16) ^ SLICE (5, a, 8) ^ t[4][a & 255]
+          ^ SLICE (3, b, 24) ^ SLICE (2, b, 16) ^ SLICE (1, b, 8) ^ t[0][b & 255];
+      buf += 8;
+      len -= 8;
+    }
+  *_crc = crc;
+  crc32_bytewise (_crc, buf, len);
+}
+
+static void
+crc32_slice16 (uint32_t *_crc, const uint8_t *buf, size_t len)
+{
+  const uint32_t (*t)[256] = crc32_slice_table;
+  uint32_t crc = *_crc;
+  while (len >= 16)
+    {
+      uint32_t a = load_be32 (buf) ^ crc;
+      uint32_t b = load_be32 (buf + 4);
+      uint32_t c = load_be32 (buf + 8);
+      uint32_t d = load_be32 (buf + 12);
+      crc = SLICE (15, a, 24) ^ SLICE (14, a, 16) ^ SLICE (13, a, 8) ^ t[12][a & 255]
+          ^ SLICE (11, b, 24) ^ SLICE (10, b, 16) ^ SLICE (9, b, 8)  ^ t[8][b & 255]
+          ^ SLICE (7, c, 24)  ^ SLICE (6, c, 16)  ^ SLICE (5, c, 8)  ^ t[4][c & 255]
+          ^ SLICE (3, d, 24)  ^ SLICE (2, d, 16)  ^ SLICE (1, d, 8)  ^ t[0][d & 255];
+      buf += 16;
+      len -= 16;
+    }
+  *_crc = crc;
+  crc32_slice8 (_crc, buf, len);
+}
+
+#undef SLICE
+
+#if UINTPTR_MAX > 0xffffffffU
+#define crc32_portable crc32_slice16
+#else
+/* 32-bit targets have fewer registers and smaller caches, slicing-by-8
+   is usually the faster choice there.  */
+#define crc32_portable crc32_slice8
+#endif
+
+/* Folding constants for the carry-less multiply implementations.
+   A 128-bit accumulator X (highest coefficient in bit 127) which is
+   followed by D more bits of message is congruent (mod P) to
+   X_hi * (x^(D+64) mod P) + X_lo * (x^D mod P), which fits in 96 bits.
+   Folding never fully reduces the accumulator, the final 128 bits are
+   run through the table implementation instead.  */
+static uint64_t crc32_fold_k512[2]; /* { x^512 mod P, x^576 mod P } */
+static uint64_t crc32_fold_k128[2]; /* { x^128 mod P, x^192 mod P } */
+
+/* The minimum length where the folding implementations are worth the setup */
+#define CRC32_FOLD_MIN 256
+
+static uint32_t
+crc32_xpow_mod (unsigned int n)
+{
+  uint32_t r = 1;
+  while (n--)
+    r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+  return r;
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+#define PCLMUL_TARGET __attribute__ ((target ("pclmul,ssse3")))
+
+static inline PCLMUL_TARGET __m128i
+pclmul_load (const uint8_t *p, __m128i bswap)
+{
+  return _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) p), bswap);
+}
+
+static inline PCLMUL_TARGET __m128i
+pclmul_fold (__m128i x, __m128i k, __m128i next)
+{
+  __m128i lo = _mm_clmulepi64_si128 (x, k, 0x00);
+  __m128i hi = _mm_clmulepi64_si128 (x, k, 0x11);
+  return _mm_xor_si128 (_mm_xor_si128 (lo, hi), next);
+}
+
+static PCLMUL_TARGET void
+crc32_pclmul (uint32_t *_crc, const uint8_t *buf, size_t len)
+{
+  if (len < CRC32_FOLD_MIN)
+    {
+      crc32_portable (_crc, buf, len);
+      return;
+    }
+
+  const __m128i bswap = _mm_setr_epi8 (15, 14, 13, 12, 11, 10, 9, 8,
+                                       7, 6, 5, 4, 3, 2, 1, 0);
+  const __m128i k512 = _mm_loadu_si128 ((const __m128i *) crc32_fold_k512);
+  const __m128i k128 = _mm_loadu_si128 ((const __m128i *) crc32_fold_k128);
+
+  /* the initial CRC value is equivalent to xor-ing it into the first
+     32 bits of the message */
+  __m128i x0 = _mm_xor_si128 (pclmul_load (buf, bswap),
+                              _mm_slli_si128 (_mm_cvtsi32_si128 ((int) *_crc), 12));
+  __m128i x1 = pclmul_load (buf + 16, bswap);
+  __m128i x2 = pclmul_load (buf + 32, bswap);
+  __m128i x3 = pclmul_load (buf + 48, bswap);
+  buf += 64;
+  len -= 64;
+
+  while (len >= 64)
+    {
+      x0 = pclmul_fold (x0, k512, pclmul_load (buf, bswap));
+      x1 = pclmul_fold (x1, k512, pclmul_load (buf + 16, bswap));
+      x2 = pclmul_fold (x2, k512, pclmul_load (buf + 32, bswap));
+      x3 = pclmul_fold (x3, k512, pclmul_load (buf + 48, bswap));
+      buf += 64;
+      len -= 64;
+    }
+
+  x0 = pclmul_fold (x0, k128, x1);
+  x0 = pclmul_fold (x0, k128, x2);
+  x0 = pclmul_fold (x0, k128, x3);
+  while (len >= 16)
+    {
+      x0 = pclmul_fold (x0, k128, pclmul_load (buf, bswap));
+      buf += 16;
+      len -= 16;
+    }
+
+  uint8_t tail[16];
+  _mm_storeu_si128 ((__m128i *) tail, _mm_shuffle_epi8 (x0, bswap));
+  *_crc = 0;
+  crc32_portable (_crc, tail, sizeof (tail));
+  crc32_portable (_crc, buf, len);
+}
+
+static bool
+crc32_pclmul_supported (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+}
+#endif /* CRC32_HAVE_PCLMUL */
+
+#ifdef CRC32_HAVE_PMULL
+#define PMULL_TARGET __attribute__ ((target ("+crypto")))
+
+static inline PMULL_TARGET uint64x2_t
+pmull_load (const uint8_t *p)
+{
+  uint8x16_t v = vrev64q_u8 (vld1q_u8 (p));
+  return vreinterpretq_u64_u8 (vextq_u8 (v, v, 8));
+}
+
+static inline PMULL_TARGET uint64x2_t
+pmull_fold (uint64x2_t x, const uint64_t *k, uint64x2_t next)
+{
+  poly128_t lo = vmull_p64 (vgetq_lane_u64 (x, 0), k[0]);
+  poly128_t hi = vmull_p64 (vgetq_lane_u64 (x, 1), k[1]);
+  return veorq_u64 (veorq_u64 (vreinterpretq_u64_p128 (lo),
+                               vreinterpretq_u64_p128 (hi)), next);
+}
+
+static PMULL_TARGET void
+crc32_pmull (uint32_t *_crc, const uint8_t *buf, size_t len)
+{
+  if (len < CRC32_FOLD_MIN)
+    {
+      crc32_portable (_crc, buf, len);
+      return;
+    }
+
+  /* the initial CRC value is equivalent to xor-ing it into the first
+     32 bits of the message */
+  uint64x2_t init = vcombine_u64 (vcreate_u64 (0),
+                                  vcreate_u64 ((uint64_t) *_crc << 32));
+  uint64x2_t x0 = veorq_u64 (pmull_load (buf), init);
+  uint64x2_t x1 = pmull_load (buf + 16);
+  uint64x2_t x2 = pmull_load (buf + 32);
+  uint64x2_t x3 = pmull_load (buf + 48);
+  buf += 64;
+  len -= 64;
+
+  while (len >= 64)
+    {
+      x0 = pmull_fold (x0, crc32_fold_k512, pmull_load (buf));
+      x1 = pmull_fold (x1, crc32_fold_k512, pmull_load (buf + 16));
+      x2 = pmull_fold (x2, crc32_fold_k512, pmull_load (buf + 32));
+      x3 = pmull_fold (x3, crc32_fold_k512, pmull_load (buf + 48));
+      buf += 64;
+      len -= 64;
+    }
+
+  x0 = pmull_fold (x0, crc32_fold_k128, x1);
+  x0 = pmull_fold (x0, crc32_fold_k128, x2);
+  x0 = pmull_fold (x0, crc32_fold_k128, x3);
+  while (len >= 16)
+    {
+      x0 = pmull_fold (x0, crc32_fold_k128, pmull_load (buf));
+      buf += 16;
+      len -= 16;
+    }
+
+  /* pmull_load is its own inverse */
+  uint8_t tail[16];
+  vst1q_u8 (tail, vreinterpretq_u8_u64 (x0));
+  uint8x16_t be = vrev64q_u8 (vld1q_u8 (tail));
+  vst1q_u8 (tail, vextq_u8 (be, be, 8));
+  *_crc = 0;
+  crc32_portable (_crc, tail, sizeof (tail));
+  crc32_portable (_crc, buf, len);
+}
+
+static bool
+crc32_pmull_supported (void)
+{
+  return (getauxval (AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+#endif /* CRC32_HAVE_PMULL */
+
+typedef struct {
+  const char *name;
+  void (*func) (uint32_t *crc, const uint8_t *buf, size_t len);
+  bool (*supported) (void);
+} crc32_impl_t;
+
+/* In order of preference, a NULL supported function means always available */
+static const crc32_impl_t crc32_impls[] = {
+#ifdef CRC32_HAVE_PCLMUL
+  { "pclmul", crc32_pclmul, crc32_pclmul_supported },
+#endif
+#ifdef CRC32_HAVE_PMULL
+  { "pmull", crc32_pmull, crc32_pmull_supported },
+#endif
+  { "slice16", crc32_slice16, NULL },
+  { "slice8", crc32_slice8, NULL },
+  { "bytewise", crc32_bytewise, NULL },
+};
+
+static const crc32_impl_t *crc32_impl = &crc32_impls[0];
+
+/* Fill in the slicing and folding tables and pick the best implementation
+   for this CPU.  The choice can be overridden (e.g. for benchmarking or
+   to rule out a broken implementation) by setting NIMG_CRC32_IMPL to one
+   of the names in crc32_impls.  */
+static void __attribute__ ((constructor))
+crc32_init (void)
+{
+  for (int i = 0; i < 256; i++)
+    {
+      crc32_slice_table[0][i] = crc32_table[i];
+      for (int k = 1; k < 16; k++)
+        {
+          uint32_t prev = crc32_slice_table[k - 1][i];
+          crc32_slice_table[k][i] = (prev << 8) ^ crc32_table[prev >> 24];
+        }
+    }
+
+  crc32_fold_k512[0] = crc32_xpow_mod (512);
+  crc32_fold_k512[1] = crc32_xpow_mod (512 + 64);
+  crc32_fold_k128[0] = crc32_xpow_mod (128);
+  crc32_fold_k128[1] = crc32_xpow_mod (128 + 64);
+
+  const size_t n_impls = sizeof (crc32_impls) / sizeof (crc32_impls[0]);
+  const char *force = getenv ("NIMG_CRC32_IMPL");
+  const crc32_impl_t *best = NULL;
+  for (size_t i = 0; i < n_impls; i++)
+    {
+      const crc32_impl_t *impl = &crc32_impls[i];
+      if (impl->supported != NULL && !impl->supported ())
+        continue;
+      if (best == NULL)
+        best = impl;
+      if (force != NULL && !strcmp (force, impl->name))
+        {
+          best = impl;
+          break;
+        }
+    }
+  crc32_impl = best;
+}
+
+/* Multiply a and b modulo P */
+static uint32_t
+crc32_mulmod (uint32_t a, uint32_t b)
+{
+  uint32_t r = 0;
+  for (int i = 31; i >= 0; i--)
+    {
+      r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+      if (b & (1U << i))
+        r ^= a;
+    }
+  return r;
+}
+
+/* Combine the CRCs of two adjacent blocks A and B into the CRC of A
+   followed by B.  crc_a may have started from any value, crc_b must have
+   been computed with an initial value of 0.  Because this CRC has no
+   final xor, appending len_b bytes to A multiplies its CRC by
+   x^(8*len_b) mod P, and the result is simply xor-ed with crc_b.  */
+uint32_t
+xcrc32_combine (uint32_t crc_a, uint32_t crc_b, uint64_t len_b)
+{
+  uint32_t shift = 1;      /* x^0 */
+  uint32_t square = 1 << 8; /* x^8, one byte */
+  while (len_b)
+    {
+      if (len_b & 1)
+        shift = crc32_mulmod (shift, square);
+      square = crc32_mulmod (square, square);
+      len_b >>= 1;
+    }
+  return crc32_mulmod (crc_a, shift) ^ crc_b;
+}
+
+/* Name of the implementation in use, for debug logging */
+const char *
+xcrc32_impl_name (void)
+{
+  return crc32_impl->name;
+}
+
+void
+xcrc32 (uint32_t *_crc, const uint8_t *buf, ssize_t len)
+{
+  if (len > 0)
+    crc32_impl->func (_crc, buf, (size_t) len);
+}
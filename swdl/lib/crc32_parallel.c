@@ -0,0 +1,183 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "nImage.h"
+
+// ranges are split into chunks of this size, which are handed out to the
+// worker threads and then merged back together with xcrc32_combine
+#define CHUNK_SIZE ((uint64_t)8 << 20)
+// pread size for each worker
+#define READ_SIZE  ((size_t)1 << 20)
+
+typedef struct {
+    crc32_range_t   *range;
+    uint64_t        offset; // relative to the start of the range
+    uint64_t        len;
+    uint32_t        crc;
+    int             err;
+} chunk_t;
+
+typedef struct {
+    chunk_t         *chunks;
+    int             n_chunks;
+    int             next;   // next chunk index to process, updated atomically
+} chunk_queue_t;
+
+int crc32_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+}
+
+static void chunk_crc32(chunk_t *c, uint8_t *buf)
+{
+    const crc32_range_t *r = c->range;
+    c->crc = 0;
+    c->err = 0;
+
+    if (r->fd == -1)
+    {
+        xcrc32(&c->crc, r->buf + c->offset, c->len);
+        return;
+    }
+
+    uint64_t done = 0;
+    while (done < c->len)
+    {
+        size_t to_read = min(READ_SIZE, (size_t)(c->len - done));
+        ssize_t n = pread(r->fd, buf, to_read, r->offset + c->offset + done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            c->err = errno;
+            return;
+        }
+        else if (n == 0)
+        {
+            c->err = -1;
+            return;
+        }
+        xcrc32(&c->crc, buf, n);
+        done += n;
+    }
+}
+
+static void* worker_main(void *arg)
+{
+    chunk_queue_t *q = arg;
+    // page aligned so that files opened with O_DIRECT can be read
+    void *buf = NULL;
+    int err = posix_memalign(&buf, 4096, READ_SIZE);
+    assert(err == 0 && buf != NULL);
+    (void)err;
+
+    int i;
+    while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->n_chunks)
+        chunk_crc32(&q->chunks[i], buf);
+
+    free(buf);
+    return NULL;
+}
+
+/* Compute the CRC32 of each range in ranges, splitting them into chunks which
+ * are processed by up to n_threads worker threads (n_threads <= 0 means one
+ * per CPU). File ranges are read using pread, so the file offset of each fd
+ * is not changed and the same fd can be used for multiple ranges. The read
+ * buffers are page aligned, so an fd opened with O_DIRECT works for ranges
+ * with page aligned offsets and lengths.
+ * The crc and err fields of each range are set. Returns 0 if all ranges were
+ * checksummed successfully, or -1 if any range has an error.
+ */
+int crc32_ranges_parallel(crc32_range_t *ranges, int n_ranges, int n_threads)
+{
+    int n_chunks = 0;
+    for (int i = 0; i < n_ranges; i++)
+        n_chunks += (ranges[i].len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    chunk_queue_t q = { .chunks = calloc(n_chunks ? n_chunks : 1, sizeof(chunk_t)),
+                        .n_chunks = n_chunks, .next = 0 };
+    assert(q.chunks != NULL);
+
+    chunk_t *c = q.chunks;
+    for (int i = 0; i < n_ranges; i++)
+    {
+        for (uint64_t off = 0; off < ranges[i].len; off += CHUNK_SIZE, c++)
+        {
+            c->range = &ranges[i];
+            c->offset = off;
+            c->len = min(CHUNK_SIZE, ranges[i].len - off);
+        }
+    }
+
+    if (n_threads <= 0)
+        n_threads = crc32_default_threads();
+    n_threads = min(n_threads, n_chunks);
+
+    // run one set of work in this thread rather than leaving it idle
+    pthread_t threads[n_threads > 1 ? n_threads - 1 : 1];
+    int started = 0;
+    for (; started < n_threads - 1; started++)
+    {
+        int err = pthread_create(&threads[started], NULL, worker_main, &q);
+        if (err != 0)
+        {
+            log_warn("failed to start crc32 worker thread: %s", strerror(err));
+            break;
+        }
+    }
+    log_debug("crc32: %d chunks in %d ranges, %d threads", n_chunks, n_ranges, started + 1);
+    worker_main(&q);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    int ret = 0;
+    c = q.chunks;
+    for (int i = 0; i < n_ranges; i++)
+    {
+        crc32_range_t *r = &ranges[i];
+        r->crc = 0;
+        r->err = 0;
+        for (uint64_t off = 0; off < r->len; off += CHUNK_SIZE, c++)
+        {
+            if (c->err && !r->err)
+                r->err = c->err;
+            r->crc = xcrc32_combine(r->crc, c->crc, c->len);
+        }
+        if (r->err)
+            ret = -1;
+    }
+
+    free(q.chunks);
+    return ret;
+}
+
+// Update a running crc with len bytes of buf, using multiple threads
+void xcrc32_parallel(uint32_t *crc, const uint8_t *buf, size_t len, int n_threads)
+{
+    crc32_range_t r = { .fd = -1, .buf = buf, .offset = 0, .len = len };
+    crc32_ranges_parallel(&r, 1, n_threads);
+    *crc = xcrc32_combine(*crc, r.crc, len);
+}
@@ -0,0 +1,205 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "nImage.h"
+
+// Hash table of the base image blocks, keyed by their CRC32. Only the first
+// block with each CRC is stored (so e.g. all the zero blocks share one entry),
+// matches are always confirmed with memcmp.
+typedef struct {
+    uint32_t *slots;    // block index + 1, 0 for empty
+    uint32_t *crcs;     // CRC32 of the block in each slot
+    uint64_t mask;
+} block_table_t;
+
+static void block_table_init(block_table_t *t, const uint8_t *base, uint64_t n_blocks, uint32_t block_size)
+{
+    uint64_t n_slots = 1024;
+    while (n_slots < n_blocks * 2)
+        n_slots *= 2;
+    t->slots = calloc(n_slots, sizeof(uint32_t));
+    t->crcs = malloc(n_slots * sizeof(uint32_t));
+    assert(t->slots != NULL && t->crcs != NULL);
+    t->mask = n_slots - 1;
+
+    for (uint64_t b = 0; b < n_blocks; b++)
+    {
+        uint32_t crc = 0;
+        xcrc32(&crc, base + b * block_size, block_size);
+        uint64_t i = crc & t->mask;
+        while (t->slots[i] && t->crcs[i] != crc)
+            i = (i + 1) & t->mask;
+        if (!t->slots[i])
+        {
+            t->slots[i] = b + 1;
+            t->crcs[i] = crc;
+        }
+    }
+}
+
+// find a base block with crc, or -1
+static int64_t block_table_find(const block_table_t *t, uint32_t crc)
+{
+    for (uint64_t i = crc & t->mask; t->slots[i]; i = (i + 1) & t->mask)
+        if (t->crcs[i] == crc)
+            return t->slots[i] - 1;
+    return -1;
+}
+
+static void* map_file(int fd, uint64_t size)
+{
+    if (size == 0)
+        return NULL;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    madvise(map, size, MADV_WILLNEED);
+    return map;
+}
+
+/* Build the op table of a delta rootfs part (see nimg_delta_hdr_t) for the new
+ * image new_fd based on the image base_fd. Each block of the new image is copied
+ * from the base if it's the same as the next block of the previous run, the
+ * block at the same offset in the base, or any block-aligned block of the base,
+ * and stored in the part otherwise.
+ * On success, fills in dh, stores a malloc'd op table in *ops, and returns 0.
+ * Returns -1 on error.
+ */
+int delta_build(int base_fd, int new_fd, uint32_t block_size, nimg_delta_hdr_t *dh, nimg_delta_op_t **ops)
+{
+    struct stat base_sb, new_sb;
+    if (fstat(base_fd, &base_sb) < 0 || fstat(new_fd, &new_sb) < 0)
+    {
+        log_error("stat failed: %s", strerror(errno));
+        return -1;
+    }
+    const uint64_t base_size = base_sb.st_size, image_size = new_sb.st_size;
+    const uint8_t *base = map_file(base_fd, base_size);
+    const uint8_t *img = map_file(new_fd, image_size);
+    if ((base_size && !base) || (image_size && !img))
+    {
+        log_error("mmap failed: %s", strerror(errno));
+        if (base)
+            munmap((void*)base, base_size);
+        return -1;
+    }
+
+    memset(dh, 0, sizeof(*dh));
+    dh->magic = NIMG_DELTA_MAGIC;
+    dh->image_size = image_size;
+    dh->base_size = base_size;
+    dh->block_size = block_size;
+
+    block_table_t table;
+    block_table_init(&table, base, base_size / block_size, block_size);
+
+    size_t alloc = 64;
+    nimg_delta_op_t *op_table = malloc(alloc * sizeof(nimg_delta_op_t));
+    assert(op_table != NULL);
+    uint32_t n_ops = 0;
+    nimg_delta_op_t *op = NULL;
+    uint64_t op_len = 0;        // bytes covered by op so far
+    uint64_t stored = 0;
+    uint32_t image_crc = 0;
+    int ret = 0;
+
+    for (uint64_t off = 0; off < image_size; off += block_size)
+    {
+        const size_t len = min((uint64_t)block_size, image_size - off);
+        const uint8_t *data = img + off;
+        uint32_t crc = 0;
+        xcrc32(&crc, data, len);
+        image_crc = xcrc32_combine(image_crc, crc, len);
+
+        uint64_t src = NIMG_DELTA_STORED;
+        if (op && op->src_offset != NIMG_DELTA_STORED && op->src_offset + op_len + len <= base_size &&
+            !memcmp(base + op->src_offset + op_len, data, len))
+            src = op->src_offset + op_len;
+        else if (off + len <= base_size && !memcmp(base + off, data, len))
+            src = off;
+        else if (len == block_size)
+        {
+            int64_t b = block_table_find(&table, crc);
+            if (b >= 0 && !memcmp(base + b * block_size, data, len))
+                src = b * block_size;
+        }
+
+        // extend the current run if possible
+        bool extend = false;
+        if (op && op->n_blocks < UINT32_MAX)
+        {
+            if (src == NIMG_DELTA_STORED)
+                extend = (op->src_offset == NIMG_DELTA_STORED);
+            else
+                extend = (op->src_offset != NIMG_DELTA_STORED) && (src == op->src_offset + op_len);
+        }
+        if (!extend)
+        {
+            if (n_ops == UINT32_MAX)
+            {
+                log_error("too many delta runs");
+                ret = -1;
+                break;
+            }
+            if (n_ops == alloc)
+            {
+                alloc *= 2;
+                op_table = realloc(op_table, alloc * sizeof(nimg_delta_op_t));
+                assert(op_table != NULL);
+            }
+            op = &op_table[n_ops++];
+            op->src_offset = src;
+            op->n_blocks = 0;
+            op->crc32 = 0;
+            op_len = 0;
+        }
+        op->crc32 = xcrc32_combine(op->crc32, crc, len);
+        op->n_blocks++;
+        op_len += len;
+        if (src == NIMG_DELTA_STORED)
+            stored += len;
+    }
+
+    free(table.slots);
+    free(table.crcs);
+    if (base)
+        munmap((void*)base, base_size);
+    if (img)
+        munmap((void*)img, image_size);
+    if (ret != 0)
+    {
+        free(op_table);
+        return -1;
+    }
+
+    dh->n_ops = n_ops;
+    dh->image_crc32 = image_crc;
+    *ops = op_table;
+    log_debug("delta: %u runs, %llu of %llu bytes stored", n_ops,
+              (unsigned long long)stored, (unsigned long long)image_size);
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "nImage.h"
+
+typedef struct {
+    nimg_comp_e     comp;
+    int             fd_in;
+    int             fd_out;
+    off_t           in_start;
+    uint64_t        len;
+    uint32_t        frame_size;
+    uint32_t        n_frames;
+    uint32_t        *frame_sizes;   // compressed size of each frame
+
+    uint32_t        next;           // next frame to compress, updated atomically
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    uint32_t        next_write;     // frames are written in order, protected by lock
+    uint32_t        crc;            // CRC32 of the frames written so far
+    uint64_t        written;
+    bool            failed;
+} frame_job_t;
+
+static void* frame_worker(void *arg)
+{
+    frame_job_t *job = arg;
+    uint8_t *inbuf = malloc(job->frame_size);
+    assert(inbuf != NULL);
+
+    uint32_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n_frames)
+    {
+        const uint64_t off = (uint64_t)i * job->frame_size;
+        const size_t len = min((uint64_t)job->frame_size, job->len - off);
+        uint8_t *out = NULL;
+        size_t out_len = 0;
+
+        bool ok = true;
+        size_t done = 0;
+        while (done < len)
+        {
+            ssize_t n = pread(job->fd_in, inbuf + done, len - done, job->in_start + off + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                log_error("read failed: %s", (n < 0) ? strerror(errno) : "unexpected EOF");
+                ok = false;
+                break;
+            }
+            done += n;
+        }
+        if (ok)
+            ok = (compress_frame(job->comp, inbuf, len, &out, &out_len) == 0) && (out_len <= UINT32_MAX);
+
+        // wait for our turn to write, this also limits how many compressed
+        // frames are held in memory to about one per thread
+        pthread_mutex_lock(&job->lock);
+        while (job->next_write != i && !job->failed)
+            pthread_cond_wait(&job->cond, &job->lock);
+        if (ok && !job->failed)
+        {
+            size_t pos = 0;
+            while (pos < out_len)
+            {
+                ssize_t n = write(job->fd_out, out + pos, out_len - pos);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                {
+                    log_error("write failed: %s", strerror(errno));
+                    ok = false;
+                    break;
+                }
+                pos += n;
+            }
+            xcrc32(&job->crc, out, out_len);
+            job->frame_sizes[i] = out_len;
+            job->written += out_len;
+        }
+        if (!ok)
+            job->failed = true;
+        job->next_write++;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+
+        free(out);
+        if (!ok)
+            break;
+    }
+
+    free(inbuf);
+    return NULL;
+}
+
+/* Copy len bytes from fd_in to fd_out as a compressed rootfs part (see
+ * nimg_frames_hdr_t), compressing frames on n_threads threads (<= 0 means one
+ * per CPU). fd_in must be a regular file and fd_out must be seekable, because
+ * the frame size table is filled in after all frames are written.
+ * crc and the return value work like file_copy_crc32_compress, the total part
+ * size written to fd_out is returned through part_size.
+ */
+ssize_t file_copy_crc32_frames(uint32_t *crc, size_t len, int fd_in, int fd_out, nimg_comp_e comp,
+                               uint32_t frame_size, int n_threads, size_t *part_size)
+{
+    frame_job_t job = {
+        .comp = comp,
+        .fd_in = fd_in,
+        .fd_out = fd_out,
+        .in_start = lseek(fd_in, 0, SEEK_CUR),
+        .len = len,
+        .frame_size = frame_size,
+        .n_frames = (len + frame_size - 1) / frame_size,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    const off_t out_start = lseek(fd_out, 0, SEEK_CUR);
+    if (job.in_start == (off_t)-1 || out_start == (off_t)-1)
+    {
+        log_error("compressed rootfs parts need a seekable input and output: %s", strerror(errno));
+        return -1;
+    }
+
+    // leave space for the header and frame size table
+    const size_t table_size = sizeof(nimg_frames_hdr_t) + (size_t)job.n_frames * sizeof(uint32_t);
+    if (lseek(fd_out, table_size, SEEK_CUR) == (off_t)-1)
+        return -1;
+    job.frame_sizes = calloc(job.n_frames ? job.n_frames : 1, sizeof(uint32_t));
+    assert(job.frame_sizes != NULL);
+
+    if (n_threads <= 0)
+        n_threads = crc32_default_threads();
+    n_threads = min(n_threads, (int)job.n_frames);
+    log_debug("compressing %u %s frames on %d threads", job.n_frames, compression_name(comp), n_threads);
+
+    pthread_t threads[n_threads > 1 ? n_threads - 1 : 1];
+    int started = 0;
+    for (; started < n_threads - 1; started++)
+    {
+        int err = pthread_create(&threads[started], NULL, frame_worker, &job);
+        if (err != 0)
+        {
+            log_warn("failed to start compression thread: %s", strerror(err));
+            break;
+        }
+    }
+    frame_worker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    ssize_t ret = -1;
+    if (!job.failed)
+    {
+        uint8_t *table = malloc(table_size);
+        assert(table != NULL);
+        nimg_frames_hdr_t fh = { .magic = NIMG_FRAMES_MAGIC, .image_size = len,
+                                 .frame_size = frame_size, .n_frames = job.n_frames };
+        memcpy(table, &fh, sizeof(fh));
+        memcpy(table + sizeof(fh), job.frame_sizes, job.n_frames * sizeof(uint32_t));
+
+        if (pwrite(fd_out, table, table_size, out_start) == (ssize_t)table_size)
+        {
+            // the table comes first in the part, but was written last
+            xcrc32(crc, table, table_size);
+            *crc = xcrc32_combine(*crc, job.crc, job.written);
+            *part_size = table_size + job.written;
+            lseek(fd_in, job.in_start + len, SEEK_SET);
+            ret = len;
+        }
+        else
+            log_error("failed to write frame table: %s", strerror(errno));
+        free(table);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+    free(job.frame_sizes);
+    return ret;
+}
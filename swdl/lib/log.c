@@ -33,9 +33,12 @@ static void vlog(log_level_e level, const char *fmt, va_list args)
 {
     if (level <= log_level)
     {
+        // hold the lock for the whole line, so lines logged by other threads don't interleave
+        flockfile(stderr);
         fputs(log_level_str[level], stderr);
         vfprintf(stderr, fmt, args);
         putc('\n', stderr);
+        funlockfile(stderr);
     }
 }
 
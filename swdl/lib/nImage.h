@@ -19,6 +19,7 @@
 #define NIMAGE_H
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
 #include <errno.h>
@@ -52,7 +53,10 @@
 
 #define NIMG_HDR_MAGIC   0x474d49534257454eULL /* "NEWBSIMG" */
 #define NIMG_PHDR_MAGIC  0x54524150474d494eULL /* "NIMGPART" */
-#define NIMG_HDR_VERSION 2
+#define NIMG_HDR_VERSION 3
+// images which don't use any version 3 features are created as version 2,
+// so that older versions of newbs-swdl can still program them
+#define NIMG_HDR_VERSION_COMPAT 2
 
 #define NIMG_HDR_VERSION_MIN_SUPPORTED 1
 #define NIMG_HDR_VERSION_MAX_SUPPORTED NIMG_HDR_VERSION
@@ -62,6 +66,16 @@
 #define NIMG_NAME_LEN   128
 #define NIMG_MAX_PARTS  27
 
+// Version 3 block CRC table. When blk_shift is non-zero, the image header is
+// followed by a table of uint32_t CRC32s of every (1 << blk_shift) byte block
+// of every part, in part order, and then a CRC32 of the table itself.
+// Each block CRC starts from 0, the last block of a part may be short.
+// The table is blktab_size bytes long and is counted as padding before the
+// first part (i.e. parts[0].offset >= blktab_size).
+#define NIMG_BLK_SHIFT_MIN 12 // 4 KiB
+#define NIMG_BLK_SHIFT_MAX 30 // 1 GiB
+#define NIMG_BLK_SHIFT_DEFAULT 20 // 1 MiB
+
 // Important! Keep this enum and nimg_ptype_names in sync!
 typedef enum {
     NIMG_PTYPE_INVALID,
@@ -76,6 +90,19 @@ typedef enum {
     NIMG_PTYPE_BOOT_IMG_XZ,
     // added after version 2, but with no header version bump (for compatibility)
     NIMG_PTYPE_BOOT_IMG_ZSTD,
+    // added in version 3
+    NIMG_PTYPE_ROOTFS_SPARSE,
+    NIMG_PTYPE_ROOTFS_RW_SPARSE,
+    NIMG_PTYPE_ROOTFS_GZ,
+    NIMG_PTYPE_ROOTFS_XZ,
+    NIMG_PTYPE_ROOTFS_ZSTD,
+    NIMG_PTYPE_ROOTFS_RW_GZ,
+    NIMG_PTYPE_ROOTFS_RW_XZ,
+    NIMG_PTYPE_ROOTFS_RW_ZSTD,
+    NIMG_PTYPE_BOOT_TAR_IDX,
+    NIMG_PTYPE_BOOT_TARGZ_IDX,
+    NIMG_PTYPE_BOOT_TARXZ_IDX,
+    NIMG_PTYPE_ROOTFS_DELTA,
 
     NIMG_PTYPE_COUNT,
     NIMG_PTYPE_LAST = NIMG_PTYPE_COUNT - 1
@@ -97,6 +124,19 @@ const char *nimg_ptype_names[] = {
     "boot_img_xz",
     // added after version 2, but with no header version bump (for compatibility)
     "boot_img_zstd",
+    // added in version 3
+    "rootfs_sparse",
+    "rootfs_rw_sparse",
+    "rootfs_gz",
+    "rootfs_xz",
+    "rootfs_zstd",
+    "rootfs_rw_gz",
+    "rootfs_rw_xz",
+    "rootfs_rw_zstd",
+    "boot_tar_idx",
+    "boot_targz_idx",
+    "boot_tarxz_idx",
+    "rootfs_delta",
 };
 static_assert(sizeof(nimg_ptype_names) == (NIMG_PTYPE_COUNT * sizeof(char*)),
               "wrong number of elements  in nimg_ptype_names");
@@ -116,8 +156,9 @@ typedef struct __attribute__((packed)) {
     uint64_t    magic;
     uint8_t     version;
     uint8_t     n_parts;
-    uint16_t    unused1;
-    uint32_t    unused2;
+    uint8_t     blk_shift;   // version 3: log2 of the block CRC size, or 0 for no block CRCs
+    uint8_t     unused1;
+    uint32_t    blktab_size; // version 3: size of the block CRC table
     char        name[NIMG_NAME_LEN];
     nimg_phdr_t parts[NIMG_MAX_PARTS];
     uint8_t     unused3[12];
@@ -125,6 +166,97 @@ typedef struct __attribute__((packed)) {
 } nimg_hdr_t;
 static_assert(sizeof(nimg_hdr_t) == NIMG_HDR_SIZE, "wrong size for nimg_hdr_t");
 
+// Version 3 sparse rootfs parts. The part data starts with a nimg_sparse_hdr_t,
+// followed by n_extents nimg_extent_t, followed by the data of each extent in
+// order. Extents are sorted and don't overlap, everything in between them
+// (up to image_size) is zeros.
+#define NIMG_SPARSE_MAGIC 0x4553524150534e49ULL /* "INSPARSE" */
+
+typedef struct __attribute__((packed)) {
+    uint64_t magic;
+    uint64_t image_size; // size of the full (unsparse) filesystem image
+    uint32_t n_extents;
+    uint32_t unused;
+} nimg_sparse_hdr_t;
+static_assert(sizeof(nimg_sparse_hdr_t) == 24, "wrong size for nimg_sparse_hdr_t");
+
+typedef struct __attribute__((packed)) {
+    uint64_t offset;
+    uint64_t len;
+} nimg_extent_t;
+static_assert(sizeof(nimg_extent_t) == 16, "wrong size for nimg_extent_t");
+
+// Version 3 compressed rootfs parts. The image is split into frames of
+// frame_size bytes (the last one may be short), and each frame is compressed
+// as an independent gzip/xz/zstd stream so that they can be decompressed in
+// parallel. The part data starts with a nimg_frames_hdr_t, followed by
+// n_frames uint32_t compressed frame sizes, followed by the frames in order.
+#define NIMG_FRAMES_MAGIC 0x53454d4152464e49ULL /* "INFRAMES" */
+#define NIMG_FRAME_SIZE_DEFAULT ((uint32_t)4 << 20)
+#define NIMG_FRAME_SIZE_MAX     ((uint32_t)64 << 20)
+
+typedef struct __attribute__((packed)) {
+    uint64_t magic;
+    uint64_t image_size; // size of the uncompressed filesystem image
+    uint32_t frame_size;
+    uint32_t n_frames;
+} nimg_frames_hdr_t;
+static_assert(sizeof(nimg_frames_hdr_t) == 24, "wrong size for nimg_frames_hdr_t");
+
+// Version 3 indexed boot tar parts. The part data starts with a file index of
+// the regular files in the archive, so that files which are already in /boot
+// don't need to be written again, followed by the tar/tar.gz/tar.xz archive.
+// The index is a nimg_fileidx_hdr_t followed by n_files variable-length entries,
+// each a nimg_fileidx_entry_t followed by name_len bytes of the file's path
+// (relative, not NUL-terminated). size is the size of the whole index.
+#define NIMG_FILEIDX_MAGIC 0x5844494c49464e49ULL /* "INFILIDX" */
+#define NIMG_FILEIDX_SIZE_MAX ((uint32_t)64 << 20)
+
+typedef struct __attribute__((packed)) {
+    uint64_t magic;
+    uint32_t n_files;
+    uint32_t size;
+} nimg_fileidx_hdr_t;
+static_assert(sizeof(nimg_fileidx_hdr_t) == 16, "wrong size for nimg_fileidx_hdr_t");
+
+typedef struct __attribute__((packed)) {
+    uint64_t size;  // file size
+    uint32_t crc32; // CRC32 of the file contents
+    uint16_t name_len;
+    uint16_t unused;
+} nimg_fileidx_entry_t;
+static_assert(sizeof(nimg_fileidx_entry_t) == 16, "wrong size for nimg_fileidx_entry_t");
+
+// Version 3 delta rootfs parts. The new filesystem image is rebuilt from the
+// image in the active rootfs bank (the base) and written to the inactive bank.
+// The new image is divided into blocks of block_size bytes (the last one may
+// be short), which are described in order by n_ops runs of blocks: each run is
+// either copied from the base starting at src_offset, or stored in the part.
+// The part data starts with a nimg_delta_hdr_t, followed by n_ops nimg_delta_op_t,
+// followed by the data of the stored runs in order.
+#define NIMG_DELTA_MAGIC 0x41544c4544524e49ULL /* "INRDELTA" */
+#define NIMG_DELTA_STORED UINT64_MAX // src_offset of runs stored in the part
+#define NIMG_DELTA_BLOCK_SIZE_DEFAULT ((uint32_t)4096)
+#define NIMG_DELTA_BLOCK_SIZE_MAX ((uint32_t)16 << 20)
+
+typedef struct __attribute__((packed)) {
+    uint64_t magic;
+    uint64_t image_size;  // size of the new filesystem image
+    uint64_t base_size;   // size of the base image
+    uint32_t block_size;
+    uint32_t n_ops;
+    uint32_t image_crc32; // CRC32 of the whole new image
+    uint32_t unused;
+} nimg_delta_hdr_t;
+static_assert(sizeof(nimg_delta_hdr_t) == 40, "wrong size for nimg_delta_hdr_t");
+
+typedef struct __attribute__((packed)) {
+    uint64_t src_offset;  // offset in the base, or NIMG_DELTA_STORED
+    uint32_t n_blocks;
+    uint32_t crc32;       // CRC32 of the run's data in the new image
+} nimg_delta_op_t;
+static_assert(sizeof(nimg_delta_op_t) == 16, "wrong size for nimg_delta_op_t");
+
 /*******************************************************************************
  * LOGGING
  ******************************************************************************/
@@ -196,6 +328,7 @@ typedef enum {
     NIMG_HDR_CHECK_BAD_VERSION,
     NIMG_HDR_CHECK_TOO_MANY_PARTS,
     NIMG_HDR_CHECK_BAD_CRC,
+    NIMG_HDR_CHECK_BAD_BLKTAB,
 } nimg_hdr_check_e;
 
 typedef enum {
@@ -208,24 +341,149 @@ typedef enum {
 BEGIN_DECLS
 // from libiberty crc32.c
 extern void xcrc32(uint32_t *_crc, const uint8_t *buf, ssize_t len);
+extern const char* xcrc32_impl_name(void);
+extern uint32_t xcrc32_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b);
+
+// from crc32_parallel.c
+typedef struct {
+    int            fd;      // file to pread from, or -1 to use buf
+    const uint8_t  *buf;    // data to checksum when fd is -1
+    uint64_t       offset;  // starting file offset, unused for buf
+    uint64_t       len;     // number of bytes to checksum
+    uint32_t       crc;     // result: CRC32 of the range, starting from 0
+    int            err;     // result: 0, an errno value, or -1 for unexpected EOF
+} crc32_range_t;
+
+int     crc32_default_threads(void);
+int     crc32_ranges_parallel(crc32_range_t *ranges, int n_ranges, int n_threads);
+void    xcrc32_parallel(uint32_t *crc, const uint8_t *buf, size_t len, int n_threads);
 
 // from common.c
 nimg_ptype_e    part_type_from_name(const char *name);
 const char*     part_name_from_type(nimg_ptype_e id);
 void            nimg_hdr_init(nimg_hdr_t *h);
-void            print_part_info(nimg_phdr_t *p, const char *prefix, FILE *fp);
+void            print_part_info(const nimg_phdr_t *p, const char *prefix, FILE *fp);
 nimg_hdr_check_e    nimg_hdr_check(const nimg_hdr_t *h);
 nimg_phdr_check_e   nimg_phdr_check(const nimg_phdr_t *h, uint8_t hdr_version);
 const char*     nimg_hdr_check_str(nimg_hdr_check_e status);
 const char*     nimg_phdr_check_str(nimg_phdr_check_e status);
+uint8_t         nimg_ptype_version(nimg_ptype_e type);
+bool            nimg_ptype_is_sparse(nimg_ptype_e type);
+int             nimg_sparse_check(const nimg_sparse_hdr_t *sh, const nimg_extent_t *extents, uint64_t part_size);
+bool            nimg_ptype_is_framed(nimg_ptype_e type);
+int             nimg_frames_check(const nimg_frames_hdr_t *fh, const uint32_t *frame_sizes, uint64_t part_size);
+bool            nimg_ptype_is_indexed(nimg_ptype_e type);
+int             nimg_fileidx_check(const nimg_fileidx_hdr_t *ih, const uint8_t *entries, uint64_t part_size);
+bool            nimg_ptype_is_delta(nimg_ptype_e type);
+uint64_t        nimg_delta_op_len(const nimg_delta_hdr_t *dh, uint64_t first_block, uint32_t n_blocks);
+int             nimg_delta_check(const nimg_delta_hdr_t *dh, const nimg_delta_op_t *ops, uint64_t part_size);
+uint32_t        nimg_block_size(const nimg_hdr_t *h);
+uint64_t        nimg_part_nblocks(const nimg_hdr_t *h, const nimg_phdr_t *p);
+uint64_t        nimg_blktab_size(const nimg_hdr_t *h);
+const uint32_t* nimg_part_blkcrcs(const nimg_hdr_t *h, const uint32_t *blktab, int part);
+int             nimg_blktab_check(const nimg_hdr_t *h, const uint32_t *blktab);
 
 ssize_t         file_copy_crc32(uint32_t *crc, ssize_t len, int fd_in, int fd_out);
-ssize_t         file_copy_crc32_compress(uint32_t *crc, ssize_t len, int fd_in, int fd_out,
-                                         const char **compressor, size_t *compressed_size);
-const char**    make_str_array(const char *arg0, ...) __attribute__((sentinel));
+ssize_t         file_copy_crc32_zerocopy(uint32_t *crc, size_t len, int fd_in, int fd_out, int n_threads);
 int             check_strtol(const char *str, int base, long *value);
+int             check_strtosize(const char *str, uint64_t *value);
 size_t          read_n(int fd, void *buf, size_t count);
 const char*     human_bytes(size_t s);
 END_DECLS
 
+/*******************************************************************************
+ * COMPRESSION
+ ******************************************************************************/
+
+typedef enum {
+    NIMG_COMP_NONE,
+    NIMG_COMP_GZIP,
+    NIMG_COMP_XZ,
+    NIMG_COMP_ZSTD,
+} nimg_comp_e;
+
+// streaming codec, implemented with zlib/liblzma/libzstd when available
+typedef struct codec codec_t;
+// called with each chunk of codec output, returns 0 on success or -1 to abort
+typedef int (*codec_output_fn)(void *arg, const uint8_t *buf, size_t len);
+
+BEGIN_DECLS
+// from compress.c
+const char*     compression_name(nimg_comp_e comp);
+nimg_comp_e     part_compression(nimg_ptype_e type);
+nimg_comp_e     boot_tar_compression(nimg_ptype_e type);
+// compressors created after this use at most max_threads threads (<= 0 means one per CPU)
+// and share memory with n_concurrent - 1 others. Not thread-safe, call before starting them
+void            compressor_set_limits(int max_threads, int n_concurrent);
+codec_t*        compressor_new(nimg_comp_e comp, codec_output_fn output, void *output_arg);
+codec_t*        decompressor_new(nimg_comp_e comp, codec_output_fn output, void *output_arg);
+int             codec_update(codec_t *c, const uint8_t *in, size_t len);
+int             codec_finish(codec_t *c);
+uint64_t        codec_total_out(const codec_t *c);
+void            codec_free(codec_t *c);
+ssize_t         file_copy_crc32_compress(uint32_t *crc, ssize_t len, int fd_in, int fd_out,
+                                         nimg_comp_e comp, size_t *compressed_size);
+int             compress_frame(nimg_comp_e comp, const uint8_t *in, size_t in_len,
+                               uint8_t **out, size_t *out_len);
+int             decompress_frame(nimg_comp_e comp, const uint8_t *in, size_t in_len,
+                                 uint8_t *out, size_t out_len);
+
+// from frames.c
+ssize_t         file_copy_crc32_frames(uint32_t *crc, size_t len, int fd_in, int fd_out, nimg_comp_e comp,
+                                       uint32_t frame_size, int n_threads, size_t *part_size);
+
+// from delta.c
+int             delta_build(int base_fd, int new_fd, uint32_t block_size,
+                            nimg_delta_hdr_t *dh, nimg_delta_op_t **ops);
+
+// from tarindex.c
+int             tar_build_fileidx(int fd, uint64_t len, nimg_comp_e comp, uint8_t **idx, size_t *idx_size);
+END_DECLS
+
+/*******************************************************************************
+ * TAR ARCHIVES
+ ******************************************************************************/
+
+typedef enum {
+    TAR_OK = 0,
+    TAR_ERR_CHECKSUM,
+    TAR_ERR_META_SIZE,
+    TAR_ERR_PAX,
+    TAR_ERR_TRUNCATED,
+    TAR_ERR_CALLBACK,   // a tar_callbacks_t function returned nonzero
+} tar_err_e;
+
+// A member of a tar archive, with any pax headers and GNU long names applied.
+// The strings are only valid during the begin callback.
+typedef struct {
+    const char  *path;  // as stored in the archive, see tar_clean_path
+    const char  *link;  // symlink or hard link target
+    uint64_t    size;
+    mode_t      mode;
+    int64_t     mtime;
+    char        type;   // typeflag from the header
+} tar_entry_t;
+
+// Called for each member of the archive (but not pax headers or GNU long names),
+// begin with its header, data with each chunk of its contents, and end after the
+// last one. Each returns 0 on success or nonzero to stop parsing.
+typedef struct {
+    int (*begin)(void *arg, const tar_entry_t *e);
+    int (*data)(void *arg, const uint8_t *buf, size_t len);
+    int (*end)(void *arg);
+} tar_callbacks_t;
+
+// streaming tar parser, used by both mknImage and newbs-swdl so that they agree on member paths
+typedef struct tar_parser tar_parser_t;
+
+BEGIN_DECLS
+// from tar.c
+tar_parser_t*   tar_parser_new(const tar_callbacks_t *cb, void *arg);
+tar_err_e       tar_parser_feed(tar_parser_t *t, const uint8_t *data, size_t len);
+tar_err_e       tar_parser_finish(tar_parser_t *t);
+void            tar_parser_free(tar_parser_t *t);
+const char*     tar_err_str(tar_err_e err);
+char*           tar_clean_path(const char *path);
+END_DECLS
+
 #endif // NIMAGE_H
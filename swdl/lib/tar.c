@@ -0,0 +1,374 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+
+#include "nImage.h"
+
+#define TAR_BLOCK 512
+// limit on the size of pax headers and GNU long names
+#define META_MAX ((size_t)1 << 20)
+
+typedef enum { TAR_HEADER, TAR_DATA, TAR_PADDING, TAR_END } tar_state_e;
+
+struct tar_parser {
+    tar_callbacks_t cb;
+    void        *arg;
+
+    tar_state_e state;
+    uint8_t     hdr[TAR_BLOCK];
+    size_t      hdr_len;
+    unsigned    zero_blocks;
+    uint64_t    remaining;      // data bytes left in the current entry
+    size_t      padding;        // bytes to skip to the next header
+    char        type;           // type of the current entry
+
+    uint8_t     *meta;          // pax header or GNU long name data
+    size_t      meta_len;
+    char        *next_path;     // from pax headers or GNU long names, for the next entry
+    char        *next_link;
+    uint64_t    next_size;
+    bool        have_next_size;
+};
+
+// pax headers and GNU long names/link names, which are collected by the parser
+static bool is_meta(char type)
+{
+    return type == 'x' || type == 'L' || type == 'K';
+}
+
+// parse a numeric tar header field, either octal text or GNU base-256
+static uint64_t tar_number(const uint8_t *f, size_t n)
+{
+    uint64_t val = 0;
+    if (f[0] & 0x80)
+    {
+        val = f[0] & 0x7f;
+        for (size_t i = 1; i < n; i++)
+            val = (val << 8) | f[i];
+        return val;
+    }
+
+    size_t i = 0;
+    while (i < n && f[i] == ' ')
+        i++;
+    for (; i < n && f[i] >= '0' && f[i] <= '7'; i++)
+        val = (val << 3) | (f[i] - '0');
+    return val;
+}
+
+// copy a header field, which is only NUL-terminated if it's shorter than the field
+static size_t tar_string(char *out, const uint8_t *f, size_t n)
+{
+    size_t len = strnlen((const char*)f, n);
+    memcpy(out, f, len);
+    out[len] = '\0';
+    return len;
+}
+
+static void set_string(char **s, const char *value)
+{
+    free(*s);
+    *s = strdup(value);
+    assert(*s != NULL);
+}
+
+/* Make a member path relative to the extraction directory by removing leading
+ * slashes and . components. Returns a malloc'd string, or NULL for paths with ..
+ * components, which could escape it.
+ */
+char* tar_clean_path(const char *path)
+{
+    char *out = malloc(strlen(path) + 1);
+    assert(out != NULL);
+    size_t len = 0;
+    const char *c = path;
+    while (*c)
+    {
+        size_t n = strcspn(c, "/");
+        if ((n == 2) && !memcmp(c, "..", 2))
+        {
+            free(out);
+            return NULL;
+        }
+        if ((n > 0) && !((n == 1) && (*c == '.')))
+        {
+            if (len)
+                out[len++] = '/';
+            memcpy(out + len, c, n);
+            len += n;
+        }
+        c += n;
+        if (*c == '/')
+            c++;
+    }
+    out[len] = '\0';
+    return out;
+}
+
+const char* tar_err_str(tar_err_e err)
+{
+    switch (err)
+    {
+        case TAR_OK:
+            return "success";
+        case TAR_ERR_CHECKSUM:
+            return "invalid tar header checksum";
+        case TAR_ERR_META_SIZE:
+            return "tar extended header is too large";
+        case TAR_ERR_PAX:
+            return "invalid pax extended header";
+        case TAR_ERR_TRUNCATED:
+            return "tar archive is truncated";
+        case TAR_ERR_CALLBACK:
+            return "tar member callback failed";
+    }
+    return NULL;
+}
+
+tar_parser_t* tar_parser_new(const tar_callbacks_t *cb, void *arg)
+{
+    tar_parser_t *t = calloc(1, sizeof(*t));
+    assert(t != NULL);
+    t->cb = *cb;
+    t->arg = arg;
+    return t;
+}
+
+void tar_parser_free(tar_parser_t *t)
+{
+    if (t == NULL)
+        return;
+    free(t->meta);
+    free(t->next_path);
+    free(t->next_link);
+    free(t);
+}
+
+// pax extended header records are "LENGTH KEY=VALUE\n"
+static tar_err_e parse_pax(tar_parser_t *t)
+{
+    char *data = (char*)t->meta;
+    const size_t size = t->meta_len;
+    data[size] = '\0'; // so that strtoul stops at the end
+    size_t pos = 0;
+    while (pos < size)
+    {
+        char *key;
+        unsigned long len = strtoul(data + pos, &key, 10);
+        if ((*key != ' ') || (len == 0) || (len > size - pos))
+            return TAR_ERR_PAX;
+        key++;
+        char *rec_end = data + pos + len - 1; // the newline
+        if ((key >= rec_end) || (*rec_end != '\n'))
+            return TAR_ERR_PAX;
+        char *eq = memchr(key, '=', rec_end - key);
+        if (eq == NULL)
+            return TAR_ERR_PAX;
+
+        *eq = '\0';
+        *rec_end = '\0';
+        if (!strcmp(key, "path"))
+            set_string(&t->next_path, eq + 1);
+        else if (!strcmp(key, "linkpath"))
+            set_string(&t->next_link, eq + 1);
+        else if (!strcmp(key, "size"))
+        {
+            t->next_size = strtoull(eq + 1, NULL, 10);
+            t->have_next_size = true;
+        }
+        pos += len;
+    }
+    return TAR_OK;
+}
+
+static tar_err_e end_entry(tar_parser_t *t)
+{
+    tar_err_e err = TAR_OK;
+    switch (t->type)
+    {
+        case 'x':
+            err = parse_pax(t);
+            break;
+        case 'L':
+        case 'K':
+            t->meta[t->meta_len] = '\0';
+            set_string(t->type == 'L' ? &t->next_path : &t->next_link, (char*)t->meta);
+            break;
+        case 'g':
+            // global pax header, nothing in it matters to us
+            break;
+        default:
+            if (t->cb.end(t->arg) != 0)
+                err = TAR_ERR_CALLBACK;
+            break;
+    }
+    t->state = t->padding ? TAR_PADDING : TAR_HEADER;
+    return err;
+}
+
+static tar_err_e process_header(tar_parser_t *t)
+{
+    bool zero = true;
+    for (size_t i = 0; zero && i < TAR_BLOCK; i++)
+        zero = !t->hdr[i];
+    if (zero)
+    {
+        // two zero blocks mark the end of the archive
+        if (++t->zero_blocks == 2)
+            t->state = TAR_END;
+        return TAR_OK;
+    }
+    t->zero_blocks = 0;
+
+    // checksum of the header with the checksum field as spaces. Some old tars used signed chars
+    unsigned sum = 0;
+    int ssum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; i++)
+    {
+        uint8_t c = (i >= 148 && i < 156) ? ' ' : t->hdr[i];
+        sum += c;
+        ssum += (int8_t)c;
+    }
+    uint64_t chksum = tar_number(t->hdr + 148, 8);
+    if (chksum != sum && chksum != (uint64_t)(unsigned)ssum)
+        return TAR_ERR_CHECKSUM;
+
+    char path[257], link[101];
+    size_t len = 0;
+    // POSIX ustar has a path prefix, GNU tar ("ustar  ") uses that space for other things
+    if (!memcmp(t->hdr + 257, "ustar\0", 6) && t->hdr[345])
+    {
+        len = tar_string(path, t->hdr + 345, 155);
+        path[len++] = '/';
+    }
+    tar_string(path + len, t->hdr, 100);
+    tar_string(link, t->hdr + 157, 100);
+
+    tar_entry_t e = {
+        .path = path,
+        .link = link,
+        .size = tar_number(t->hdr + 124, 12),
+        .mode = tar_number(t->hdr + 100, 8),
+        .mtime = tar_number(t->hdr + 136, 12),
+        .type = t->hdr[156],
+    };
+    t->type = e.type;
+
+    // pax headers and GNU long names apply to the next entry
+    const bool member = !is_meta(e.type) && (e.type != 'g');
+    if (member)
+    {
+        if (t->next_path)
+            e.path = t->next_path;
+        if (t->next_link)
+            e.link = t->next_link;
+        if (t->have_next_size)
+            e.size = t->next_size;
+    }
+
+    t->remaining = e.size;
+    t->padding = (TAR_BLOCK - e.size % TAR_BLOCK) % TAR_BLOCK;
+    t->state = TAR_DATA;
+
+    tar_err_e err = TAR_OK;
+    if (is_meta(e.type))
+    {
+        if (e.size > META_MAX)
+            return TAR_ERR_META_SIZE;
+        t->meta = realloc(t->meta, e.size + 1);
+        assert(t->meta != NULL);
+        t->meta_len = 0;
+    }
+    else if (member)
+    {
+        if (t->cb.begin(t->arg, &e) != 0)
+            err = TAR_ERR_CALLBACK;
+        free(t->next_path);
+        free(t->next_link);
+        t->next_path = t->next_link = NULL;
+        t->have_next_size = false;
+    }
+
+    if ((err == TAR_OK) && !t->remaining)
+        err = end_entry(t);
+    return err;
+}
+
+tar_err_e tar_parser_feed(tar_parser_t *t, const uint8_t *data, size_t len)
+{
+    tar_err_e err = TAR_OK;
+    while ((err == TAR_OK) && (len > 0))
+    {
+        size_t n = 0;
+        switch (t->state)
+        {
+            case TAR_HEADER:
+                n = min(len, TAR_BLOCK - t->hdr_len);
+                memcpy(t->hdr + t->hdr_len, data, n);
+                t->hdr_len += n;
+                if (t->hdr_len == TAR_BLOCK)
+                {
+                    t->hdr_len = 0;
+                    err = process_header(t);
+                }
+                break;
+
+            case TAR_DATA:
+                n = min((uint64_t)len, t->remaining);
+                if (is_meta(t->type))
+                {
+                    memcpy(t->meta + t->meta_len, data, n);
+                    t->meta_len += n;
+                }
+                else if ((t->type != 'g') && (t->cb.data(t->arg, data, n) != 0))
+                    err = TAR_ERR_CALLBACK;
+                t->remaining -= n;
+                if ((err == TAR_OK) && !t->remaining)
+                    err = end_entry(t);
+                break;
+
+            case TAR_PADDING:
+                n = min(len, t->padding);
+                t->padding -= n;
+                if (!t->padding)
+                    t->state = TAR_HEADER;
+                break;
+
+            case TAR_END:
+                // anything after the end of archive blocks is ignored, like tar does
+                return TAR_OK;
+        }
+        data += n;
+        len -= n;
+    }
+    return err;
+}
+
+tar_err_e tar_parser_finish(tar_parser_t *t)
+{
+    // tar only warns when the end of archive blocks are missing, but anything
+    // else means the archive was cut off
+    if ((t->state == TAR_END) || ((t->state == TAR_HEADER) && (t->hdr_len == 0)))
+        return TAR_OK;
+    return TAR_ERR_TRUNCATED;
+}
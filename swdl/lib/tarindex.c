@@ -0,0 +1,189 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "nImage.h"
+
+#define READ_SIZE ((size_t)1 << 20)
+
+typedef struct {
+    tar_parser_t *parser;
+    bool        is_file;        // the current entry is a regular file going in the index
+    nimg_fileidx_entry_t entry; // the current file
+    char        *path;
+    uint32_t    crc;
+
+    uint8_t     *idx;           // the index being built
+    size_t      idx_len;
+    size_t      idx_alloc;
+    uint32_t    n_files;
+} tar_index_t;
+
+static void idx_append(tar_index_t *t, const void *data, size_t len)
+{
+    if (t->idx_len + len > t->idx_alloc)
+    {
+        t->idx_alloc = max(t->idx_alloc * 2, t->idx_len + len);
+        t->idx = realloc(t->idx, t->idx_alloc);
+        assert(t->idx != NULL);
+    }
+    memcpy(t->idx + t->idx_len, data, len);
+    t->idx_len += len;
+}
+
+static int index_begin(void *arg, const tar_entry_t *e)
+{
+    tar_index_t *t = arg;
+    t->is_file = false;
+    if (e->type != '0' && e->type != '\0' && e->type != '7')
+        return 0;
+
+    // the same path newbs-swdl extracts the file to
+    free(t->path);
+    t->path = tar_clean_path(e->path);
+    if ((t->path != NULL) && (*t->path != '\0') && (strlen(t->path) <= UINT16_MAX))
+    {
+        t->is_file = true;
+        memset(&t->entry, 0, sizeof(t->entry));
+        t->entry.size = e->size;
+        t->entry.name_len = strlen(t->path);
+        t->crc = 0;
+    }
+    return 0;
+}
+
+static int index_data(void *arg, const uint8_t *data, size_t len)
+{
+    tar_index_t *t = arg;
+    if (t->is_file)
+        xcrc32(&t->crc, data, len);
+    return 0;
+}
+
+static int index_end(void *arg)
+{
+    tar_index_t *t = arg;
+    if (t->is_file)
+    {
+        t->entry.crc32 = t->crc;
+        log_debug("indexed %s (%llu bytes, CRC32 0x%08x)", t->path,
+                  (unsigned long long)t->entry.size, t->entry.crc32);
+        idx_append(t, &t->entry, sizeof(t->entry));
+        idx_append(t, t->path, t->entry.name_len);
+        t->n_files++;
+    }
+    t->is_file = false;
+    return 0;
+}
+
+// codec_output_fn for the tar archive data
+static int tar_index_feed(void *arg, const uint8_t *data, size_t len)
+{
+    tar_index_t *t = arg;
+    tar_err_e err = tar_parser_feed(t->parser, data, len);
+    if (err != TAR_OK)
+    {
+        log_error("%s", tar_err_str(err));
+        return -1;
+    }
+    return 0;
+}
+
+/* Build the file index of an indexed boot tar part from len bytes of a tar
+ * archive (compressed with comp) read from fd, see nimg_fileidx_hdr_t.
+ * On success, stores a malloc'd buffer with the whole index in *idx and its size
+ * in *idx_size, and returns 0. Returns -1 on error.
+ */
+int tar_build_fileidx(int fd, uint64_t len, nimg_comp_e comp, uint8_t **idx, size_t *idx_size)
+{
+    tar_index_t t;
+    memset(&t, 0, sizeof(t));
+    const tar_callbacks_t cb = { index_begin, index_data, index_end };
+    nimg_fileidx_hdr_t ih = { .magic = NIMG_FILEIDX_MAGIC };
+    idx_append(&t, &ih, sizeof(ih));
+
+    codec_t *dec = NULL;
+    if (comp != NIMG_COMP_NONE)
+    {
+        dec = decompressor_new(comp, tar_index_feed, &t);
+        if (dec == NULL)
+        {
+            log_error("%s support is needed to index the files in a compressed tarball", compression_name(comp));
+            free(t.idx);
+            return -1;
+        }
+    }
+    t.parser = tar_parser_new(&cb, &t);
+
+    uint8_t *buf = malloc(READ_SIZE);
+    assert(buf != NULL);
+    int ret = 0;
+    uint64_t done = 0;
+    while (ret == 0 && done < len)
+    {
+        size_t n = read_n(fd, buf, min((uint64_t)READ_SIZE, len - done));
+        if (n == 0)
+        {
+            log_error("failed to read tarball: %s", errno ? strerror(errno) : "unexpected EOF");
+            ret = -1;
+            break;
+        }
+        done += n;
+        ret = dec ? codec_update(dec, buf, n) : tar_index_feed(&t, buf, n);
+    }
+    if ((ret == 0) && dec)
+        ret = codec_finish(dec);
+    if (ret == 0)
+    {
+        tar_err_e err = tar_parser_finish(t.parser);
+        if (err != TAR_OK)
+        {
+            log_error("%s", tar_err_str(err));
+            ret = -1;
+        }
+    }
+    if ((ret == 0) && (t.idx_len > NIMG_FILEIDX_SIZE_MAX))
+    {
+        log_error("file index is too large (%zu bytes)", t.idx_len);
+        ret = -1;
+    }
+
+    if (dec)
+        codec_free(dec);
+    free(buf);
+    tar_parser_free(t.parser);
+    free(t.path);
+    if (ret != 0)
+    {
+        free(t.idx);
+        return -1;
+    }
+
+    ih.n_files = t.n_files;
+    ih.size = t.idx_len;
+    memcpy(t.idx, &ih, sizeof(ih));
+    *idx = t.idx;
+    *idx_size = t.idx_len;
+    return 0;
+}
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "mknImage.h"
@@ -35,10 +36,313 @@ void cmd_help_check(void)
     fputs(msg, stdout);
 }
 
+// compare a part's block CRCs against the block CRC table and log mismatches.
+// returns the number of bad blocks
+static uint64_t check_blocks(const uint32_t *expected, const uint32_t *actual, uint64_t n_blocks)
+{
+    uint64_t n_bad = 0;
+    for (uint64_t b = 0; b < n_blocks; b++)
+    {
+        if (actual[b] != expected[b])
+        {
+            if (n_bad == 0)
+                log_error("Block %llu CRC32 Mismatch! expected 0x%08x, got 0x%08x",
+                          (unsigned long long)b, expected[b], actual[b]);
+            n_bad++;
+        }
+    }
+    if (n_bad > 1)
+        log_error("%llu of %llu blocks have bad CRC32s",
+                  (unsigned long long)n_bad, (unsigned long long)n_blocks);
+    return n_bad;
+}
+
+// validate the extent table of a sparse part and print a summary.
+// Returns 0 if OK or -1 if the table is invalid
+static int check_sparse_part(int fd, const nimg_phdr_t *p)
+{
+    const off_t off = NIMG_HDR_SIZE + p->offset;
+    nimg_sparse_hdr_t sh;
+    if (p->size < sizeof(sh) || pread(fd, &sh, sizeof(sh), off) != sizeof(sh))
+        return -1;
+    if ((uint64_t)sh.n_extents * sizeof(nimg_extent_t) > p->size - sizeof(sh))
+        return -1;
+
+    const size_t table_size = sh.n_extents * sizeof(nimg_extent_t);
+    nimg_extent_t *extents = malloc(table_size ? table_size : 1);
+    assert(extents != NULL);
+    int ret = -1;
+    if (pread(fd, extents, table_size, off + sizeof(sh)) == (ssize_t)table_size)
+        ret = nimg_sparse_check(&sh, extents, p->size);
+    free(extents);
+
+    if (ret == 0)
+        printf("  sparse: %u extents, image size %s\n", sh.n_extents, human_bytes(sh.image_size));
+    return ret;
+}
+
+// validate the frame table of a compressed rootfs part and print a summary.
+// Returns 0 if OK or -1 if the table is invalid
+static int check_frames_part(int fd, const nimg_phdr_t *p)
+{
+    const off_t off = NIMG_HDR_SIZE + p->offset;
+    nimg_frames_hdr_t fh;
+    if (p->size < sizeof(fh) || pread(fd, &fh, sizeof(fh), off) != sizeof(fh))
+        return -1;
+    if ((uint64_t)fh.n_frames * sizeof(uint32_t) > p->size - sizeof(fh))
+        return -1;
+
+    const size_t table_size = fh.n_frames * sizeof(uint32_t);
+    uint32_t *frame_sizes = malloc(table_size ? table_size : 1);
+    assert(frame_sizes != NULL);
+    int ret = -1;
+    if (pread(fd, frame_sizes, table_size, off + sizeof(fh)) == (ssize_t)table_size)
+        ret = nimg_frames_check(&fh, frame_sizes, p->size);
+    free(frame_sizes);
+
+    if (ret == 0)
+    {
+        printf("  frames: %u of %s", fh.n_frames, human_bytes(fh.frame_size));
+        printf(", image size %s\n", human_bytes(fh.image_size));
+    }
+    return ret;
+}
+
+// validate the file index of an indexed boot tar part and print a summary.
+// Returns 0 if OK or -1 if the index is invalid
+static int check_fileidx_part(int fd, const nimg_phdr_t *p)
+{
+    const off_t off = NIMG_HDR_SIZE + p->offset;
+    nimg_fileidx_hdr_t ih;
+    if (p->size < sizeof(ih) || pread(fd, &ih, sizeof(ih), off) != sizeof(ih))
+        return -1;
+    if (ih.size < sizeof(ih) || ih.size > p->size || ih.size > NIMG_FILEIDX_SIZE_MAX)
+        return -1;
+
+    const size_t entries_size = ih.size - sizeof(ih);
+    uint8_t *entries = malloc(entries_size ? entries_size : 1);
+    assert(entries != NULL);
+    int ret = -1;
+    if (pread(fd, entries, entries_size, off + sizeof(ih)) == (ssize_t)entries_size)
+        ret = nimg_fileidx_check(&ih, entries, p->size);
+    free(entries);
+
+    if (ret == 0)
+    {
+        printf("  file index: %u files in %s", ih.n_files, human_bytes(ih.size));
+        printf(", tarball %s\n", human_bytes(p->size - ih.size));
+    }
+    return ret;
+}
+
+// validate the op table of a delta rootfs part and print a summary.
+// Returns 0 if OK or -1 if the table is invalid
+static int check_delta_part(int fd, const nimg_phdr_t *p)
+{
+    const off_t off = NIMG_HDR_SIZE + p->offset;
+    nimg_delta_hdr_t dh;
+    if (p->size < sizeof(dh) || pread(fd, &dh, sizeof(dh), off) != sizeof(dh))
+        return -1;
+    if ((uint64_t)dh.n_ops * sizeof(nimg_delta_op_t) > p->size - sizeof(dh))
+        return -1;
+
+    const size_t table_size = dh.n_ops * sizeof(nimg_delta_op_t);
+    nimg_delta_op_t *ops = malloc(table_size ? table_size : 1);
+    assert(ops != NULL);
+    int ret = -1;
+    if (pread(fd, ops, table_size, off + sizeof(dh)) == (ssize_t)table_size)
+        ret = nimg_delta_check(&dh, ops, p->size);
+    free(ops);
+
+    if (ret == 0)
+    {
+        printf("  delta: %u runs, image size %s", dh.n_ops, human_bytes(dh.image_size));
+        printf(", base size %s\n", human_bytes(dh.base_size));
+        printf("  image CRC32: 0x%08x\n", dh.image_crc32);
+    }
+    return ret;
+}
+
+// check part data by reading the image sequentially, for pipes/stdin.
+// blktab is the block CRC table (already read from fd) or NULL
+static int check_parts_stream(int fd, const nimg_hdr_t *hdr, const uint32_t *blktab, bool *nonfatal_err)
+{
+    const uint64_t bs = blktab ? nimg_block_size(hdr) : 0;
+    uint64_t parts_bytes = nimg_blktab_size(hdr);
+    for (int i = 0; i < hdr->n_parts; i++)
+    {
+        const nimg_phdr_t *p = &hdr->parts[i];
+        log_info("Part %d", i);
+        print_part_info(p, "  ", stdout);
+
+        if (p->offset < parts_bytes)
+        {
+            log_error("bad offset for part %d. offset=%llu but parts_read=%llu", i,
+                      (unsigned long long)p->offset, (unsigned long long)parts_bytes);
+            return -1;
+        }
+
+        // skip inter-image padding
+        size_t padding = p->offset - parts_bytes;
+        if (padding > 0)
+        {
+            uint32_t dummy_crc = 0;
+            if (file_copy_crc32(&dummy_crc, padding, fd, -1) != (ssize_t)padding)
+            {
+                log_error("failed to read %zu inter-image padding bytes", padding);
+                if (errno)
+                    log_error("%s", strerror(errno));
+                return -1;
+            }
+            parts_bytes += padding;
+        }
+
+        // read the part one block at a time if there are block CRCs, otherwise all at once
+        const uint64_t n_blocks = bs ? nimg_part_nblocks(hdr, p) : 1;
+        const uint64_t read_size = bs ? bs : p->size;
+        uint32_t *blkcrcs = malloc((n_blocks ? n_blocks : 1) * sizeof(uint32_t));
+        assert(blkcrcs != NULL);
+
+        uint32_t crc = 0;
+        for (uint64_t b = 0; b < n_blocks; b++)
+        {
+            const uint64_t len = min(read_size, p->size - b * read_size);
+            blkcrcs[b] = 0;
+            if (file_copy_crc32(&blkcrcs[b], (long)len, fd, -1) != (ssize_t)len)
+            {
+                log_error("failed to read image data: %s", errno ? strerror(errno) : "unexpected EOF");
+                free(blkcrcs);
+                return -1;
+            }
+            crc = xcrc32_combine(crc, blkcrcs[b], len);
+        }
+        parts_bytes += p->size;
+
+        if (bs && check_blocks(nimg_part_blkcrcs(hdr, blktab, i), blkcrcs, n_blocks))
+            *nonfatal_err = true;
+        free(blkcrcs);
+
+        if (crc != p->crc32)
+        {
+            log_error("CRC32 Mismatch! expected 0x%08x, got 0x%08x", p->crc32, crc);
+            *nonfatal_err = true;
+        }
+    }
+    return 0;
+}
+
+// check part data of a regular file by reading all parts (or all blocks of all parts)
+// in parallel with pread. Results are reported in header order, the same as check_parts_stream
+static int check_parts_seekable(int fd, const nimg_hdr_t *hdr, const uint32_t *blktab, bool *nonfatal_err)
+{
+    const uint64_t bs = blktab ? nimg_block_size(hdr) : 0;
+    uint64_t n_ranges = 0;
+    uint64_t parts_bytes = nimg_blktab_size(hdr);
+    for (int i = 0; i < hdr->n_parts; i++)
+    {
+        const nimg_phdr_t *p = &hdr->parts[i];
+        // newbs-swdl reads images as a stream, so overlapping or out-of-order
+        // parts are invalid even though we could check them here
+        if (p->offset < parts_bytes)
+        {
+            log_info("Part %d", i);
+            print_part_info(p, "  ", stdout);
+            log_error("bad offset for part %d. offset=%llu but parts_read=%llu", i,
+                      (unsigned long long)p->offset, (unsigned long long)parts_bytes);
+            return -1;
+        }
+        parts_bytes = p->offset + p->size;
+        n_ranges += bs ? nimg_part_nblocks(hdr, p) : 1;
+    }
+
+    // one range per block, or per part if there's no block table
+    crc32_range_t *ranges = calloc(n_ranges ? n_ranges : 1, sizeof(crc32_range_t));
+    assert(ranges != NULL);
+    crc32_range_t *r = ranges;
+    for (int i = 0; i < hdr->n_parts; i++)
+    {
+        const nimg_phdr_t *p = &hdr->parts[i];
+        const uint64_t range_size = bs ? bs : p->size;
+        const uint64_t n = bs ? nimg_part_nblocks(hdr, p) : 1;
+        for (uint64_t b = 0; b < n; b++, r++)
+        {
+            *r = (crc32_range_t){ .fd = fd, .offset = NIMG_HDR_SIZE + p->offset + b * range_size,
+                                  .len = min(range_size, p->size - b * range_size) };
+        }
+    }
+
+    crc32_ranges_parallel(ranges, n_ranges, n_threads);
+
+    int ret = 0;
+    uint32_t *blkcrcs = NULL;
+    r = ranges;
+    for (int i = 0; i < hdr->n_parts; i++)
+    {
+        const nimg_phdr_t *p = &hdr->parts[i];
+        log_info("Part %d", i);
+        print_part_info(p, "  ", stdout);
+
+        const uint64_t n = bs ? nimg_part_nblocks(hdr, p) : 1;
+        blkcrcs = realloc(blkcrcs, (n ? n : 1) * sizeof(uint32_t));
+        assert(blkcrcs != NULL);
+
+        uint32_t crc = 0;
+        for (uint64_t b = 0; b < n; b++, r++)
+        {
+            if (r->err)
+            {
+                log_error("failed to read image data: %s",
+                          (r->err > 0) ? strerror(r->err) : "unexpected EOF");
+                ret = -1;
+                goto out;
+            }
+            blkcrcs[b] = r->crc;
+            crc = xcrc32_combine(crc, r->crc, r->len);
+        }
+
+        if (bs && check_blocks(nimg_part_blkcrcs(hdr, blktab, i), blkcrcs, n))
+            *nonfatal_err = true;
+
+        if (crc != p->crc32)
+        {
+            log_error("CRC32 Mismatch! expected 0x%08x, got 0x%08x", p->crc32, crc);
+            *nonfatal_err = true;
+        }
+
+        // the stream check doesn't look inside of parts, only do this here
+        if (nimg_ptype_is_sparse(p->type) && check_sparse_part(fd, p) < 0)
+        {
+            log_error("Invalid sparse part extent table");
+            *nonfatal_err = true;
+        }
+        if (nimg_ptype_is_framed(p->type) && check_frames_part(fd, p) < 0)
+        {
+            log_error("Invalid compressed rootfs frame table");
+            *nonfatal_err = true;
+        }
+        if (nimg_ptype_is_delta(p->type) && check_delta_part(fd, p) < 0)
+        {
+            log_error("Invalid delta part op table");
+            *nonfatal_err = true;
+        }
+        if (nimg_ptype_is_indexed(p->type) && check_fileidx_part(fd, p) < 0)
+        {
+            log_error("Invalid boot tar file index");
+            *nonfatal_err = true;
+        }
+    }
+
+out:
+    free(blkcrcs);
+    free(ranges);
+    return ret;
+}
+
 int cmd_check(int argc, char **argv)
 {
     int ret = 1;
     bool nonfatal_err = false; // found a non-fatal error. keep checking but return failure at the end
+    uint32_t *blktab = NULL;
 
     if (argc != 2)
         DIE_USAGE("Wrong number of arguments for check");
@@ -80,6 +384,26 @@ int cmd_check(int argc, char **argv)
     if (hcheck == NIMG_HDR_CHECK_BAD_CRC)
         log_error("Header CRC32 is invalid!");
 
+    // version 3 block CRC table, which comes right after the header
+    if (nimg_block_size(&hdr))
+    {
+        blktab = malloc(hdr.blktab_size);
+        assert(blktab != NULL);
+        if (read_n(fd, blktab, hdr.blktab_size) < hdr.blktab_size)
+        {
+            log_error("Failed to read block CRC table: %s", errno ? strerror(errno) : "unexpected EOF");
+            goto out;
+        }
+        log_info("Block Size:      %s", human_bytes(nimg_block_size(&hdr)));
+        if (nimg_blktab_check(&hdr, blktab) < 0)
+        {
+            log_error("Block CRC table CRC32 is invalid! Not checking blocks");
+            nonfatal_err = true;
+            free(blktab);
+            blktab = NULL;
+        }
+    }
+
     for (int i = 0; i < hdr.n_parts; i++)
     {
         nimg_phdr_check_e pcheck = nimg_phdr_check(&hdr.parts[i], hdr.version);
@@ -94,40 +418,14 @@ int cmd_check(int argc, char **argv)
         }
     }
 
-    uint64_t parts_bytes = 0;
-    for (int i = 0; i < hdr.n_parts; i++)
-    {
-        nimg_phdr_t *p = &hdr.parts[i];
-        log_info("Part %d", i);
-        print_part_info(p, "  ", stdout);
-
-        size_t padding = p->offset - parts_bytes;
-        if (padding > 0)
-        {
-            char pbuf[padding];
-            if (read_n(fd, pbuf, padding) < padding)
-            {
-                log_error("failed to read %zu inter-image padding bytes", padding);
-                if (errno)
-                    log_error("%s", strerror(errno));
-                goto out;
-            }
-        }
-
-        uint32_t crc = 0;
-        if (file_copy_crc32(&crc, (long)p->size, fd, -1) != (ssize_t)p->size)
-        {
-            log_error("failed to read image data: %s", strerror(errno));
-            goto out;
-        }
-        parts_bytes += p->size;
-
-        if (crc != p->crc32)
-        {
-            log_error("CRC32 Mismatch! expected 0x%08x, got 0x%08x", p->crc32, crc);
-            nonfatal_err = true;
-        }
-    }
+    struct stat sb;
+    int pret;
+    if ((fstat(fd, &sb) == 0) && S_ISREG(sb.st_mode))
+        pret = check_parts_seekable(fd, &hdr, blktab, &nonfatal_err);
+    else
+        pret = check_parts_stream(fd, &hdr, blktab, &nonfatal_err);
+    if (pret < 0)
+        goto out;
 
     if (!nonfatal_err)
     {
@@ -137,6 +435,7 @@ int cmd_check(int argc, char **argv)
     else
         log_info("Image check FAILURE");
 out:
+    free(blktab);
     if (fd != -1)
         close(fd);
     return ret;
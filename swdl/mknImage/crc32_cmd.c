@@ -20,6 +20,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "mknImage.h"
@@ -58,7 +59,26 @@ int cmd_crc32(int argc, char **argv)
     }
 
     uint32_t crc = 0;
-    ssize_t count = file_copy_crc32(&crc, len, fd, -1);
+    ssize_t count;
+    struct stat sb;
+    if ((fstat(fd, &sb) == 0) && S_ISREG(sb.st_mode))
+    {
+        // regular files can be split up and checksummed in parallel
+        crc32_range_t r = { .fd = fd, .offset = 0 };
+        r.len = (len > 0) ? min((uint64_t)len, (uint64_t)sb.st_size) : (uint64_t)sb.st_size;
+        if (crc32_ranges_parallel(&r, 1, n_threads) == 0)
+        {
+            crc = r.crc;
+            count = r.len;
+        }
+        else
+        {
+            errno = (r.err > 0) ? r.err : EIO;
+            count = -1;
+        }
+    }
+    else
+        count = file_copy_crc32(&crc, len, fd, -1);
     close(fd);
 
     if (count < 0)
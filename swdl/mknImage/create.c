@@ -21,6 +21,8 @@
 #include <string.h>
 #include <assert.h>
 #include <signal.h>
+#include <libgen.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -28,18 +30,46 @@
 
 #include "mknImage.h"
 
-#define COMPRESSOR(arg0, args...) make_str_array(arg0, ##args, NULL)
-
 // padding/alignment between images
 #define PART_ALIGN 16
-static const char part_align_buf[PART_ALIGN] = {0};
+// alignment of uncompressed part data in the image file with -r
+#define REFLINK_ALIGN 4096
+static const char part_align_buf[REFLINK_ALIGN] = {0};
 
 typedef struct {
     const char   *filename;
     nimg_ptype_e type;
+    // sparse parts only, filled in by map_sparse_extents
+    nimg_extent_t *extents;
+    uint32_t     n_extents;
+    uint64_t     image_size;
+    // indexed boot tar parts only, filled in by build_fileidx
+    uint8_t      *fileidx;
+    size_t       fileidx_size;
+    // delta rootfs parts only, filled in by build_delta
+    nimg_delta_hdr_t delta;
+    nimg_delta_op_t  *delta_ops;
 } fileinfo_t;
 
+// a part compressed ahead of time into a temporary spool file
+typedef struct {
+    const fileinfo_t *file;
+    nimg_comp_e comp;
+    int         spool_fd;
+    uint32_t    crc;
+    size_t      size;   // compressed size
+    bool        failed;
+} spool_job_t;
+
+typedef struct {
+    spool_job_t *jobs;
+    int         n_jobs;
+    int         next;   // next job index, updated atomically
+    int         part_threads; // threads for compressing each part
+} spool_queue_t;
+
 static const char *img_filename = NULL;
+static const char *delta_base = NULL;
 static fileinfo_t *files = NULL;
 static int img_fd = -1;
 static bool create_success = false;
@@ -48,17 +78,42 @@ void cmd_help_create(void)
 {
     static const char msg[] =
         "    Create an nImage.\n"
-        "    usage: mknImage create -o IMAGE_FILE [-a] [-n NAME] TYPE1:FILE1 [TYPE2:FILE2]...\n"
+        "    usage: mknImage create -o IMAGE_FILE [-a [-p]] [-r] [-B SIZE] [-d BASE] [-n NAME] TYPE1:FILE1 [TYPE2:FILE2]...\n"
         "      -o FILE: Output image file (must be a seekable file, not a pipe like stdout)\n"
         "      -a       Automatically compress boot_img_* parts.\n"
         "               This option applies globally to all parts of the appropriate type.\n"
+        "      -p       With -a, compress all parts at the same time into temporary files\n"
+        "               in the same directory as IMAGE_FILE, then assemble the image.\n"
+        "               The mknImage -j option limits how many parts are compressed at once.\n"
+        "      -r       Align uncompressed parts to %d bytes in IMAGE_FILE, so that their\n"
+        "               data can be shared with the input files (reflinked) on filesystems\n"
+        "               which support it, like btrfs and xfs.\n"
+        "      -B SIZE  Create a version 3 image with a table of CRC32s for every SIZE\n"
+        "               bytes of each part, so that corruption is detected early. SIZE is\n"
+        "               a power of 2 between 4K and 1G, a K, M, or G suffix is allowed.\n"
+        "               Without -B, a version 2 image is created unless a part type\n"
+        "               requires version 3.\n"
+        "      -d BASE  Rootfs image which rootfs_delta parts are based on. This must be\n"
+        "               the image in the active rootfs bank of the devices being updated.\n"
         "      -n NAME: Name to embed in the image header (max %d chars)\n"
         "      TYPEn:   Image type\n"
         "      FILEn:   Input partition data filename\n"
+        "    The *_sparse rootfs types only store the data regions (not holes) of\n"
+        "    FILE, newbs-swdl zeros the rest. Use e.g. `fallocate --dig-holes FILE`\n"
+        "    first if FILE isn't already sparse. These types need a version 3 image.\n"
+        "    The compressed rootfs types (rootfs_gz, rootfs_rw_xz, etc.) take an\n"
+        "    uncompressed FILE, which is always compressed (regardless of -a) as\n"
+        "    independent %s frames so newbs-swdl can decompress it on all CPUs.\n"
+        "    The *_idx boot tar types store an index of the CRC32 of every file in\n"
+        "    the tarball before it, so newbs-swdl only writes files that changed.\n"
+        "    These types need a version 3 image.\n"
+        "    The rootfs_delta type only stores the %u byte blocks of FILE which aren't\n"
+        "    in BASE (-d), newbs-swdl copies the rest from the active rootfs bank.\n"
+        "    It needs a version 3 image.\n"
         "    Valid image types are:\n"
         "      "
     "";
-    printf(msg, NIMG_NAME_LEN);
+    printf(msg, REFLINK_ALIGN, NIMG_NAME_LEN, human_bytes(NIMG_FRAME_SIZE_DEFAULT), NIMG_DELTA_BLOCK_SIZE_DEFAULT);
     for (int i = 1; i < NIMG_PTYPE_COUNT; i++)
         printf("%s%c", nimg_ptype_names[i], (i == NIMG_PTYPE_COUNT-1) ? '\n' : ' ');
 }
@@ -131,16 +186,421 @@ static int init_fileinfo(fileinfo_t *f, const char *arg)
 
     f->type = type;
     f->filename = arg + colon_pos + 1;
+    f->extents = NULL;
+    f->n_extents = 0;
+    f->image_size = 0;
+    f->fileidx = NULL;
+    f->fileidx_size = 0;
+    memset(&f->delta, 0, sizeof(f->delta));
+    f->delta_ops = NULL;
     return 0;
 }
 
+// find the data regions of a sparse input file using SEEK_DATA/SEEK_HOLE.
+// If the filesystem doesn't support that, the whole file is one extent
+static void map_sparse_extents(fileinfo_t *f)
+{
+    int fd = open(f->filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        DIE_ERRNO("failed to open '%s' for reading", f->filename);
+    struct stat sb;
+    if (fstat(fd, &sb) < 0)
+        DIE_ERRNO("failed to stat '%s'", f->filename);
+    f->image_size = sb.st_size;
+
+    size_t alloc = 16;
+    f->extents = malloc(alloc * sizeof(nimg_extent_t));
+    assert(f->extents != NULL);
+    f->n_extents = 0;
+
+    off_t pos = 0;
+    while (pos < sb.st_size)
+    {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data == (off_t)-1)
+        {
+            if (errno == ENXIO) // only a hole after pos
+                break;
+            if (pos == 0 && (errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                log_warn("'%s': SEEK_DATA not supported, storing the whole file", f->filename);
+                f->extents[0] = (nimg_extent_t){ .offset = 0, .len = sb.st_size };
+                f->n_extents = 1;
+                break;
+            }
+            DIE_ERRNO("SEEK_DATA failed on '%s'", f->filename);
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == (off_t)-1)
+            DIE_ERRNO("SEEK_HOLE failed on '%s'", f->filename);
+
+        if (f->n_extents == UINT32_MAX)
+            DIE("too many extents in '%s'", f->filename);
+        if (f->n_extents == alloc)
+        {
+            alloc *= 2;
+            f->extents = realloc(f->extents, alloc * sizeof(nimg_extent_t));
+            assert(f->extents != NULL);
+        }
+        f->extents[f->n_extents++] = (nimg_extent_t){ .offset = data, .len = hole - data };
+        pos = hole;
+    }
+    close(fd);
+
+    uint64_t data_size = 0;
+    for (uint32_t i = 0; i < f->n_extents; i++)
+        data_size += f->extents[i].len;
+    log_info("%s: %s of data in %u extents", f->filename, human_bytes(data_size), f->n_extents);
+}
+
+// index the files of an indexed boot tar part, see nimg_fileidx_hdr_t
+static void build_fileidx(fileinfo_t *f)
+{
+    int fd = open(f->filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        DIE_ERRNO("failed to open '%s' for reading", f->filename);
+    struct stat sb;
+    if (fstat(fd, &sb) < 0)
+        DIE_ERRNO("failed to stat '%s'", f->filename);
+    if (tar_build_fileidx(fd, sb.st_size, boot_tar_compression(f->type), &f->fileidx, &f->fileidx_size) != 0)
+        DIE("failed to index the files in '%s'", f->filename); // error already logged
+    close(fd);
+
+    const nimg_fileidx_hdr_t *ih = (const nimg_fileidx_hdr_t*)f->fileidx;
+    log_info("%s: indexed %u files", f->filename, ih->n_files);
+}
+
+// compute the runs of a delta rootfs part, see nimg_delta_hdr_t
+static void build_delta(fileinfo_t *f)
+{
+    int base_fd = open(delta_base, O_RDONLY | O_CLOEXEC);
+    if (base_fd == -1)
+        DIE_ERRNO("failed to open '%s' for reading", delta_base);
+    int fd = open(f->filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        DIE_ERRNO("failed to open '%s' for reading", f->filename);
+    if (delta_build(base_fd, fd, NIMG_DELTA_BLOCK_SIZE_DEFAULT, &f->delta, &f->delta_ops) != 0)
+        DIE("failed to compute delta from '%s' to '%s'", delta_base, f->filename); // error already logged
+    close(fd);
+    close(base_fd);
+
+    uint64_t stored = 0, block = 0;
+    for (uint32_t i = 0; i < f->delta.n_ops; i++)
+    {
+        if (f->delta_ops[i].src_offset == NIMG_DELTA_STORED)
+            stored += nimg_delta_op_len(&f->delta, block, f->delta_ops[i].n_blocks);
+        block += f->delta_ops[i].n_blocks;
+    }
+    log_info("%s: %s changed from '%s' (%llu of %llu bytes, in %u runs)", f->filename, human_bytes(stored),
+             delta_base, (unsigned long long)stored, (unsigned long long)f->delta.image_size, f->delta.n_ops);
+}
+
+// size of a delta part in the image: the header, the op table, and the stored runs
+static uint64_t delta_part_size(const fileinfo_t *f)
+{
+    uint64_t size = sizeof(nimg_delta_hdr_t) + (uint64_t)f->delta.n_ops * sizeof(nimg_delta_op_t);
+    uint64_t block = 0;
+    for (uint32_t i = 0; i < f->delta.n_ops; i++)
+    {
+        if (f->delta_ops[i].src_offset == NIMG_DELTA_STORED)
+            size += nimg_delta_op_len(&f->delta, block, f->delta_ops[i].n_blocks);
+        block += f->delta_ops[i].n_blocks;
+    }
+    return size;
+}
+
+/* Write a delta part to the image, i.e. the delta header, op table, and then the
+ * data of each stored run. Returns the full image size like file_copy_crc32
+ * returns the number of bytes copied, or a negative number on error.
+ */
+static ssize_t write_delta_part(uint32_t *crc, const fileinfo_t *f, int part_fd, size_t *part_size)
+{
+    const size_t table_size = sizeof(nimg_delta_hdr_t) + (size_t)f->delta.n_ops * sizeof(nimg_delta_op_t);
+    uint8_t *table = malloc(table_size);
+    assert(table != NULL);
+    memcpy(table, &f->delta, sizeof(f->delta));
+    memcpy(table + sizeof(f->delta), f->delta_ops, f->delta.n_ops * sizeof(nimg_delta_op_t));
+
+    xcrc32(crc, table, table_size);
+    ssize_t written = write(img_fd, table, table_size);
+    free(table);
+    if (written != (ssize_t)table_size)
+        return -2;
+
+    *part_size = table_size;
+    uint64_t block = 0;
+    for (uint32_t i = 0; i < f->delta.n_ops; i++)
+    {
+        const nimg_delta_op_t *op = &f->delta_ops[i];
+        const uint64_t len = nimg_delta_op_len(&f->delta, block, op->n_blocks);
+        if (op->src_offset == NIMG_DELTA_STORED)
+        {
+            if (lseek(part_fd, block * f->delta.block_size, SEEK_SET) == (off_t)-1)
+                return -1;
+            ssize_t count = file_copy_crc32_zerocopy(crc, len, part_fd, img_fd, n_threads);
+            if (count != (ssize_t)len)
+                return (count < 0) ? count : -1;
+            *part_size += len;
+        }
+        block += op->n_blocks;
+    }
+    return f->delta.image_size;
+}
+
+// size of a sparse part in the image: the header, the extent table, and the extent data
+static uint64_t sparse_part_size(const fileinfo_t *f)
+{
+    uint64_t size = sizeof(nimg_sparse_hdr_t) + (uint64_t)f->n_extents * sizeof(nimg_extent_t);
+    for (uint32_t i = 0; i < f->n_extents; i++)
+        size += f->extents[i].len;
+    return size;
+}
+
+/* Write a sparse part to the image, i.e. the sparse header, extent table, and
+ * then the data of each extent. Returns the full image size like file_copy_crc32
+ * returns the number of bytes copied, or a negative number on error.
+ */
+static ssize_t write_sparse_part(uint32_t *crc, const fileinfo_t *f, int part_fd, size_t *part_size)
+{
+    const size_t table_size = sizeof(nimg_sparse_hdr_t) + (size_t)f->n_extents * sizeof(nimg_extent_t);
+    uint8_t *table = malloc(table_size);
+    assert(table != NULL);
+    nimg_sparse_hdr_t sh = { .magic = NIMG_SPARSE_MAGIC, .image_size = f->image_size,
+                             .n_extents = f->n_extents, .unused = 0 };
+    memcpy(table, &sh, sizeof(sh));
+    memcpy(table + sizeof(sh), f->extents, f->n_extents * sizeof(nimg_extent_t));
+
+    xcrc32(crc, table, table_size);
+    ssize_t written = write(img_fd, table, table_size);
+    free(table);
+    if (written != (ssize_t)table_size)
+        return -2;
+
+    *part_size = table_size;
+    for (uint32_t i = 0; i < f->n_extents; i++)
+    {
+        const nimg_extent_t *e = &f->extents[i];
+        if (lseek(part_fd, e->offset, SEEK_SET) == (off_t)-1)
+            return -1;
+        ssize_t count = file_copy_crc32_zerocopy(crc, e->len, part_fd, img_fd, n_threads);
+        if (count != (ssize_t)e->len)
+            return (count < 0) ? count : -1;
+        *part_size += e->len;
+    }
+    return f->image_size;
+}
+
+// how a part will be compressed. boot_img_* parts are only compressed with -a,
+// compressed rootfs parts always are because the input is a raw filesystem
+static nimg_comp_e part_comp(const fileinfo_t *f, bool auto_compress)
+{
+    if (auto_compress || nimg_ptype_is_framed(f->type))
+        return part_compression(f->type);
+    return NIMG_COMP_NONE;
+}
+
+// compress a part to fd_out, in frames on up to part_threads threads for compressed rootfs parts
+static ssize_t compress_part(uint32_t *crc, const fileinfo_t *f, ssize_t len, int fd_in, int fd_out,
+                             nimg_comp_e comp, int part_threads, size_t *compressed_size)
+{
+    if (nimg_ptype_is_framed(f->type))
+        return file_copy_crc32_frames(crc, len, fd_in, fd_out, comp, NIMG_FRAME_SIZE_DEFAULT,
+                                      part_threads, compressed_size);
+    return file_copy_crc32_compress(crc, len, fd_in, fd_out, comp, compressed_size);
+}
+
+// open an anonymous temporary file in the same directory as the image
+static int open_spool_file(void)
+{
+    char *dirbuf = strdup(img_filename);
+    assert(dirbuf != NULL);
+    const char *dir = dirname(dirbuf);
+
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL))
+    {
+        // no O_TMPFILE support, use a named file and unlink it right away
+        char *tmpl = NULL;
+        if (asprintf(&tmpl, "%s/.mknImage-spool.XXXXXX", dir) < 0)
+            tmpl = NULL;
+        assert(tmpl != NULL);
+        fd = mkostemp(tmpl, O_CLOEXEC);
+        if (fd != -1)
+            unlink(tmpl);
+        free(tmpl);
+    }
+    if (fd == -1)
+        log_error("failed to create spool file in %s: %s", dir, strerror(errno));
+    free(dirbuf);
+    return fd;
+}
+
+static void* spool_worker(void *arg)
+{
+    spool_queue_t *q = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->n_jobs)
+    {
+        spool_job_t *job = &q->jobs[i];
+        job->failed = true;
+
+        int part_fd = open(job->file->filename, O_RDONLY | O_CLOEXEC);
+        if (part_fd == -1)
+        {
+            log_error("failed to open '%s' for reading: %s", job->file->filename, strerror(errno));
+            continue;
+        }
+        struct stat sb;
+        if (fstat(part_fd, &sb) < 0)
+        {
+            log_error("failed to stat '%s': %s", job->file->filename, strerror(errno));
+            close(part_fd);
+            continue;
+        }
+
+        job->spool_fd = open_spool_file();
+        if (job->spool_fd != -1)
+        {
+            log_info("Compressing %s with %s", job->file->filename, compression_name(job->comp));
+            job->crc = 0;
+            ssize_t count = compress_part(&job->crc, job->file, sb.st_size, part_fd, job->spool_fd,
+                                          job->comp, q->part_threads, &job->size);
+            if (count == sb.st_size)
+                job->failed = false;
+            else
+                log_error("failed to compress '%s'", job->file->filename);
+        }
+        close(part_fd);
+    }
+    return NULL;
+}
+
+/* Compress all parts which need it at the same time, up to n_workers at once.
+ * The -j thread budget is split between them rather than each one using every CPU.
+ * Returns an array of jobs, one per part, with comp == NIMG_COMP_NONE for
+ * parts which aren't compressed. Dies if anything fails.
+ */
+static spool_job_t* spool_compressed_parts(int n_parts, int n_workers, bool auto_compress)
+{
+    spool_job_t *jobs = calloc(n_parts, sizeof(spool_job_t));
+    spool_queue_t q = { .jobs = calloc(n_parts, sizeof(spool_job_t)), .n_jobs = 0, .next = 0 };
+    assert(jobs != NULL && q.jobs != NULL);
+
+    for (int i = 0; i < n_parts; i++)
+    {
+        jobs[i].file = &files[i];
+        jobs[i].comp = part_comp(&files[i], auto_compress);
+        jobs[i].spool_fd = -1;
+        if (jobs[i].comp != NIMG_COMP_NONE)
+            q.jobs[q.n_jobs++] = jobs[i];
+    }
+
+    if (n_workers <= 0)
+        n_workers = crc32_default_threads();
+    n_workers = min(n_workers, q.n_jobs);
+    const int budget = (n_threads > 0) ? n_threads : crc32_default_threads();
+    q.part_threads = max(budget / max(n_workers, 1), 1);
+    compressor_set_limits(q.part_threads, n_workers);
+    if (n_workers > 1)
+        log_debug("compressing %d parts at once with %d threads each", n_workers, q.part_threads);
+    pthread_t threads[n_workers > 0 ? n_workers : 1];
+    int started = 0;
+    for (; started < n_workers; started++)
+    {
+        int err = pthread_create(&threads[started], NULL, spool_worker, &q);
+        if (err != 0)
+        {
+            log_warn("failed to start compression thread: %s", strerror(err));
+            break;
+        }
+    }
+    if (started == 0)
+        spool_worker(&q);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    compressor_set_limits(n_threads, 1);
+
+    bool failed = false;
+    for (int i = 0, j = 0; i < n_parts; i++)
+    {
+        if (jobs[i].comp != NIMG_COMP_NONE)
+        {
+            jobs[i] = q.jobs[j++];
+            failed |= jobs[i].failed;
+        }
+    }
+    free(q.jobs);
+    if (failed)
+        DIE("failed to compress image parts");
+    return jobs;
+}
+
+/* Fill in the version 3 block CRC table by reading back the finished image
+ * data, and double check that the blocks add up to each part's CRC.
+ * The table and its CRC are written just after the image header.
+ */
+static void write_blktab(const nimg_hdr_t *hdr)
+{
+    const uint64_t bs = nimg_block_size(hdr);
+    const size_t n_entries = hdr->blktab_size / sizeof(uint32_t);
+    const size_t n_blocks = n_entries - 1;
+
+    crc32_range_t *ranges = calloc(n_blocks ? n_blocks : 1, sizeof(crc32_range_t));
+    uint32_t *blktab = malloc(hdr->blktab_size);
+    assert(ranges != NULL && blktab != NULL);
+
+    size_t b = 0;
+    for (int i = 0; i < hdr->n_parts; i++)
+    {
+        const nimg_phdr_t *p = &hdr->parts[i];
+        for (uint64_t off = 0; off < p->size; off += bs, b++)
+        {
+            ranges[b] = (crc32_range_t){ .fd = img_fd, .offset = NIMG_HDR_SIZE + p->offset + off,
+                                         .len = min(bs, p->size - off) };
+        }
+    }
+    assert(b == n_blocks);
+
+    log_info("Computing CRCs of %zu %s blocks", n_blocks, human_bytes(bs));
+    if (crc32_ranges_parallel(ranges, n_blocks, n_threads) < 0)
+        DIE("failed to read back image data for block CRCs");
+
+    b = 0;
+    for (int i = 0; i < hdr->n_parts; i++)
+    {
+        const nimg_phdr_t *p = &hdr->parts[i];
+        uint32_t crc = 0;
+        for (uint64_t off = 0; off < p->size; off += bs, b++)
+        {
+            blktab[b] = ranges[b].crc;
+            crc = xcrc32_combine(crc, ranges[b].crc, ranges[b].len);
+        }
+        if (crc != p->crc32)
+            DIE("part %d data changed while creating the image (CRC 0x%08x, expected 0x%08x)",
+                i, crc, p->crc32);
+    }
+
+    uint32_t tab_crc = 0;
+    xcrc32(&tab_crc, (const uint8_t*)blktab, n_blocks * sizeof(uint32_t));
+    blktab[n_blocks] = tab_crc;
+
+    if (pwrite(img_fd, blktab, hdr->blktab_size, NIMG_HDR_SIZE) != (ssize_t)hdr->blktab_size)
+        DIE_ERRNO("failed to write block CRC table");
+
+    free(ranges);
+    free(blktab);
+}
+
 int cmd_create(int argc, char **argv)
 {
     bool auto_compress = false;
+    bool parallel = false;
+    bool reflink = false;
+    uint8_t blk_shift = 0;
     char *img_name = NULL;
     int opt;
     optind = 1; // reset getopt state after main options parsing
-    while ((opt = getopt(argc, argv, "o:an:")) != -1)
+    while ((opt = getopt(argc, argv, "o:aprB:d:n:")) != -1)
     {
         switch (opt)
         {
@@ -150,6 +610,25 @@ int cmd_create(int argc, char **argv)
             case 'a':
                 auto_compress = true;
                 break;
+            case 'p':
+                parallel = true;
+                break;
+            case 'r':
+                reflink = true;
+                break;
+            case 'B':
+            {
+                uint64_t bs;
+                if (check_strtosize(optarg, &bs) < 0 || bs == 0 || (bs & (bs - 1)) != 0)
+                    DIE_USAGE("invalid block size '%s'", optarg);
+                blk_shift = __builtin_ctzll(bs);
+                if (blk_shift < NIMG_BLK_SHIFT_MIN || blk_shift > NIMG_BLK_SHIFT_MAX)
+                    DIE_USAGE("block size must be between %s and %s", "4K", "1G");
+                break;
+            }
+            case 'd':
+                delta_base = optarg;
+                break;
             case 'n':
                 if (strlen(optarg) > NIMG_NAME_LEN)
                     DIE_USAGE("image name too long");
@@ -178,13 +657,21 @@ int cmd_create(int argc, char **argv)
     files = malloc(argc * sizeof(fileinfo_t));
     assert(files != NULL);
 
+    uint8_t version = blk_shift ? 3 : NIMG_HDR_VERSION_COMPAT;
     for (int i = 0; i < argc; i++)
+    {
         if (init_fileinfo(&files[i], argv[i]) < 0)
             return 1;
+        if (nimg_ptype_is_delta(files[i].type) && delta_base == NULL)
+            DIE_USAGE("create: %s parts need a base image (-d)", part_name_from_type(files[i].type));
+        version = max(version, nimg_ptype_version(files[i].type));
+    }
 
     nimg_hdr_t hdr;
     nimg_hdr_init(&hdr);
     hdr.n_parts = argc;
+    hdr.version = version;
+    hdr.blk_shift = blk_shift;
 
     // this strncpy may leave hdr.name without a null terminator, but that's OK
     // (since we always know the max size, a null terminator isn't necessary in
@@ -203,7 +690,16 @@ int cmd_create(int argc, char **argv)
     if (img_name != NULL)
         log_info("Image name is '%s'", img_name);
 
-    img_fd = open(img_filename, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    for (int i = 0; i < argc; i++)
+        if (nimg_ptype_is_sparse(files[i].type))
+            map_sparse_extents(&files[i]);
+        else if (nimg_ptype_is_indexed(files[i].type))
+            build_fileidx(&files[i]);
+        else if (nimg_ptype_is_delta(files[i].type))
+            build_delta(&files[i]);
+
+    // O_RDWR so that block CRCs can be read back from the image
+    img_fd = open(img_filename, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
     if (img_fd == -1)
         DIE_ERRNO("unable to open '%s' for writing", img_filename);
     register_cleanup();
@@ -214,7 +710,41 @@ int cmd_create(int argc, char **argv)
         DIE_ERRNO("failed to write blank image header");
     free(dummy_hdr);
 
+    // the block CRC table comes before the part data, so its size (and therefore
+    // the compressed size of each part) has to be known before writing any parts
+    spool_job_t *spool = NULL;
+    if (parallel || blk_shift)
+        spool = spool_compressed_parts(argc, parallel ? n_threads : 1, auto_compress);
+
     uint64_t parts_bytes = 0;
+    if (blk_shift)
+    {
+        for (int i = 0; i < argc; i++)
+        {
+            struct stat sb;
+            if (stat(files[i].filename, &sb) < 0)
+                DIE_ERRNO("failed to stat '%s'", files[i].filename);
+            if (spool && spool[i].comp != NIMG_COMP_NONE)
+                hdr.parts[i].size = spool[i].size;
+            else if (nimg_ptype_is_sparse(files[i].type))
+                hdr.parts[i].size = sparse_part_size(&files[i]);
+            else if (nimg_ptype_is_delta(files[i].type))
+                hdr.parts[i].size = delta_part_size(&files[i]);
+            else
+                hdr.parts[i].size = files[i].fileidx_size + sb.st_size;
+        }
+        uint64_t blktab_size = nimg_blktab_size(&hdr);
+        if (blktab_size > UINT32_MAX)
+            DIE("block CRC table is too large, use a bigger block size");
+        hdr.blktab_size = blktab_size;
+
+        // leave space for the table, it's filled in by write_blktab at the end
+        parts_bytes = blktab_size + (PART_ALIGN - (blktab_size % PART_ALIGN)) % PART_ALIGN;
+        if (lseek(img_fd, parts_bytes, SEEK_CUR) == (off_t)-1)
+            DIE_ERRNO("failed to seek past block CRC table");
+        log_debug("reserved %u bytes for the block CRC table", hdr.blktab_size);
+    }
+
     const size_t buf_size = 8192;
     uint8_t *buf = malloc(buf_size);
     assert(buf != NULL);
@@ -228,43 +758,70 @@ int cmd_create(int argc, char **argv)
         if (part_fd == -1)
             DIE_ERRNO("failed to open '%s' for reading", files[i].filename);
 
-        const char **compressor = NULL;
-        if (auto_compress)
-        {
-            switch (files[i].type)
-            {
-                case NIMG_PTYPE_BOOT_IMG_GZ:
-                    compressor = COMPRESSOR("gzip");
-                    break;
-                case NIMG_PTYPE_BOOT_IMG_XZ:
-                    compressor = COMPRESSOR("xz", "-T0");
-                    break;
-                case NIMG_PTYPE_BOOT_IMG_ZSTD:
-                    compressor = COMPRESSOR("zstd", "-15", "-T0");
-                    break;
-                default:
-                    break; // suppress enum not handled in switch warning
-            }
-        }
+        nimg_comp_e comp = part_comp(&files[i], auto_compress);
 
         uint32_t crc = 0;
         size_t part_size = 0;
         ssize_t count;
-        if (compressor != NULL)
+        if (spool != NULL && comp != NIMG_COMP_NONE)
+        {
+            // already compressed, copy from the spool file and double check the CRC
+            log_info("Adding compressed part type %s", part_name_from_type(files[i].type));
+            part_size = spool[i].size;
+            if (lseek(spool[i].spool_fd, 0, SEEK_SET) == (off_t)-1)
+                DIE_ERRNO("failed to seek spool file");
+            if (file_copy_crc32_zerocopy(&crc, part_size, spool[i].spool_fd, img_fd, n_threads) != (ssize_t)part_size)
+                DIE_ERRNO("failed to copy spooled part data for '%s'", files[i].filename);
+            if (crc != spool[i].crc)
+                DIE("spool file CRC mismatch for '%s'", files[i].filename);
+            close(spool[i].spool_fd);
+            count = sb.st_size;
+        }
+        else if (comp != NIMG_COMP_NONE)
         {
             log_info("Compressing part type %s", part_name_from_type(files[i].type));
-            count = file_copy_crc32_compress(&crc, sb.st_size, part_fd, img_fd, compressor, &part_size);
-            free(compressor);
+            count = compress_part(&crc, &files[i], sb.st_size, part_fd, img_fd, comp, n_threads, &part_size);
+        }
+        else if (nimg_ptype_is_sparse(files[i].type))
+        {
+            if (sb.st_size != (off_t)files[i].image_size)
+                DIE("'%s' changed size while creating the image", files[i].filename);
+            count = write_sparse_part(&crc, &files[i], part_fd, &part_size);
+        }
+        else if (nimg_ptype_is_delta(files[i].type))
+        {
+            if (sb.st_size != (off_t)files[i].delta.image_size)
+                DIE("'%s' changed size while creating the image", files[i].filename);
+            count = write_delta_part(&crc, &files[i], part_fd, &part_size);
+        }
+        else if (nimg_ptype_is_indexed(files[i].type))
+        {
+            // the index, then the tarball as-is
+            xcrc32(&crc, files[i].fileidx, files[i].fileidx_size);
+            if (write(img_fd, files[i].fileidx, files[i].fileidx_size) != (ssize_t)files[i].fileidx_size)
+                DIE_ERRNO("failed to write file index for '%s'", files[i].filename);
+            count = file_copy_crc32_zerocopy(&crc, sb.st_size, part_fd, img_fd, n_threads);
+            part_size = files[i].fileidx_size + sb.st_size;
         }
         else
         {
-            count = file_copy_crc32(&crc, sb.st_size, part_fd, img_fd);
+            if (reflink)
+            {
+                unsigned int padding = (REFLINK_ALIGN - ((NIMG_HDR_SIZE + parts_bytes) % REFLINK_ALIGN)) % REFLINK_ALIGN;
+                log_debug("adding %u bytes of padding for reflink alignment", padding);
+                if (write(img_fd, part_align_buf, padding) != (ssize_t)padding)
+                    DIE_ERRNO("failed to write %u padding bytes between images", padding);
+                parts_bytes += padding;
+            }
+            count = file_copy_crc32_zerocopy(&crc, sb.st_size, part_fd, img_fd, n_threads);
             part_size = sb.st_size;
         }
         close(part_fd);
         if (count != sb.st_size)
         {
-            if (count < 0)
+            if (count < 0 && comp != NIMG_COMP_NONE)
+                DIE("failed to compress '%s'", files[i].filename); // error already logged
+            else if (count < 0)
                 DIE_ERRNO("failed to read from '%s'", files[i].filename);
             else
                 DIE("expected to read %zu bytes but got only %zu from '%s'",
@@ -284,7 +841,7 @@ int cmd_create(int argc, char **argv)
         }
 
         parts_bytes += part_size;
-        unsigned int padding = (16 - (parts_bytes % 16)) % 16;
+        unsigned int padding = (PART_ALIGN - (parts_bytes % PART_ALIGN)) % PART_ALIGN;
         log_debug("adding %u bytes of padding", padding);
         if (padding > 0)
         {
@@ -294,7 +851,23 @@ int cmd_create(int argc, char **argv)
         }
     }
     free(buf);
+    free(spool);
+    for (int i = 0; i < argc; i++)
+    {
+        free(files[i].extents);
+        free(files[i].fileidx);
+        free(files[i].delta_ops);
+    }
+    // cleanup() frees files too if anything below fails
     free(files);
+    files = NULL;
+
+    if (blk_shift)
+    {
+        if (nimg_blktab_size(&hdr) != hdr.blktab_size)
+            DIE("part sizes changed while creating the image");
+        write_blktab(&hdr);
+    }
 
     // compute header CRC
     // use a temp variable rather than passing &hdr.hdr_crc32 to suppress
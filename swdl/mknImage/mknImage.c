@@ -29,6 +29,8 @@
 
 static const DECLARE_CMD_TABLE(cmd_table);
 
+int n_threads = 0;
+
 static const char usage_text[] =
     "usage: mknImage [OPTIONS] COMMAND [ARGUMENTS]\n"
     "\n"
@@ -37,6 +39,7 @@ static const char usage_text[] =
     " -V  Show program version\n"
     " -D  Enable verbose debug outpus\n"
     " -q  Be more quiet\n"
+    " -j N  Use N threads for checksumming (default is one per CPU)\n"
 "";
 
 static void print_version(void)
@@ -71,7 +74,7 @@ int main(int argc, char *argv[])
     // start the optstring with + to disable automatic argument re-ordering,
     // getopt stops as soon as it finds a non-option argument so that
     // commands can take options too.
-    while ((opt = getopt(argc, argv, "+hVDq")) != -1)
+    while ((opt = getopt(argc, argv, "+hVDqj:")) != -1)
     {
         switch (opt)
         {
@@ -89,6 +92,14 @@ int main(int argc, char *argv[])
             case 'q':
                 log_level = LOG_LEVEL_ERROR;
                 break;
+            case 'j':
+            {
+                long n;
+                if ((check_strtol(optarg, 0, &n) < 0) || (n <= 0) || (n > 1024))
+                    DIE_USAGE("invalid thread count '%s'", optarg);
+                n_threads = (int)n;
+                break;
+            }
             default:
                 DIE_USAGE("unknown option '%c'", opt);
                 break;
@@ -104,6 +115,7 @@ int main(int argc, char *argv[])
 
     argc -= optind;
     argv += optind;
+    log_debug("using %s crc32 implementation", xcrc32_impl_name());
 
     const cmd_t *cmd = find_cmd(argv[0]);
     if (cmd == NULL)
@@ -20,6 +20,9 @@
 
 #include "nImage.h"
 
+// number of worker threads from the -j option, 0 means one per CPU
+extern int n_threads;
+
 typedef struct {
     const char    *name;
     int(*handler)(int argc, char **argv);
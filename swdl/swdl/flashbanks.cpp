@@ -51,6 +51,15 @@ static int get_inactive_bank(const stringvec& cmdline)
     return (active + 1) % N_BANKS;
 }
 
+string get_active_dev(const stringvec& cmdline)
+{
+    int bank = get_active_bank(cmdline);
+    if (bank == -1)
+        return string();
+    log_debug("active dev is %s", rootfs_devs[bank]);
+    return string(rootfs_devs[bank]);
+}
+
 string get_inactive_dev(const stringvec& cmdline)
 {
     int bank = get_inactive_bank(cmdline);
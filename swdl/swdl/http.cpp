@@ -0,0 +1,595 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+// Minimal built-in HTTP/1.1 client, so that images can be downloaded without
+// forking curl and copying everything through a pipe. Only plain http:// is
+// supported, https and anything fancy still goes through curl.
+
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <errno.h>
+#include <netdb.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "newbs-swdl.h"
+
+#define HTTP_MAX_REDIRECTS  10
+#define HTTP_MAX_RETRIES    3
+#define HTTP_TIMEOUT_SEC    30
+#define HTTP_BUF_SIZE       ((size_t)64 * 1024)
+#define HTTP_SKIP_MIN       ((uint64_t)1024 * 1024) // use a range request to skip at least this much
+
+struct Url
+{
+    string host;
+    string port = "80";
+    string path = "/";
+    string userinfo;
+};
+
+static Url parse_url(const string& url)
+{
+    const string scheme = "http://";
+    if (url.compare(0, scheme.length(), scheme))
+        throw PError("unsupported URL for the built-in HTTP client: %s", url.c_str());
+
+    Url u;
+    string rest = url.substr(scheme.length());
+    size_t slash = rest.find('/');
+    string authority = rest.substr(0, slash);
+    if (slash != string::npos)
+        u.path = rest.substr(slash);
+
+    size_t at = authority.rfind('@');
+    if (at != string::npos)
+    {
+        u.userinfo = authority.substr(0, at);
+        authority = authority.substr(at + 1);
+    }
+
+    // [v6addr]:port or host:port
+    size_t colon = authority.rfind(':');
+    if (authority[0] == '[')
+    {
+        size_t close = authority.find(']');
+        if (close == string::npos)
+            throw PError("invalid URL: %s", url.c_str());
+        u.host = authority.substr(1, close - 1);
+        if (colon != string::npos && colon > close)
+            u.port = authority.substr(colon + 1);
+    }
+    else if (colon != string::npos)
+    {
+        u.host = authority.substr(0, colon);
+        u.port = authority.substr(colon + 1);
+    }
+    else
+        u.host = authority;
+
+    if (u.host.empty() || u.port.empty())
+        throw PError("invalid URL: %s", url.c_str());
+    return u;
+}
+
+static string base64(const string& in)
+{
+    static const char tbl[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string out;
+    for (size_t i = 0; i < in.length(); i += 3)
+    {
+        uint32_t v = (uint8_t)in[i] << 16;
+        if (i + 1 < in.length()) v |= (uint8_t)in[i+1] << 8;
+        if (i + 2 < in.length()) v |= (uint8_t)in[i+2];
+        out += tbl[(v >> 18) & 63];
+        out += tbl[(v >> 12) & 63];
+        out += (i + 1 < in.length()) ? tbl[(v >> 6) & 63] : '=';
+        out += (i + 2 < in.length()) ? tbl[v & 63] : '=';
+    }
+    return out;
+}
+
+// look up host in a .netrc file, like curl --netrc. Returns "login:password" or ""
+static string netrc_lookup(const string& host)
+{
+    string filename = g_opts.curl_netrc;
+    if (filename.empty())
+    {
+        const char *home = getenv("HOME");
+        if (home == NULL)
+            return string();
+        filename = string(home) + "/.netrc";
+    }
+
+    std::ifstream ifs(filename);
+    if (ifs.fail())
+        return string();
+    std::istream_iterator<string> it(ifs), end;
+    stringvec words(it, end);
+
+    bool match = false;
+    string login, password;
+    for (size_t i = 0; i < words.size(); i++)
+    {
+        if (words[i] == "machine" || words[i] == "default")
+        {
+            if (match)
+                break; // done with the matching entry
+            match = (words[i] == "default") || (i + 1 < words.size() && words[++i] == host);
+        }
+        else if (match && words[i] == "login" && i + 1 < words.size())
+            login = words[++i];
+        else if (match && words[i] == "password" && i + 1 < words.size())
+            password = words[++i];
+    }
+    if (!match || login.empty())
+        return string();
+    return login + ":" + password;
+}
+
+// thrown for failures which are worth retrying (connection problems, 5xx errors)
+class RetryableError : public PError
+{
+    public:
+        explicit RetryableError(const PError& e) : PError(e) {}
+};
+
+// thrown for a redirect to something other than plain http, e.g. https
+class UnsupportedRedirect : public PError
+{
+    public:
+        explicit UnsupportedRedirect(const string& location_)
+            : PError("redirected to %s, which the built-in HTTP client doesn't support", location_.c_str()),
+              location(location_) {}
+        string location;
+};
+
+// the absolute URL for a Location header of a response to a request for u
+static string resolve_location(const Url& u, const string& host, const string& location)
+{
+    // absolute, with a scheme
+    size_t scheme_end = location.find("://");
+    if (scheme_end != string::npos && scheme_end > 0 &&
+        location.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+-.") == scheme_end)
+        return location;
+    if (!location.compare(0, 2, "//"))
+        return "http:" + location;
+    if (location[0] == '/')
+        return "http://" + host + location;
+
+    // relative to the request path: replace its query, or its last segment
+    string path = u.path.substr(0, u.path.find('?'));
+    if (location[0] != '?')
+        path.erase(path.rfind('/') + 1);
+    return "http://" + host + path + location;
+}
+
+static int tcp_connect(const string& host, const string& port)
+{
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    int gai = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (gai != 0)
+        throw PError("failed to resolve %s: %s", host.c_str(), gai_strerror(gai));
+
+    int fd = -1, err = 0;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1)
+        {
+            err = errno;
+            continue;
+        }
+        // a stalled connection is an error rather than hanging forever
+        struct timeval tv = { .tv_sec = HTTP_TIMEOUT_SEC, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        err = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1)
+        throw RetryableError(PError("failed to connect to %s port %s: %s", host.c_str(), port.c_str(), strerror(err)));
+    return fd;
+}
+
+static double elapsed_sec(const struct timespec& start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+class HttpSource : public ImageSource
+{
+    private:
+        int fd = -1;
+        string url;
+        vector<char> buf = vector<char>(HTTP_BUF_SIZE);
+        size_t buf_pos = 0, buf_len = 0;    // buffered data which hasn't been consumed yet
+
+        bool chunked = false;
+        bool has_length = false;
+        uint64_t remaining = 0;             // of the body with Content-Length, or of the current chunk
+        bool eof = false;
+        bool ranged = false;                // the response is for a range request
+        uint64_t range_end = 0;             // for streams of part of the image, the offset where it ends
+        uint64_t pos = 0;                   // offset in the image of the next byte returned by read()
+        uint64_t total = 0;                 // bytes received, for the download speed
+        struct timespec start;
+
+        // read into the internal buffer, returns 0 on EOF
+        size_t fill(void)
+        {
+            if (buf_pos == buf_len)
+                buf_pos = buf_len = 0;
+            if (buf_len == buf.size())
+                throw PError("HTTP response line too long");
+            ssize_t n;
+            do { n = ::read(fd, buf.data() + buf_len, buf.size() - buf_len); } while (n < 0 && errno == EINTR);
+            if (n < 0)
+                throw RetryableError(PError("HTTP read failed: %s", (errno == EAGAIN) ? "timed out" : strerror(errno)));
+            buf_len += n;
+            return n;
+        }
+
+        // read a CRLF (or LF) terminated line, without the line ending
+        string read_line(void)
+        {
+            while (true)
+            {
+                char *start = buf.data() + buf_pos;
+                char *nl = static_cast<char*>(memchr(start, '\n', buf_len - buf_pos));
+                if (nl != NULL)
+                {
+                    string line(start, nl - start);
+                    buf_pos += nl - start + 1;
+                    if (!line.empty() && line.back() == '\r')
+                        line.pop_back();
+                    return line;
+                }
+                if (buf_pos > 0)
+                {
+                    // shift the partial line to the start of the buffer
+                    memmove(buf.data(), start, buf_len - buf_pos);
+                    buf_len -= buf_pos;
+                    buf_pos = 0;
+                }
+                if (fill() == 0)
+                    throw RetryableError(PError("HTTP connection closed unexpectedly"));
+            }
+        }
+
+        // read body data, from the buffer first and then directly from the socket
+        size_t raw_read(void *dst, size_t count)
+        {
+            if (buf_pos < buf_len)
+            {
+                size_t n = min(count, buf_len - buf_pos);
+                memcpy(dst, buf.data() + buf_pos, n);
+                buf_pos += n;
+                return n;
+            }
+            ssize_t n;
+            do { n = ::read(fd, dst, count); } while (n < 0 && errno == EINTR);
+            if (n < 0)
+                throw RetryableError(PError("HTTP read failed: %s", (errno == EAGAIN) ? "timed out" : strerror(errno)));
+            return n;
+        }
+
+        void disconnect(void)
+        {
+            if (fd != -1)
+                close(fd);
+            fd = -1;
+            buf_pos = buf_len = 0;
+        }
+
+        // send the request and read the response headers, asking for the data
+        // starting at offset from. Returns the redirect location for 3xx responses,
+        // or an empty string when the body is ready to read
+        string request(const string& req_url, uint64_t from)
+        {
+            Url u = parse_url(req_url);
+            disconnect();
+            fd = tcp_connect(u.host, u.port);
+
+            string host = (u.host.find(':') != string::npos) ? "[" + u.host + "]" : u.host;
+            if (u.port != "80")
+                host += ":" + u.port;
+            string req = "GET " + u.path + " HTTP/1.1\r\n"
+                         "Host: " + host + "\r\n"
+                         "User-Agent: newbs-swdl/" PACKAGE_VERSION "\r\n"
+                         "Accept-Encoding: identity\r\n"
+                         "Connection: close\r\n";
+            // like curl without --location-trusted, -u credentials are only sent to the
+            // host and port of the original URL, not to wherever it redirects
+            string auth;
+            if (!g_opts.curl_username.empty())
+            {
+                const Url orig = parse_url(url);
+                if (u.host == orig.host && u.port == orig.port)
+                    auth = g_opts.curl_username;
+            }
+            else
+                auth = !u.userinfo.empty() ? u.userinfo : netrc_lookup(u.host);
+            if (!auth.empty())
+                req += "Authorization: Basic " + base64(auth) + "\r\n";
+            if (from > 0 || range_end)
+                req += "Range: bytes=" + std::to_string(from) + "-" +
+                       (range_end ? std::to_string(range_end - 1) : string()) + "\r\n";
+            req += "\r\n";
+
+            for (size_t sent = 0; sent < req.length(); )
+            {
+                ssize_t n = send(fd, req.data() + sent, req.length() - sent, MSG_NOSIGNAL);
+                if (n <= 0)
+                    throw RetryableError(PError("failed to send HTTP request: %s", strerror(errno)));
+                sent += n;
+            }
+
+            // status line, e.g. "HTTP/1.1 200 OK"
+            string line = read_line();
+            int status = 0;
+            if (sscanf(line.c_str(), "HTTP/%*d.%*d %d", &status) != 1)
+                throw PError("invalid HTTP status line '%s'", line.c_str());
+
+            string location, content_range;
+            chunked = false;
+            has_length = false;
+            eof = false;
+            while (!(line = read_line()).empty())
+            {
+                size_t colon = line.find(':');
+                if (colon == string::npos)
+                    continue;
+                string name = line.substr(0, colon);
+                size_t vstart = line.find_first_not_of(" \t", colon + 1);
+                string value = (vstart == string::npos) ? string() : line.substr(vstart);
+                if (!strcasecmp(name.c_str(), "Content-Length"))
+                {
+                    has_length = true;
+                    remaining = strtoull(value.c_str(), NULL, 10);
+                }
+                else if (!strcasecmp(name.c_str(), "Transfer-Encoding") && !strcasecmp(value.c_str(), "chunked"))
+                    chunked = true;
+                else if (!strcasecmp(name.c_str(), "Location"))
+                    location = value;
+                else if (!strcasecmp(name.c_str(), "Content-Range"))
+                    content_range = value;
+            }
+            if (chunked)
+            {
+                has_length = false;
+                remaining = 0;
+            }
+
+            log_info("HTTP %d from %s%s", status, u.host.c_str(), u.path.c_str());
+            if (status >= 300 && status < 400 && !location.empty())
+            {
+                location = resolve_location(u, host, location);
+                if (location.compare(0, strlen("http://"), "http://"))
+                    throw UnsupportedRedirect(location);
+                return location;
+            }
+            if (status >= 500 || status == 408 || status == 429)
+                throw RetryableError(PError("HTTP request failed with status %d", status));
+            if (status < 200 || status >= 300)
+                throw PError("HTTP request failed with status %d", status);
+
+            ranged = (status == 206);
+            if (ranged)
+            {
+                // e.g. "bytes 1000-1999/2000", make sure we got what we asked for
+                unsigned long long range_start;
+                if (sscanf(content_range.c_str(), "bytes %llu-", &range_start) != 1 || range_start != from)
+                    throw PError("unexpected HTTP Content-Range '%s'", content_range.c_str());
+            }
+            if (has_length && from == 0)
+                log_info("image download size is %s", human_bytes(remaining));
+            return string();
+        }
+
+        // (re)connect and position the body at offset from, following redirects
+        // and retrying temporary failures
+        void connect_at(uint64_t from)
+        {
+            for (int attempt = 0; ; attempt++)
+            {
+                try
+                {
+                    string next = url;
+                    int redirects = 0;
+                    while (!(next = request(next, from)).empty())
+                    {
+                        if (++redirects > HTTP_MAX_REDIRECTS)
+                            throw PError("too many HTTP redirects");
+                        log_info("redirected to %s", next.c_str());
+                    }
+                    break;
+                }
+                catch (RetryableError& e)
+                {
+                    if (attempt == HTTP_MAX_RETRIES)
+                    {
+                        disconnect();
+                        throw;
+                    }
+                    log_warn("%s, retrying in %d seconds (%d/%d)", e.what(), 1 << attempt,
+                             attempt + 1, HTTP_MAX_RETRIES);
+                    sleep(1 << attempt);
+                }
+                catch (exception&)
+                {
+                    disconnect();
+                    throw;
+                }
+            }
+
+            if (range_end && !ranged)
+                throw PError("HTTP server doesn't support range requests");
+            if (from > 0 && !ranged)
+            {
+                log_warn("server doesn't support range requests, skipping %llu bytes", (unsigned long long)from);
+                uint8_t tmp[65536];
+                for (uint64_t left = from; left > 0; )
+                {
+                    size_t n = body_read(tmp, min(sizeof(tmp), left));
+                    if (n == 0)
+                        throw PError("HTTP response ended before offset %llu", (unsigned long long)from);
+                    left -= n;
+                }
+            }
+        }
+
+        // read from the response body, handling chunked encoding. Returns 0 at the end
+        size_t body_read(void *dst, size_t count)
+        {
+            if (eof || count == 0)
+                return 0;
+
+            if (chunked && remaining == 0)
+            {
+                // chunk header: size in hex, maybe followed by extensions
+                string line = read_line();
+                if (line.empty()) // CRLF after the previous chunk's data
+                    line = read_line();
+                remaining = strtoull(line.c_str(), NULL, 16);
+                if (remaining == 0)
+                {
+                    while (!read_line().empty())
+                        ; // skip trailers
+                    eof = true;
+                    return 0;
+                }
+            }
+
+            if (has_length || chunked)
+            {
+                if (remaining == 0)
+                {
+                    eof = true;
+                    return 0;
+                }
+                count = min(count, remaining);
+            }
+
+            size_t n = raw_read(dst, count);
+            if (n == 0)
+            {
+                if (has_length || chunked)
+                    throw RetryableError(PError("HTTP connection closed after %llu bytes",
+                                                (unsigned long long)pos));
+                eof = true;
+            }
+            if (has_length || chunked)
+                remaining -= n;
+            total += n;
+            return n;
+        }
+
+    public:
+        // download the whole image, or only the data between from and end
+        HttpSource(const string& url_, uint64_t from = 0, uint64_t end = 0)
+            : url(url_), range_end(end), pos(from)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            connect_at(from);
+        }
+
+        ~HttpSource(void) { disconnect(); }
+
+        // read data, resuming with a range request if the connection drops
+        virtual size_t read(void *dst, size_t count)
+        {
+            for (int failures = 0; ; failures++)
+            {
+                try
+                {
+                    size_t n = body_read(dst, count);
+                    pos += n;
+                    return n;
+                }
+                catch (RetryableError& e)
+                {
+                    if (failures == HTTP_MAX_RETRIES)
+                        throw;
+                    log_warn("%s, resuming download at byte %llu in %d seconds (%d/%d)", e.what(),
+                             (unsigned long long)pos, 1 << failures, failures + 1, HTTP_MAX_RETRIES);
+                    disconnect();
+                    sleep(1 << failures);
+                    connect_at(pos);
+                }
+            }
+        }
+
+        // large skips are done with a range request rather than downloading everything
+        virtual void skip(uint64_t count)
+        {
+            if (count < HTTP_SKIP_MIN || eof)
+            {
+                ImageSource::skip(count);
+                return;
+            }
+            log_info("skipping %s of the image", human_bytes(count));
+            disconnect();
+            connect_at(pos + count);
+            pos += count;
+        }
+
+        virtual std::unique_ptr<ImageSource> open_range(uint64_t offset, uint64_t len)
+        {
+            return std::unique_ptr<ImageSource>(new HttpSource(url, pos + offset, pos + offset + len));
+        }
+
+        virtual void finish(void)
+        {
+            disconnect();
+            double sec = elapsed_sec(start);
+            log_info("downloaded %s in %.1f seconds", human_bytes(total), sec);
+            if (sec > 0)
+                log_info("average download speed %s/s", human_bytes((size_t)(total / sec)));
+        }
+};
+
+std::unique_ptr<ImageSource> open_http(const string& url)
+{
+    log_info("Flashing image '%s' (built-in HTTP client)", url.c_str());
+    try { return std::unique_ptr<ImageSource>(new HttpSource(url)); }
+    catch (UnsupportedRedirect& e)
+    {
+        // nothing has been read yet, so curl can start over and follow the redirect itself
+        log_info("redirected to %s, downloading with curl instead", e.location.c_str());
+        return std::unique_ptr<ImageSource>();
+    }
+}
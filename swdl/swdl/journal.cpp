@@ -0,0 +1,146 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#include <cstddef>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "newbs-swdl.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a4c445753ULL /* "SWDLJRNL" */
+
+typedef struct __attribute__((packed)) {
+    uint64_t magic;
+    uint32_t hdr_crc;   // hdr_crc32 of the image being downloaded
+    uint32_t dev_crc;   // CRC32 of the inactive rootfs device name
+    uint32_t part;      // index of the part in progress, all parts before it are done
+    uint32_t crc;       // CRC32 of the first offset bytes of the part
+    uint64_t offset;    // bytes of the part which have been written and synced
+    uint32_t unused;
+    uint32_t jcrc;      // CRC32 of everything above
+} journal_data_t;
+static_assert(sizeof(journal_data_t) == 40, "wrong size for journal_data_t");
+
+static uint32_t string_crc(const string& s)
+{
+    uint32_t crc = 0;
+    xcrc32(&crc, reinterpret_cast<const uint8_t*>(s.data()), s.length());
+    return crc;
+}
+
+Journal::Journal(const string& path_, const nimg_hdr_t& hdr, const string& dev)
+    : path(path_), hdr_crc(hdr.hdr_crc32), dev_crc(string_crc(dev))
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        if (errno != ENOENT)
+            log_warn("failed to open journal %s: %s", path.c_str(), strerror(errno));
+        return;
+    }
+
+    journal_data_t j;
+    ssize_t n = read_n(fd, &j, sizeof(j));
+    close(fd);
+
+    uint32_t crc = 0;
+    xcrc32(&crc, reinterpret_cast<const uint8_t*>(&j), offsetof(journal_data_t, jcrc));
+    if (n != sizeof(j) || j.magic != JOURNAL_MAGIC || j.jcrc != crc)
+        log_warn("ignoring invalid journal %s", path.c_str());
+    else if (j.hdr_crc != hdr_crc || j.dev_crc != dev_crc)
+        log_info("journal %s is for a different image or device, starting from the beginning", path.c_str());
+    else if (j.part > hdr.n_parts || (j.part == hdr.n_parts ? j.offset : j.offset > hdr.parts[j.part].size))
+        log_warn("ignoring journal %s with an invalid position", path.c_str());
+    else
+    {
+        resume_part = j.part;
+        resume_offset = j.offset;
+        resume_crc = j.crc;
+        if (resume_part == hdr.n_parts)
+            log_info("all parts were already programmed by an interrupted download");
+        else
+            log_info("resuming interrupted download at part %d, offset %s",
+                     resume_part, human_bytes(resume_offset));
+    }
+}
+
+void Journal::write(int part, uint64_t offset, uint32_t crc)
+{
+    journal_data_t j = {
+        .magic = JOURNAL_MAGIC,
+        .hdr_crc = hdr_crc,
+        .dev_crc = dev_crc,
+        .part = (uint32_t)part,
+        .crc = crc,
+        .offset = offset,
+        .unused = 0,
+        .jcrc = 0,
+    };
+    uint32_t jcrc = 0;
+    xcrc32(&jcrc, reinterpret_cast<const uint8_t*>(&j), offsetof(journal_data_t, jcrc));
+    j.jcrc = jcrc;
+
+    // write a new file and rename it, so there's always a complete journal on disk
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        THROW_ERRNO("failed to create journal %s", tmp.c_str());
+    bool ok = (::write(fd, &j, sizeof(j)) == sizeof(j)) && (fsync(fd) == 0);
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+        THROW_ERRNO("failed to write journal %s", path.c_str());
+    log_debug("journal: part %d offset %llu crc 0x%08x", part, (unsigned long long)offset, crc);
+}
+
+bool Journal::part_done(int part) const
+{
+    return part < resume_part;
+}
+
+void Journal::resume_point(uint64_t *offset, uint32_t *crc) const
+{
+    *offset = 0;
+    *crc = 0;
+    if (current_part == resume_part)
+    {
+        *offset = resume_offset;
+        *crc = resume_crc;
+    }
+}
+
+void Journal::begin_part(int part)
+{
+    uint64_t offset;
+    uint32_t crc;
+    current_part = part;
+    resume_point(&offset, &crc);
+    write(part, offset, crc);
+}
+
+void Journal::checkpoint(uint64_t offset, uint32_t crc)
+{
+    write(current_part, offset, crc);
+}
+
+void Journal::remove(void)
+{
+    if (unlink(path.c_str()) != 0 && errno != ENOENT)
+        log_warn("failed to remove journal %s: %s", path.c_str(), strerror(errno));
+}
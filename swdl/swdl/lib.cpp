@@ -29,6 +29,8 @@
 #include <fcntl.h>
 #include <mntent.h>
 #include <limits.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -106,28 +108,14 @@ void do_exec(const vector<const char*>& args)
     _exit(99);
 }
 
-CPipe open_curl(const string& url_)
+CPipe open_curl(const string& url)
 {
-    string url;
-
-    if (url_ == "-")
+    if (url == "-")
     {
         log_info("reading image from stdin");
         return { .pid = -1, .fd = STDIN_FILENO, .running = false };
     }
 
-    struct stat sb;
-    if ((stat(url_.c_str(), &sb) == 0) && ((sb.st_mode & S_IFMT) != S_IFDIR))
-    {
-        log_debug("using local file %s", url_.c_str());
-        char *fullpath = realpath(url_.c_str(), NULL);
-        if (fullpath == NULL)
-            THROW_ERRNO("Failed to expand local file path %s", url_.c_str());
-        url = string("file://") + fullpath;
-        free(fullpath);
-    }
-    else url = url_;
-
     log_info("Flashing image '%s'", url.c_str());
 
     // opening some sort of URI, open a pipe and fork off to curl
@@ -209,26 +197,282 @@ void cpipe_wait(CPipe& cp, bool block)
     }
 }
 
-// read from a forked child process, then check if it exited using cpipe_wait.
-// continues reading from the pipe after exit, cpipe_wait will throw an exception
-// if the process exits non-zero or was killed by a signal.
-size_t cpipe_read(CPipe& cp, void *buf, size_t count)
+void ImageSource::read_full(void *buf, size_t count)
+{
+    size_t done = 0;
+    while (done < count)
+    {
+        size_t nread = read(static_cast<uint8_t*>(buf) + done, count - done);
+        if (nread == 0)
+            THROW_ERROR("image ended after reading only %zu/%zu bytes", done, count);
+        done += nread;
+    }
+}
+
+void ImageSource::skip(uint64_t count)
 {
-    size_t nread = 0;
-    if ((cp.fd != -1) && (count != 0))
+    uint8_t buf[65536];
+    while (count > 0)
     {
-        nread = read_n(cp.fd, buf, count);
-        if (nread < count)
+        size_t n = min(sizeof(buf), count);
+        read_full(buf, n);
+        count -= n;
+    }
+}
+
+// how much of a local image is read before dropping it from the page cache
+static const uint64_t drop_behind_step = 8 << 20;
+
+// image data read from stdin or the pipe of a forked curl process.
+// Errors reported by curl are only seen in finish(), when cpipe_wait checks
+// its exit status.
+class PipeSource : public ImageSource
+{
+    private:
+        CPipe cp;
+        bool is_file = false;   // stdin redirected from a file
+        uint64_t pos = 0, drop_pos = 0;
+
+        // like FileSource, don't leave a file we only read once in the page cache
+        void drop_behind(bool all)
         {
-            close(cp.fd);
-            cp.fd = -1;
-            if (errno)
+            if (is_file && pos > drop_pos && (all || pos - drop_pos >= drop_behind_step))
+            {
+                posix_fadvise(cp.fd, drop_pos, pos - drop_pos, POSIX_FADV_DONTNEED);
+                drop_pos = pos;
+            }
+        }
+
+    public:
+        PipeSource(const CPipe& cp_) : cp(cp_)
+        {
+            struct stat sb;
+            off_t off;
+            if (fstat(cp.fd, &sb) == 0 && S_ISREG(sb.st_mode) && (off = lseek(cp.fd, 0, SEEK_CUR)) != (off_t)-1)
+            {
+                is_file = true;
+                pos = drop_pos = off;
+                posix_fadvise(cp.fd, pos, 0, POSIX_FADV_SEQUENTIAL);
+            }
+        }
+
+        ~PipeSource(void)
+        {
+            if (cp.fd != -1)
+            {
+                drop_behind(true);
+                close(cp.fd);
+            }
+        }
+
+        virtual size_t read(void *buf, size_t count)
+        {
+            if (cp.fd == -1)
+                return 0;
+            ssize_t nread;
+            do { nread = ::read(cp.fd, buf, count); } while (nread < 0 && errno == EINTR);
+            if (nread < 0)
                 THROW_ERRNO("read error on pipe");
-            else
-                THROW_ERROR("pipe closed after reading only %zd/%zu bytes", nread, count);
+            pos += nread;
+            drop_behind(false);
+            return nread;
+        }
+
+        virtual void skip(uint64_t count)
+        {
+            // stdin may be a file, which can be seeked over
+            off_t off;
+            if (cp.fd != -1 && (off = lseek(cp.fd, count, SEEK_CUR)) != (off_t)-1)
+            {
+                pos = off;
+                return;
+            }
+            ImageSource::skip(count);
+        }
+
+        virtual void finish(void)
+        {
+            drop_behind(true);
+            if (cp.fd != -1)
+                close(cp.fd);
+            cp.fd = -1;
+            cpipe_wait(cp, true);
+        }
+
+        virtual void abort(void)
+        {
+            if (cp.running)
+                kill(cp.pid, SIGTERM);
+            if (cp.fd != -1)
+                close(cp.fd);
+            cp.fd = -1;
+            // we killed curl, so don't complain about how it exited
+            try { cpipe_wait(cp, true); }
+            catch (exception&) { /* no-op */ }
         }
+};
+
+// image data read directly from a local file or block device (e.g. a USB stick).
+// Data is read with pread straight into the caller's buffers, and the kernel is
+// asked to read ahead of the current position so that the disk stays busy.
+// Data behind the read position is dropped from the page cache, the image is
+// only read once and shouldn't push out other processes' cached files.
+class FileSource : public ImageSource
+{
+    private:
+        // how far ahead of the read position to ask for readahead, and how often
+        static const uint64_t readahead_size = 16 << 20;
+        static const uint64_t readahead_step = 4 << 20;
+
+        const string path;
+        int fd = -1;
+        uint64_t pos;       // current read position in the file
+        uint64_t end;       // end of the readable data, the file size or the end of a range
+        uint64_t ra_pos;    // readahead has been requested up to here
+        uint64_t drop_pos;  // dropped from the page cache up to here
+
+        void drop_behind(bool all)
+        {
+            if (pos > drop_pos && (all || pos - drop_pos >= drop_behind_step))
+            {
+                posix_fadvise(fd, drop_pos, pos - drop_pos, POSIX_FADV_DONTNEED);
+                drop_pos = pos;
+            }
+        }
+
+        // bytes of the file from pos to end which are in the page cache, 0 if unknown
+        uint64_t cached_bytes(void)
+        {
+            const long page = sysconf(_SC_PAGESIZE);
+            const uint64_t start = pos - pos % page;
+            if (end <= start)
+                return 0;
+            void *map = mmap(NULL, end - start, PROT_READ, MAP_SHARED, fd, start);
+            if (map == MAP_FAILED)
+                return 0;
+            vector<unsigned char> vec((end - start + page - 1) / page);
+            uint64_t n = 0;
+            if (mincore(map, end - start, vec.data()) == 0)
+                for (unsigned char v : vec)
+                    n += v & 1;
+            munmap(map, end - start);
+            return n * page;
+        }
+
+        void do_readahead(void)
+        {
+            if (ra_pos >= end || ra_pos >= pos + readahead_size - readahead_step)
+                return;
+            uint64_t ra_end = min(end, pos + readahead_size);
+            // only a hint, errors don't matter
+            readahead(fd, ra_pos, ra_end - ra_pos);
+            ra_pos = ra_end;
+        }
+
+    public:
+        // read the file at path from offset up to end. If end is 0, read until the end of the file
+        FileSource(const string& path_, uint64_t offset = 0, uint64_t end_ = 0)
+            : path(path_), pos(offset), end(end_), ra_pos(offset), drop_pos(offset)
+        {
+            fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+                THROW_ERRNO("failed to open %s", path.c_str());
+
+            if (!end)
+            {
+                // st_size is 0 for block devices, seek to the end to find their size
+                off_t size = lseek(fd, 0, SEEK_END);
+                if (size == (off_t)-1)
+                {
+                    int err = errno;
+                    close(fd);
+                    errno = err;
+                    THROW_ERRNO("failed to get the size of %s", path.c_str());
+                }
+                end = size;
+            }
+            cached_at_open = cached_bytes();
+            posix_fadvise(fd, pos, end - pos, POSIX_FADV_SEQUENTIAL);
+        }
+
+        ~FileSource(void)
+        {
+            if (fd != -1)
+            {
+                drop_behind(true);
+                close(fd);
+            }
+        }
+
+        virtual size_t read(void *buf, size_t count)
+        {
+            if (pos >= end)
+                return 0;
+            do_readahead();
+            count = min((uint64_t)count, end - pos);
+            ssize_t nread;
+            do { nread = pread(fd, buf, count, pos); } while (nread < 0 && errno == EINTR);
+            if (nread < 0)
+                THROW_ERRNO("read error on %s", path.c_str());
+            pos += nread;
+            drop_behind(false);
+            return nread;
+        }
+
+        virtual void skip(uint64_t count)
+        {
+            if (count > end - pos)
+                THROW_ERROR("image ended while skipping %llu bytes", (unsigned long long)count);
+            pos += count;
+            ra_pos = max(ra_pos, pos);
+        }
+
+        virtual std::unique_ptr<ImageSource> open_range(uint64_t offset, uint64_t len)
+        {
+            if (offset + len > end - pos)
+                THROW_ERROR("range past the end of %s", path.c_str());
+            return std::unique_ptr<ImageSource>(new FileSource(path, pos + offset, pos + offset + len));
+        }
+};
+
+// open the image at url, which may be "-" for stdin, a local file, or a URL.
+// Local files are read directly. Plain http:// URLs are downloaded by the built-in
+// HTTP client unless -E or any custom curl options were given, everything else is
+// handed to curl.
+std::unique_ptr<ImageSource> open_image(const string& url)
+{
+    struct stat sb;
+    if (url != "-" && (stat(url.c_str(), &sb) == 0) && ((sb.st_mode & S_IFMT) != S_IFDIR))
+    {
+        log_info("Flashing image from local file '%s'", url.c_str());
+        return std::unique_ptr<ImageSource>(new FileSource(url));
+    }
+    if (!g_opts.use_curl && g_opts.curl_opts.empty() && !url.compare(0, strlen("http://"), "http://"))
+    {
+        std::unique_ptr<ImageSource> src = open_http(url);
+        if (src)
+            return src;
     }
-    return nread;
+    return std::unique_ptr<ImageSource>(new PipeSource(open_curl(url)));
+}
+
+// size of the page cache (file data and block device buffers) from /proc/meminfo,
+// or 0 if it's not available
+uint64_t page_cache_size(void)
+{
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (fp == NULL)
+        return 0;
+    char line[256];
+    uint64_t total = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        unsigned long long kb;
+        if (sscanf(line, "Cached: %llu kB", &kb) == 1 || sscanf(line, "Buffers: %llu kB", &kb) == 1)
+            total += kb * 1024;
+    }
+    fclose(fp);
+    return total;
 }
 
 // put the first found mount entry info into *ment, returns whether a mount was found.
@@ -47,13 +47,41 @@ static void usage(const char *arg0)
         "  -r   Flip rootfs bank an reboot after download.\n"
         "  -T   Do not flip rootfs bank or reboot.\n"
         "\n"
+        "Programming options:\n"
+        "  -s   Skip unchanged data. Read back raw parts (rootfs, boot_img) from the\n"
+        "       target device and only write the blocks which are different.\n"
+        "       Useful when re-flashing after an interrupted update.\n"
+        "  -v   Verify. Read back rootfs and boot_img parts from the device after\n"
+        "       writing them, bypassing the cache, and check their CRC32. Checking\n"
+        "       a part overlaps with programming the next one.\n"
+        "  -j JOURNAL  Record download progress in the file JOURNAL. If the download\n"
+        "       is interrupted, running again with the same image and JOURNAL\n"
+        "       resumes it, skipping finished parts and continuing raw parts\n"
+        "       from the last checkpoint. JOURNAL is removed after success.\n"
+        "  -L RATE  Limit downloading and writing to RATE bytes per second, with an\n"
+        "       optional K/M/G suffix (e.g. -L 10M).\n"
+        "  -B   Background mode, for updating while the system is busy. Runs with\n"
+        "       idle I/O priority and nice 19, and slows down writes whenever the\n"
+        "       device's write latency goes up. Can be combined with -L.\n"
+        "  -o ROOTFS_DEV[,BOOT_DEV]  Write the image to other devices instead of\n"
+        "       this system's rootfs bank and boot device, e.g. to flash SD cards.\n"
+        "       Can be used multiple times to write several devices at once from\n"
+        "       one download. BOOT_DEV is needed if the image has a boot_img part.\n"
+        "       A device which fails is dropped and the others carry on. Implies -T,\n"
+        "       can't be used with -s, -j or -P, or for delta and boot_tar parts.\n"
+        "\n"
         "Image download options:\n"
         "  -n[NETRC]    Use .netrc for authentication (default).\n"
         "               This translates to curl's --netrc or --netrc-file option\n"
         "               depending on wheter an argument is present\n"
         "  -u USER:PASS username/password (passed directly to curl)\n"
         "  -C OPTION    Pass OPTION directly to curl, no splitting is done.\n"
-        "               This can be used multiple times.\n"
+        "               This can be used multiple times, and implies -E.\n"
+        "  -E           Download http:// URLs with curl rather than the built-in\n"
+        "               HTTP client. Other URLs always use curl.\n"
+        "  -P N         Download large raw parts (rootfs) over N connections at\n"
+        "               once. Needs the built-in HTTP client and a server which\n"
+        "               supports range requests. Default 1.\n"
         "\n"
         "Debug/Test Options:\n"
         "  -b   boot device node (used for debugging, probably a loop device.\n"
@@ -66,10 +94,19 @@ static void usage(const char *arg0)
     printf(msg, progname);
 }
 
+// the directory containing path
+static string dirname_of(const string& path)
+{
+    size_t slash = path.rfind('/');
+    if (slash == string::npos)
+        return ".";
+    return (slash == 0) ? "/" : path.substr(0, slash);
+}
+
 int main(int argc, char *argv[])
 {
     int opt;
-    while ((opt = getopt(argc, argv, "hVDqtrTn::u:C:b:c:")) != -1)
+    while ((opt = getopt(argc, argv, "hVDqtrTsvEj:L:Bo:n::u:C:P:b:c:")) != -1)
     {
         switch (opt)
         {
@@ -94,6 +131,48 @@ int main(int argc, char *argv[])
             case 'T':
                 g_opts.success_action = SwdlOptions::NO_FLIP;
                 break;
+            case 's':
+                g_opts.skip_unchanged = true;
+                break;
+            case 'v':
+                g_opts.verify = true;
+                break;
+            case 'E':
+                g_opts.use_curl = true;
+                break;
+            case 'j':
+                g_opts.journal = optarg;
+                break;
+            case 'L':
+            {
+                uint64_t rate;
+                if ((check_strtosize(optarg, &rate) < 0) || (rate == 0))
+                {
+                    log_error("Invalid rate limit '%s'", optarg);
+                    return 2;
+                }
+                g_opts.rate_limit = rate;
+                break;
+            }
+            case 'B':
+                g_opts.background = true;
+                break;
+            case 'o':
+            {
+                string arg = optarg;
+                size_t comma = arg.find(',');
+                SwdlOptions::TargetDevs t;
+                t.rootfs = arg.substr(0, comma);
+                if (comma != string::npos)
+                    t.boot = arg.substr(comma + 1);
+                if (t.rootfs.empty() || (comma != string::npos && t.boot.empty()))
+                {
+                    log_error("Invalid target devices '%s'", optarg);
+                    return 2;
+                }
+                g_opts.targets.push_back(t);
+                break;
+            }
             case 'n':
                 if (optarg)
                     g_opts.curl_netrc = optarg;
@@ -104,6 +183,17 @@ int main(int argc, char *argv[])
             case 'C':
                 g_opts.curl_opts.push_back(optarg);
                 break;
+            case 'P':
+            {
+                long n;
+                if ((check_strtol(optarg, 0, &n) < 0) || (n <= 0) || (n > 64))
+                {
+                    log_error("Invalid number of connections '%s'", optarg);
+                    return 2;
+                }
+                g_opts.connections = n;
+                break;
+            }
             case 'b':
 #ifdef SWDL_TEST
                 if (strncmp(optarg, "/dev/loop", strlen("/dev/loop")))
@@ -135,15 +225,32 @@ int main(int argc, char *argv[])
         usage(argv[0]);
         return 2;
     }
+    if (!g_opts.targets.empty())
+    {
+        if (g_opts.skip_unchanged || !g_opts.journal.empty() || g_opts.connections > 1)
+        {
+            log_error("-o can't be used with -s, -j or -P");
+            return 2;
+        }
+        // the banks of this system aren't touched
+        g_opts.success_action = SwdlOptions::NO_FLIP;
+    }
     string url = argv[optind];
+    log_debug("using %s crc32 implementation", xcrc32_impl_name());
 
     // done with argument parsing, time to do stuff
-    CPipe curl;
+    std::unique_ptr<ImageSource> src;
+    std::unique_ptr<Journal> journal;
     int err = 0;
     try
     {
-        // fork off to curl to download the image
-        curl = open_curl(url);
+        // before starting any threads or child processes, which inherit the priorities
+        if (g_opts.rate_limit || g_opts.background)
+            g_qos.configure(g_opts.rate_limit, g_opts.background);
+        const uint64_t cache_before = page_cache_size();
+
+        // start downloading the image
+        src = open_image(url);
 
         // ignore SIGPIPE so that we can handle errors when writes fail.
         // This can happen when programming a corrupted tar part because
@@ -153,7 +260,7 @@ int main(int argc, char *argv[])
 
         // read the image header
         nimg_hdr_t hdr;
-        try { cpipe_read(curl, &hdr, NIMG_HDR_SIZE); }
+        try { src->read_full(&hdr, NIMG_HDR_SIZE); }
         catch (exception& e) { log_error("failed to read image header"); throw; }
 
         // validate the header
@@ -163,6 +270,18 @@ int main(int argc, char *argv[])
 
         log_info("Image name is %.*s", NIMG_NAME_LEN, hdr.name[0] ? hdr.name : "(empty)");
 
+        // version 3 images have a table of block CRCs after the header
+        vector<uint32_t> blktab;
+        if (nimg_block_size(&hdr))
+        {
+            blktab.resize(hdr.blktab_size / sizeof(uint32_t));
+            try { src->read_full(blktab.data(), hdr.blktab_size); }
+            catch (exception& e) { log_error("failed to read block CRC table"); throw; }
+            if (nimg_blktab_check(&hdr, blktab.data()) < 0)
+                throw PError("nImage block CRC table validation failed: invalid CRC32");
+            log_debug("image block size is %s", human_bytes(nimg_block_size(&hdr)));
+        }
+
         if (hdr.n_parts == 0)
         {
             log_warn("No partitions in image, nothing to do!");
@@ -176,7 +295,10 @@ int main(int argc, char *argv[])
         stringvec cmdline = split_words_in_file("/proc/cmdline");
 #endif
 
-        uint64_t parts_bytes = 0;
+        if (!g_opts.journal.empty())
+            journal.reset(new Journal(g_opts.journal, hdr, get_inactive_dev(cmdline)));
+
+        uint64_t parts_bytes = nimg_blktab_size(&hdr);
         for (int i = 0; i < hdr.n_parts; i++)
         {
             nimg_phdr_t *p = &hdr.parts[i];
@@ -186,15 +308,52 @@ int main(int argc, char *argv[])
                              i, (unsigned long long)p->offset, (unsigned long long)parts_bytes);
             if (padding > 0)
             {
-                char pbuf[padding];
-                if (cpipe_read(curl, pbuf, padding) < (size_t)padding)
-                    throw PError("failed to read %zu padding bytes before part %d", padding, i);
+                try { src->skip(padding); }
+                catch (exception& e) { log_error("failed to read %zd padding bytes before part %d", padding, i); throw; }
+                parts_bytes += padding;
+            }
+
+            if (journal && journal->part_done(i))
+            {
+                log_info("part %d was finished by an earlier download, skipping it", i);
+                src->skip(p->size);
+                parts_bytes += p->size;
+                continue;
+            }
+
+            PartBlocks blocks;
+            if (!blktab.empty())
+            {
+                blocks.crcs = nimg_part_blkcrcs(&hdr, blktab.data(), i);
+                blocks.block_size = nimg_block_size(&hdr);
             }
 
             // this does the real work, and throws an exception for any failure
-            program_part(curl, p, cmdline);
+            if (journal)
+                journal->begin_part(i);
+            program_part(*src, p, blocks, cmdline, journal.get());
             parts_bytes += p->size;
         }
+        if (!g_verify.wait())
+            throw PError("verification failed, the data on the device doesn't match the image");
+        if (failed_targets())
+            throw PError("writing failed on %zu of %zu target devices", failed_targets(), g_opts.targets.size());
+        if (journal)
+            journal->begin_part(hdr.n_parts);
+
+        // Image data and written data are dropped from the page cache as we go, so if
+        // the cache shrank by more than the image had cached, that's how much of other
+        // processes' data we pushed out. It's system-wide, so only an estimate when
+        // other things are running
+        const uint64_t cache_after = page_cache_size();
+        if (cache_before && cache_after)
+        {
+            log_debug("page cache was %llu KB, now %llu KB, image had %llu KB cached",
+                      (unsigned long long)(cache_before / 1024), (unsigned long long)(cache_after / 1024),
+                      (unsigned long long)(src->cached_at_open / 1024));
+            const uint64_t dropped = cache_after + src->cached_at_open;
+            log_info("Displaced about %s of page cache", human_bytes(dropped < cache_before ? cache_before - dropped : 0));
+        }
 
         if (g_opts.success_action == SwdlOptions::NO_FLIP)
         {
@@ -207,10 +366,26 @@ int main(int argc, char *argv[])
         int flip_bank = 0;
         for (int i = 0; i < hdr.n_parts; i++)
         {
-            if (hdr.parts[i].type == NIMG_PTYPE_ROOTFS)
-                flip_bank = 1;
-            else if (hdr.parts[i].type == NIMG_PTYPE_ROOTFS_RW)
-                flip_bank = 2;
+            switch (hdr.parts[i].type)
+            {
+                case NIMG_PTYPE_ROOTFS:
+                case NIMG_PTYPE_ROOTFS_SPARSE:
+                case NIMG_PTYPE_ROOTFS_GZ:
+                case NIMG_PTYPE_ROOTFS_XZ:
+                case NIMG_PTYPE_ROOTFS_ZSTD:
+                case NIMG_PTYPE_ROOTFS_DELTA:
+                    flip_bank = 1;
+                    break;
+                case NIMG_PTYPE_ROOTFS_RW:
+                case NIMG_PTYPE_ROOTFS_RW_SPARSE:
+                case NIMG_PTYPE_ROOTFS_RW_GZ:
+                case NIMG_PTYPE_ROOTFS_RW_XZ:
+                case NIMG_PTYPE_ROOTFS_RW_ZSTD:
+                    flip_bank = 2;
+                    break;
+                default:
+                    break;
+            }
         }
         if (flip_bank)
         {
@@ -233,9 +408,22 @@ int main(int argc, char *argv[])
             if (fd_write == -1)
                 THROW_ERRNO("failed to open %s for writing", g_opts.cmdline_txt.c_str());
             ssize_t nwritten = write(fd_write, new_cmdline_s.c_str(), new_cmdline_s.length());
-            close(fd_write);
             if (nwritten != (ssize_t)new_cmdline_s.length())
+            {
+                close(fd_write);
                 THROW_ERRNO("failed to write to %s", g_opts.cmdline_txt.c_str());
+            }
+
+            // sync the new file and the renames, rather than everything with sync() at the end
+            int fd_dir = open(dirname_of(g_opts.cmdline_txt).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            bool synced = (fsync(fd_write) == 0) && (fd_dir != -1) && (fsync(fd_dir) == 0);
+            int sync_errno = errno;
+            close(fd_write);
+            if (fd_dir != -1)
+                close(fd_dir);
+            errno = sync_errno;
+            if (!synced)
+                THROW_ERRNO("failed to sync %s", g_opts.cmdline_txt.c_str());
         }
         else
         {
@@ -246,25 +434,38 @@ int main(int argc, char *argv[])
     catch (exception& e)
     {
         log_error("%s", e.what());
-        if (curl.running)
-            kill(curl.pid, SIGTERM);
+        if (src)
+            src->abort();
         err++;
     }
 
-    // clean up
-    if (curl.fd != -1)
-        close(curl.fd);
-    try { cpipe_wait(curl, true); }
-    catch (exception& e)
+    // A part may still be being verified after a later part failed. The journal says
+    // that a part which failed verification is done, so it has to go
+    if (!g_verify.wait())
     {
-        // if there was an error above, we killed curl so don't complain about that
         if (!err)
-            log_error("image download failed: %s", e.what());
-        err++;
+            err++;
+        if (journal)
+        {
+            log_warn("removing journal %s, the next download has to start over", g_opts.journal.c_str());
+            journal->remove();
+            journal.reset();
+        }
     }
 
-    log_info("syncing filesystems");
-    sync();
+    // clean up
+    if (src && !err)
+    {
+        try { src->finish(); }
+        catch (exception& e)
+        {
+            log_error("image download failed: %s", e.what());
+            err++;
+        }
+    }
+    src.reset();
+    if (journal && !err)
+        journal->remove();
 
     if (err)
     {
@@ -18,11 +18,20 @@
 #ifndef NEWBS_SWDL_H
 #define NEWBS_SWDL_H
 
+#include <condition_variable>
 #include <exception>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 #include "nImage.h"
 #include "PError.h"
 
@@ -42,12 +51,24 @@ struct SwdlOptions
         FLIP,
         FLIP_REBOOT,
     } success_action = FLIP;
+    bool skip_unchanged = false; // compare raw parts with the device and only write blocks that differ
+    bool use_curl = false;       // always download with a curl child process, not the built-in HTTP client
     string cmdline_txt = string("/boot/cmdline.txt");
 #ifdef SWDL_TEST
     string boot_dev = string("/dev/loop0");
 #else
     string boot_dev = string("/dev/mmcblk0p1");
 #endif
+    string journal;              // file to record progress in, so that downloads can be resumed
+    int connections = 1;         // download large raw parts over this many connections
+    uint64_t rate_limit = 0;     // bytes/s for downloads and device writes, 0 for unlimited
+    bool background = false;     // idle I/O priority, nice 19 and adaptive write throttling
+    bool verify = false;         // read back what was written to devices and check its CRC32
+    struct TargetDevs
+    {
+        string rootfs, boot;     // boot may be empty if the image has no boot parts
+    };
+    vector<TargetDevs> targets;  // -o: write every part to each of these, not to this system's banks
     string curl_netrc;
     string curl_username;
     stringvec curl_opts;
@@ -62,23 +83,437 @@ struct CPipe
     bool running = false;
 };
 
+// A stream of image data being downloaded, either by a curl child process or
+// in-process by the built-in HTTP client.
+class ImageSource
+{
+    public:
+        virtual ~ImageSource(void) {}
+
+        // read up to count bytes. Returns 0 at the end of the stream, throws on error
+        virtual size_t read(void *buf, size_t count) = 0;
+
+        // check that the download completed successfully, throws if it didn't
+        virtual void finish(void) {}
+
+        // stop the download after an error
+        virtual void abort(void) {}
+
+        // skip over count bytes of the image. By default they're read and discarded
+        virtual void skip(uint64_t count);
+
+        // open another stream of len bytes of the image, starting offset bytes after the
+        // current position, so that they can be downloaded in parallel.
+        // Returns nullptr if the source can't do that
+        virtual std::unique_ptr<ImageSource> open_range(uint64_t offset, uint64_t len)
+        {
+            (void)offset; (void)len;
+            return nullptr;
+        }
+
+        // read exactly count bytes, throws on error or EOF
+        void read_full(void *buf, size_t count);
+
+        // how much of the image was in the page cache when it was opened. It's
+        // dropped while reading, which doesn't count as displacing anything
+        uint64_t cached_at_open = 0;
+};
+
+// per-block CRC32s of one part, from the block CRC table of a version 3 image
+struct PartBlocks
+{
+    const uint32_t *crcs = nullptr; // nullptr when the image has no block table
+    uint32_t block_size = 0;
+};
+
+// Rolling writeback for buffered writes to a device or file. Every window bytes,
+// the range written since the last window is handed to the device with
+// sync_file_range (without waiting), and the writer waits for the window before
+// it to finish. This way only about two windows of dirty pages build up, instead
+// of gigabytes which are only written out by one long sync at the end and stall
+// everything else on the system. Written windows are dropped from the page cache
+// once they're clean, so that they don't evict other processes' data.
+// wrote() is thread-safe.
+class Writeback
+{
+    public:
+        static const uint64_t window = 8 << 20;
+
+        Writeback(int fd_, const string& path_) : fd(fd_), path(path_) {}
+
+        // record that len bytes at offset were written, may wait for earlier writes
+        void wrote(uint64_t offset, uint64_t len);
+
+        // flush everything to the device with fsync and drop it from the page cache,
+        // throws on error
+        void sync(void);
+
+    private:
+        int fd;
+        string path;
+        std::mutex lock;
+        bool enabled = true;
+        uint64_t cur_start = UINT64_MAX, cur_end = 0, cur_bytes = 0; // written since the last window
+        uint64_t prev_start = 0, prev_end = 0;                         // the last window, being written
+
+        void range(uint64_t start, uint64_t end, unsigned flags);
+};
+
+// Token bucket rate limiter, thread-safe. A rate of 0 means unlimited
+class TokenBucket
+{
+    public:
+        void set_rate(uint64_t bytes_per_sec);
+
+        // account for n bytes, sleeping as long as needed to stay under the rate
+        void take(size_t n);
+
+    private:
+        std::mutex lock;
+        double rate = 0, burst = 0, tokens = 0;
+        double last = 0;
+};
+
+// I/O QoS for updating while the system is busy (-L and -B). Caps the rate of
+// network reads and device writes, and in background mode also lowers the CPU
+// and I/O priority and throttles writes further whenever their latency spikes,
+// so that other processes keep getting their storage I/O done.
+class IoQos
+{
+    public:
+        // max_rate in bytes/s, 0 for unlimited. Call once before starting any threads
+        void configure(uint64_t max_rate, bool background);
+
+        // account for n bytes read from the network, may sleep
+        void read(size_t n) { reads.take(n); }
+
+        // account for n bytes about to be written to the device, may sleep
+        void write(size_t n);
+
+        // feedback for the adaptive throttling: a direct write of n bytes took sec seconds
+        // to complete, or with buffered, writing n bytes waited sec seconds for writeback
+        void write_latency(size_t n, double sec, bool buffered);
+
+    private:
+        static constexpr double spike_factor = 4;   // latency this much above normal is congestion
+        static const uint64_t min_rate = 1048576;   // never throttle below this
+
+        TokenBucket reads, writes;
+        uint64_t max_rate = 0;
+        bool adaptive = false;
+
+        std::mutex lock;
+        double base_lat[2] = {0, 0};    // lowest direct/buffered write latency seen, in seconds per MiB
+        double observed = 0, peak = 0;  // write throughput, bytes/s
+        double sample_start = 0, last_change = 0;
+        uint64_t sample_bytes = 0;
+        uint64_t throttle = 0;          // adaptive write rate limit, 0 when not throttling
+};
+extern IoQos g_qos;
+
+// Post-write verification (-v). After a part has been written to a device and
+// synced, the written range is read back with O_DIRECT (so it comes from the
+// device, not the page cache) and its CRC32 computed on several threads. Each
+// check runs in the background, so it overlaps with programming the next part.
+class Verifier
+{
+    public:
+        ~Verifier(void) { wait(); }
+
+        // check that the first len bytes of dev have the CRC32 crc. what names the part for messages
+        void start(const string& dev, uint64_t len, uint32_t crc, const string& what);
+
+        // wait for all started checks, log any failures. Returns false if any check has failed
+        bool wait(void);
+
+    private:
+        static const int n_threads = 4; // enough to keep the device busy, leaves CPUs for the next part
+
+        struct Check
+        {
+            string dev, what;
+            uint64_t len;
+            uint32_t crc;
+            string error;
+            std::thread thread;
+        };
+        std::list<Check> checks;
+        unsigned n_failed = 0;
+
+        static void run(Check *c);
+};
+extern Verifier g_verify;
+
+// Where the data of raw parts is written: one device (DeviceWriter), or the same
+// data to several devices (FanOutWriter). Data is written from buffers owned by
+// the writer: get one with get_buffer(), fill it, and pass it to submit() or release().
+class PartWriter
+{
+    public:
+        static const size_t buf_size = 1048576;
+
+        virtual ~PartWriter(void) {}
+
+        // an aligned buffer of buf_size bytes, waits for a write to finish if needed
+        virtual uint8_t* get_buffer(void) = 0;
+
+        // queue a write of len bytes from buf at offset, buf is released when it's done
+        virtual void submit(uint8_t *buf, size_t len, uint64_t offset) = 0;
+
+        // give back a buffer without writing it
+        virtual void release(uint8_t *buf) = 0;
+
+        // whether the device already contains len bytes of buf at offset (needs read_back)
+        virtual bool unchanged(const uint8_t *buf, size_t len, uint64_t offset) = 0;
+
+        // wait for all writes and flush them to the device, throws if any failed
+        virtual void flush(void) = 0;
+
+        virtual const char* backend(void) const = 0;
+};
+
+// Writes a part to a block device with O_DIRECT, keeping several large writes
+// in flight with io_uring. Falls back to synchronous pwrites when io_uring isn't
+// available, and to buffered writes when O_DIRECT isn't supported (e.g. tmpfs).
+class DeviceWriter : public PartWriter
+{
+    public:
+        DeviceWriter(const string& dev, bool read_back);
+        ~DeviceWriter(void);
+
+        virtual uint8_t* get_buffer(void);
+        virtual void submit(uint8_t *buf, size_t len, uint64_t offset);
+        virtual void release(uint8_t *buf);
+        virtual bool unchanged(const uint8_t *buf, size_t len, uint64_t offset);
+        virtual void flush(void);
+        virtual const char* backend(void) const;
+
+        uint64_t bytes_written(void) const { return total; }
+
+    private:
+        static const unsigned n_bufs = 8;   // also the number of writes in flight
+        static const size_t align = 4096;   // for O_DIRECT offsets, sizes and buffers
+
+        struct Uring;
+        string path;
+        int fd = -1, fd_direct = -1;
+        std::unique_ptr<Uring> ring;
+        std::unique_ptr<Writeback> wb;  // for buffered writes
+        vector<uint8_t*> bufs;
+        vector<unsigned> free_bufs;
+        vector<struct iovec> iovs;
+        vector<size_t> lens;
+        vector<uint64_t> offsets;
+        vector<double> start_times;     // when each write was submitted, for IoQos
+        uint8_t *cmp_buf = nullptr;
+        unsigned in_flight = 0;
+        uint64_t total = 0;
+        string error;
+
+        void cleanup(void);
+        void set_error(const string& msg);
+        void write_sync(int wfd, const uint8_t *buf, size_t len, uint64_t offset);
+        unsigned buf_index(const uint8_t *buf) const;
+        void reap(void);
+        void drain(void);
+};
+
+// Writes the same data to several devices at once (-o), e.g. to flash a batch of
+// SD cards from one download. Every device has a writer thread with its own queue
+// of writes. Each buffer is queued for all of them and reference counted, so it's
+// only reused once every device has written it. There are only n_bufs buffers,
+// so the slowest device holds up the others once it's that far behind, but not
+// before. A device which fails is dropped, and the others carry on. Thread-safe.
+class FanOutWriter : public PartWriter
+{
+    public:
+        static const unsigned n_bufs = 32;
+
+        FanOutWriter(const vector<string>& devs);
+        ~FanOutWriter(void);
+
+        virtual uint8_t* get_buffer(void);
+        virtual void submit(uint8_t *buf, size_t len, uint64_t offset);
+        virtual void release(uint8_t *buf);
+        virtual bool unchanged(const uint8_t *, size_t, uint64_t) { return false; } // no -s with -o
+        virtual void flush(void); // only throws if every device failed
+        virtual const char* backend(void) const { return "one writer thread per device"; }
+
+        // zero len bytes at offset
+        void zero(uint64_t offset, uint64_t len);
+
+        // whether writing to devs[i] failed, after flush()
+        bool failed(size_t i) const;
+
+    private:
+        static const size_t align = 4096;
+
+        struct Op
+        {
+            int buf;        // buffer index, or -1 to zero len bytes
+            size_t len;
+            uint64_t offset;
+        };
+        struct Target;
+
+        std::mutex lock;
+        std::condition_variable cond;
+        vector<uint8_t*> bufs;
+        vector<unsigned> refs;      // devices which still have to write each buffer
+        vector<unsigned> free_bufs;
+        vector<std::unique_ptr<Target>> targets;
+        bool stop = false;
+
+        unsigned buf_index(const uint8_t *buf) const;
+        void put(unsigned i);
+        void queue(const Op& op);
+        void worker(Target *t);
+};
+
+// Extracts a tar archive (ustar, pax and GNU long names) into a directory as
+// it's streamed in with feed(). Small files are collected in memory and written
+// by a pool of threads so that several are in flight at once, large files are
+// written directly in large batches. Files are preallocated with fallocate and
+// nothing is synced until the whole archive is done.
+// With a file index from the image (see skip_unchanged), files which are already
+// in the directory with the same contents aren't written again.
+class TarExtractor
+{
+    public:
+        TarExtractor(const string& dir);
+        ~TarExtractor(void);
+
+        // extract the next len bytes of the archive, throws on error
+        void feed(const uint8_t *data, size_t len);
+
+        // codec_output_fn version of feed(), for extracting the output of a decompressor
+        static int output(void *arg, const uint8_t *data, size_t len);
+
+        // wait for all files to be written, throws if anything failed or the archive is incomplete
+        void finish(void);
+
+        // compare the n_files entries of a file index (see nimg_fileidx_hdr_t) with the
+        // files in the directory, and don't write the ones which are the same.
+        // Call before feed(), returns the number of unchanged files
+        unsigned skip_unchanged(const uint8_t *entries, uint32_t n_files);
+
+        unsigned n_files = 0;       // files written
+        unsigned n_unchanged = 0;   // files skipped because they're unchanged
+        uint64_t total_bytes = 0;
+        string error; // set by output()
+
+    private:
+        struct FileJob
+        {
+            string path;
+            mode_t mode;
+            int64_t mtime;
+            vector<uint8_t> data;
+        };
+
+        enum Sink { SINK_SKIP, SINK_SMALL, SINK_LARGE };
+
+        string dir;
+        int dirfd = -1;
+
+        std::unique_ptr<tar_parser_t, void(*)(tar_parser_t*)> parser;
+        std::exception_ptr cb_error; // thrown by a parser callback
+
+        // the current entry
+        Sink sink = SINK_SKIP;
+        char entry_type = 0;
+        FileJob job;            // path/mode/mtime of any entry, data of small files
+        int fd = -1;            // large files
+        vector<uint8_t> wbuf;   // large file write batch
+        vector<string> unchanged; // sorted paths of files that don't need to be written
+
+        struct Pool;    // threads writing small files
+        std::unique_ptr<Pool> pool;
+        std::set<string> queued; // paths of small files given to the pool since it was last drained
+
+        static int on_begin(void *arg, const tar_entry_t *e);
+        static int on_data(void *arg, const uint8_t *data, size_t len);
+        static int on_end(void *arg);
+        void check(tar_err_e err);
+        void begin_entry(const string& path, const string& link, uint64_t size, mode_t mode, int64_t mtime);
+        void create_entry(const string& path, const string& link, uint64_t size, mode_t mode, int64_t mtime);
+        void wait_queued(const string& path);
+        void drain_pool(void);
+        void entry_data(const uint8_t *data, size_t len);
+        void end_entry(void);
+        void flush_wbuf(void);
+        void close_file(void);
+};
+
+// Records how far a download got (-j), so that an interrupted download can be
+// resumed rather than starting over. Raw parts are checkpointed while they're
+// being written, other parts restart from their beginning.
+class Journal
+{
+    public:
+        Journal(const string& path_, const nimg_hdr_t& hdr, const string& dev);
+
+        // whether part was completed by an earlier run
+        bool part_done(int part) const;
+
+        // where to resume programming the current part, and the CRC32 of the data before that
+        void resume_point(uint64_t *offset, uint32_t *crc) const;
+
+        // record the start of a part (or n_parts when all parts are done)
+        void begin_part(int part);
+
+        // record that offset bytes of the current part are written and synced
+        void checkpoint(uint64_t offset, uint32_t crc);
+
+        // delete the journal after a successful download
+        void remove(void);
+
+    private:
+        string path;
+        uint32_t hdr_crc, dev_crc;
+        int resume_part = 0;
+        uint64_t resume_offset = 0;
+        uint32_t resume_crc = 0;
+        int current_part = 0;
+
+        void write(int part, uint64_t offset, uint32_t crc);
+};
+
 // lib.cpp functions
 stringvec split_words_in_file(const string& filename);
 string join_words(const stringvec& vec, const string& sep);
 stringvec split_string(const string& input, char delim);
 void do_exec(const vector<const char*>& args) __attribute__((noreturn));
-CPipe open_curl(const string& url_);
+CPipe open_curl(const string& url);
 void cpipe_wait(CPipe& cp, bool block);
-size_t cpipe_read(CPipe& cp, void *buf, size_t count);
+std::unique_ptr<ImageSource> open_image(const string& url);
+uint64_t page_cache_size(void);
+
+// untar.cpp functions
+void mark_dir_incomplete(const string& dir);
+void mark_dir_complete(const string& dir);
+
+// http.cpp functions
+// returns nullptr if the server redirects somewhere only curl can download from
+std::unique_ptr<ImageSource> open_http(const string& url);
 
 // flashbanks.cpp functions
+string get_active_dev(const stringvec& cmdline);
 string get_inactive_dev(const stringvec& cmdline);
 void cmdline_set_root(stringvec& cmdline, const string& new_root, bool rw);
 bool find_mntent(const string& dev, struct mntent *ment);
 void mount_mntent(const struct mntent *m, bool force_rw=false);
 
+// writer.cpp functions
+void zero_range(int fd, const struct stat& sb, uint64_t offset, uint64_t len);
+
+// qos.cpp functions
+double monotonic_sec(void);
+
 // program.cpp functions
-void program_part(CPipe& curl, const nimg_phdr_t *p, const stringvec& cmdline);
+void program_part(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks, const stringvec& cmdline,
+                  Journal *journal);
+size_t failed_targets(void); // -o target sets which failed
 
 
 #endif // NEWBS_SWDL_H
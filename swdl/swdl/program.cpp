@@ -15,16 +15,28 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  ******************************************************************************/
 
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <errno.h>
 #include <fcntl.h>
 #include <mntent.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "newbs-swdl.h"
 
+// raw parts smaller than this aren't worth downloading over multiple connections
+#define PARALLEL_MIN_SIZE ((uint64_t)64 << 20)
+
 static inline string _get_inactive_dev(const stringvec& cmdline)
 {
 #ifdef SWDL_TEST
@@ -35,6 +47,15 @@ static inline string _get_inactive_dev(const stringvec& cmdline)
 #endif
 }
 
+// the base of delta parts. It's only read from, so this is the real device even in test mode
+static inline string _get_active_dev(const stringvec& cmdline)
+{
+    string dev = get_active_dev(cmdline);
+    if (dev.empty())
+        THROW_ERROR("unable to find the active rootfs bank for a delta part");
+    return dev;
+}
+
 static inline string get_boot_dir(void)
 {
 #ifdef SWDL_TEST
@@ -48,72 +69,1071 @@ static inline string get_boot_dir(void)
 #endif
 }
 
-// copy between file descriptors, return the crc32, throw an exception if something goes wrong
-// prints a . to stderr every chunk_size for progress, returns the crc32
-static uint32_t file_copy_crc32_progress(int fd_in, int fd_out, size_t len)
+// Reads the data of one part from the image stream, computes its CRC32 and
+// prints a . to stderr every 2MB for progress.
+// Reading is pipelined: a fetch thread downloads the part into a ring of large
+// buffers, a checksum thread computes the CRC, and the caller (normally writing
+// to a device) consumes buffers once they've been checked. This way the network,
+// CPU and storage all work at the same time.
+// If the part has block CRCs, each block is checked as soon as it's been read
+// so that a corrupt image fails early rather than after the whole part is written.
+class PartReader
 {
-    // read and copy block_size bytes at a time, print a progress dot every chunk_size bytes
-    const size_t block_size = 8192;
-    const size_t chunk_size = 1048576 * 2;
+    public:
+        static const size_t buf_size = 1048576;
+
+    private:
+        static const size_t n_bufs = 8;
+        static const size_t buf_align = 4096;
+
+        struct Slot
+        {
+            uint8_t *data = nullptr;
+            size_t len = 0;
+            uint32_t crc_end = 0; // CRC32 of the part up to the end of this buffer
+        };
+
+        ImageSource& src;
+        const size_t len;
+        const PartBlocks& blocks;
+        const uint64_t start;   // offset in the part to start reading at, when resuming
+        const uint64_t n_slots; // number of buffers needed for the rest of the part
+        vector<Slot> ring;
+
+        std::mutex lock;
+        std::condition_variable cond;
+        uint64_t n_fetched = 0, n_checked = 0, n_consumed = 0; // buffers through each stage
+        bool stop = false;
+        string error;
+        uint32_t crc = 0; // written by the checksum thread, only read after it's joined
+        std::thread fetch_thread, crc_thread;
+
+        // consumer state
+        size_t pos = 0; // position in the current buffer, ring[n_consumed % n_bufs]
+        size_t total = 0, chunk_progress = 0;
+
+        // wait for pred, returns false if the pipeline is stopping
+        template<typename Pred>
+        bool wait_for(std::unique_lock<std::mutex>& lk, Pred pred)
+        {
+            cond.wait(lk, [&]{ return pred() || stop || error.length(); });
+            return !(stop || error.length());
+        }
+
+        void set_error(const char *msg)
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            if (error.empty())
+                error = msg;
+            cond.notify_all();
+        }
+
+        void fetch(void)
+        {
+            try
+            {
+                for (uint64_t i = 0; i < n_slots; i++)
+                {
+                    Slot& s = ring[i % n_bufs];
+                    {
+                        std::unique_lock<std::mutex> lk(lock);
+                        if (!wait_for(lk, [&]{ return n_fetched - n_consumed < n_bufs; }))
+                            return;
+                    }
+                    s.len = min(buf_size, len - start - i * buf_size);
+                    g_qos.read(s.len);
+                    src.read_full(s.data, s.len);
+
+                    std::lock_guard<std::mutex> lk(lock);
+                    n_fetched++;
+                    cond.notify_all();
+                }
+            }
+            catch (exception& e) { set_error(e.what()); }
+        }
+
+        void check(void)
+        {
+            uint32_t blk_crc = 0;
+            uint64_t blk_index = blocks.crcs ? start / blocks.block_size : 0;
+            size_t blk_len = 0; // bytes checked in the current block
+            size_t checked = start;
+            try
+            {
+                for (uint64_t i = 0; i < n_slots; i++)
+                {
+                    Slot& s = ring[i % n_bufs];
+                    {
+                        std::unique_lock<std::mutex> lk(lock);
+                        if (!wait_for(lk, [&]{ return n_checked < n_fetched; }))
+                            return;
+                    }
+
+                    if (!blocks.crcs)
+                    {
+                        xcrc32(&crc, s.data, s.len);
+                        checked += s.len;
+                    }
+
+                    // check each block CRC as soon as the block is done, then merge it into the part CRC
+                    for (size_t off = 0; blocks.crcs && off < s.len; )
+                    {
+                        size_t n = min(s.len - off, blocks.block_size - blk_len);
+                        xcrc32(&blk_crc, s.data + off, n);
+                        blk_len += n;
+                        checked += n;
+                        off += n;
+                        if (blk_len == blocks.block_size || checked == len)
+                        {
+                            if (blk_crc != blocks.crcs[blk_index])
+                                THROW_ERROR("CRC mismatch in block %llu! expected 0x%08x, actual 0x%08x",
+                                            (unsigned long long)blk_index, blocks.crcs[blk_index], blk_crc);
+                            crc = xcrc32_combine(crc, blk_crc, blk_len);
+                            blk_crc = 0;
+                            blk_len = 0;
+                            blk_index++;
+                        }
+                    }
+
+                    s.crc_end = blk_len ? xcrc32_combine(crc, blk_crc, blk_len) : crc;
+                    std::lock_guard<std::mutex> lk(lock);
+                    n_checked++;
+                    cond.notify_all();
+                }
+            }
+            catch (exception& e) { set_error(e.what()); }
+        }
+
+        void throw_error(void)
+        {
+            fputc('\n', stderr);
+            throw PError(error);
+        }
+
+    public:
+        // start and start_crc resume reading a part in the middle. start must be a
+        // multiple of the block size, and start_crc the CRC32 of the data before it
+        PartReader(ImageSource& src_, size_t len_, const PartBlocks& blocks_,
+                   uint64_t start_ = 0, uint32_t start_crc = 0)
+            : src(src_), len(len_), blocks(blocks_), start(start_),
+              n_slots((len_ - start_ + buf_size - 1) / buf_size), ring(min((uint64_t)n_bufs, n_slots)),
+              crc(start_crc), total(start_)
+        {
+            assert(start <= len && !(blocks.crcs && start % blocks.block_size));
+            // aligned so that the buffers can be written with O_DIRECT
+            for (auto& s : ring)
+                if (posix_memalign(reinterpret_cast<void**>(&s.data), buf_align, buf_size) != 0)
+                    THROW_ERROR("failed to allocate buffers");
+            fetch_thread = std::thread(&PartReader::fetch, this);
+            crc_thread = std::thread(&PartReader::check, this);
+        }
+
+        ~PartReader(void)
+        {
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                stop = true;
+            }
+            cond.notify_all();
+            if (fetch_thread.joinable())
+                fetch_thread.join();
+            if (crc_thread.joinable())
+                crc_thread.join();
+            for (auto& s : ring)
+                free(s.data);
+        }
+
+        size_t remaining(void) const { return len - total; }
 
-    uint8_t buf[block_size];
-    uint32_t crc = 0;
-    size_t total = 0, chunk_progress = 0;
-    while (total < len)
+        // get a pointer to the next (up to count) bytes of the part, without copying.
+        // The data stays valid until the next call. Throws on error or EOF
+        size_t get(const uint8_t **data, size_t count)
+        {
+            if (total == len)
+                THROW_ERROR("unexpected EOF");
+
+            std::unique_lock<std::mutex> lk(lock);
+            if (pos > 0 && pos == ring[n_consumed % n_bufs].len)
+            {
+                // done with the current buffer, hand it back to the fetch thread
+                n_consumed++;
+                pos = 0;
+                cond.notify_all();
+            }
+            if (!wait_for(lk, [this]{ return n_checked > n_consumed; }))
+                throw_error();
+            lk.unlock();
+
+            const Slot& s = ring[n_consumed % n_bufs];
+            size_t n = min(count, s.len - pos);
+            *data = s.data + pos;
+            pos += n;
+            total += n;
+            chunk_progress += n;
+            if (chunk_progress >= 1048576 * 2)
+            {
+                fputc('.', stderr);
+                chunk_progress = 0;
+            }
+            return n;
+        }
+
+        // read exactly count bytes
+        void read_full(void *buf, size_t count)
+        {
+            for (size_t done = 0; done < count; )
+            {
+                const uint8_t *data;
+                size_t n = get(&data, count - done);
+                memcpy(static_cast<uint8_t*>(buf) + done, data, n);
+                done += n;
+            }
+        }
+
+        // Get the offset and CRC32 of everything read so far. This is only possible
+        // after reading up to the end of one of the internal buffers, returns false otherwise
+        bool checkpoint(uint64_t *offset, uint32_t *crc_out)
+        {
+            if (pos == 0 || pos != ring[n_consumed % n_bufs].len)
+                return false;
+            *offset = total;
+            *crc_out = ring[n_consumed % n_bufs].crc_end;
+            return true;
+        }
+
+        // CRC32 of the whole part, call after everything has been read
+        uint32_t finish(void)
+        {
+            assert(total == len);
+            fetch_thread.join();
+            crc_thread.join();
+            if (error.length())
+                throw_error();
+            fputc('\n', stderr);
+            return crc;
+        }
+};
+
+static void write_all(int fd, const uint8_t *buf, size_t count)
+{
+    size_t written = 0;
+    while (written < count)
     {
-        size_t to_read = min(block_size, len - total);
-        ssize_t nread = read(fd_in, buf, to_read);
-        if (nread < 0)
-            THROW_ERRNO("read failed");
+        ssize_t nwrite = write(fd, buf+written, count-written);
+        if (nwrite <= 0)
+            THROW_ERRNO("write failed");
+        written += nwrite;
+    }
+}
+
+// copy len bytes from in to fd_out, at fd_out's current offset.
+// If skip_unchanged is set, fd_out must be a readable and seekable file/device, its
+// contents are compared with the input and only the data which differs is written.
+// Writes are reported to wb if it's not null, which also needs fd_out to be seekable.
+// The CRC32 of the data is added to *crc if it's not null.
+// Returns the number of bytes that were skipped.
+static uint64_t copy_part_data(PartReader& in, int fd_out, size_t len, bool skip_unchanged, Writeback *wb = nullptr,
+                               uint32_t *crc = nullptr)
+{
+    // data is written straight from the reader's buffers. When skipping unchanged
+    // data, compare in smaller chunks so that one changed byte doesn't cause a large write
+    const size_t chunk_size = skip_unchanged ? 65536 : PartReader::buf_size;
+    vector<uint8_t> cmp_buf(skip_unchanged ? chunk_size : 0);
+    uint64_t skipped = 0;
+
+    off_t out_off = 0;
+    if ((skip_unchanged || wb) && (out_off = lseek(fd_out, 0, SEEK_CUR)) == (off_t)-1)
+        THROW_ERRNO("seek failed");
 
-        ssize_t written = 0;
-        while (written < nread)
+    for (size_t total = 0; total < len; )
+    {
+        const uint8_t *buf;
+        size_t nread = in.get(&buf, min(chunk_size, len - total));
+        if (crc)
+            xcrc32(crc, buf, nread);
+
+        // reads are much faster than writes on SD/eMMC, and don't wear out the flash
+        if (skip_unchanged &&
+            (pread(fd_out, cmp_buf.data(), nread, out_off + total) == (ssize_t)nread) &&
+            !memcmp(buf, cmp_buf.data(), nread))
+        {
+            if (lseek(fd_out, nread, SEEK_CUR) == (off_t)-1)
+                THROW_ERRNO("seek failed");
+            skipped += nread;
+        }
+        else
         {
-            ssize_t nwrite = write(fd_out, buf+written, nread-written);
-            if (nwrite <= 0)
-                THROW_ERRNO("write failed");
-            written += nwrite;
+            write_all(fd_out, buf, nread);
+            if (wb)
+                wb->wrote(out_off + total, nread);
         }
-        assert(written == nread); // this should never really fail
 
-        xcrc32(&crc, buf, nread);
         total += nread;
-        chunk_progress += nread;
-        if (chunk_progress >= chunk_size)
+    }
+    return skipped;
+}
+
+// copy a part from the image to fd_out, return the crc32, throw an exception if something goes wrong
+static uint32_t file_copy_crc32_progress(ImageSource& src, int fd_out, size_t len, const PartBlocks& blocks)
+{
+    PartReader in(src, len, blocks);
+    copy_part_data(in, fd_out, len, false);
+    return in.finish();
+}
+
+// check whether len bytes of fd at offset already read as zeros
+static bool range_is_zero(int fd, uint64_t offset, uint64_t len)
+{
+    uint64_t buf[8192 / sizeof(uint64_t)];
+    for (uint64_t done = 0; done < len; )
+    {
+        size_t n = min(sizeof(buf), len - done);
+        if (pread(fd, buf, n, offset + done) != (ssize_t)n)
+            return false;
+        const uint8_t *p = reinterpret_cast<const uint8_t*>(buf);
+        if (p[0] != 0 || memcmp(p, p + 1, n - 1))
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// copy a part to a PartWriter, from offset start to len.
+// With a journal, progress is recorded every checkpoint_size bytes after
+// making sure the data is on the device.
+// Returns the number of bytes that were skipped because they were unchanged.
+static uint64_t copy_part_direct(PartReader& in, PartWriter& out, uint64_t start, size_t len,
+                                 bool skip_unchanged, Journal *journal, uint64_t checkpoint_size)
+{
+    const size_t chunk_size = skip_unchanged ? 65536 : PartWriter::buf_size;
+    uint64_t skipped = 0;
+    for (uint64_t off = start; off < len; )
+    {
+        size_t n = min(chunk_size, len - off);
+        uint8_t *buf = out.get_buffer();
+        try { in.read_full(buf, n); }
+        catch (exception& e) { out.release(buf); throw; }
+
+        if (skip_unchanged && out.unchanged(buf, n, off))
         {
-            fputc('.', stderr);
-            chunk_progress = 0;
+            out.release(buf);
+            skipped += n;
+        }
+        else
+            out.submit(buf, n, off);
+        off += n;
+
+        uint64_t cp_off;
+        uint32_t cp_crc;
+        if (journal && off < len && !(off % checkpoint_size) && in.checkpoint(&cp_off, &cp_crc))
+        {
+            out.flush();
+            journal->checkpoint(cp_off, cp_crc);
         }
     }
-    fputc('\n', stderr);
-    assert(total == len);
-    return crc;
+    out.flush();
+    return skipped;
 }
 
-static void program_raw(const CPipe& curl, const nimg_phdr_t *p, const string& dev)
+// Download a large raw part over several connections at once. The part is
+// split into regions which are each downloaded, checked and written by their
+// own thread, and the region CRCs are combined into the part CRC.
+// Returns false (with nothing read or written) if the image source can't do this.
+static bool program_raw_parallel(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks,
+                                 const string& dev, uint32_t *crc, uint64_t *skipped)
+{
+    struct Region
+    {
+        uint64_t start, end;
+        std::unique_ptr<ImageSource> src;
+        uint32_t crc = 0;
+        uint64_t skipped = 0;
+        string error;
+    };
+
+    // regions start at block boundaries so that their block CRCs can be checked
+    const uint64_t align = max((uint64_t)blocks.block_size, (uint64_t)DeviceWriter::buf_size);
+    uint64_t region_size = (p->size + g_opts.connections - 1) / g_opts.connections;
+    region_size = (region_size + align - 1) / align * align;
+
+    vector<Region> regions;
+    for (uint64_t off = 0; off < p->size; off += region_size)
+    {
+        Region r;
+        r.start = off;
+        r.end = min((uint64_t)p->size, off + region_size);
+        try { r.src = src.open_range(r.start, r.end - r.start); }
+        catch (exception& e)
+        {
+            log_warn("can't download in parallel, %s", e.what());
+            return false;
+        }
+        if (!r.src)
+            return false;
+        regions.push_back(std::move(r));
+    }
+    log_info("downloading in %zu parallel regions of %s", regions.size(), human_bytes(region_size));
+
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+    vector<std::thread> threads;
+    for (auto& r : regions)
+    {
+        threads.emplace_back([&r, &blocks, &dev]() {
+            try
+            {
+                DeviceWriter out(dev, g_opts.skip_unchanged);
+                PartReader in(*r.src, r.end, blocks, r.start, 0);
+                r.skipped = copy_part_direct(in, out, r.start, r.end, g_opts.skip_unchanged, nullptr, 0);
+                r.crc = in.finish();
+            }
+            catch (exception& e) { r.error = e.what(); }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    for (auto& r : regions)
+        if (r.error.length())
+            throw PError(r.error);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    double sec = (ts_end.tv_sec - ts_start.tv_sec) + (ts_end.tv_nsec - ts_start.tv_nsec) / 1e9;
+    log_info("downloaded %s in %.1f seconds over %zu connections", human_bytes(p->size), sec, regions.size());
+    if (sec > 0)
+        log_info("average download speed %s/s", human_bytes(p->size / sec));
+
+    // the main stream hasn't read any of the part yet
+    src.skip(p->size);
+
+    *crc = 0;
+    *skipped = 0;
+    for (auto& r : regions)
+    {
+        *crc = xcrc32_combine(*crc, r.crc, r.end - r.start);
+        *skipped += r.skipped;
+    }
+    return true;
+}
+
+static void program_raw(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks, const string& dev,
+                        Journal *journal)
 {
     log_info("Program raw part type %s (%s) to %s",
              part_name_from_type((nimg_ptype_e)p->type), human_bytes(p->size), dev.c_str());
-    int fd_out = open(dev.c_str(), O_WRONLY);
+
+    // checkpoints must be at block boundaries so that block CRCs can still be checked after resuming
+    const uint64_t checkpoint_size = max((uint64_t)64 << 20, (uint64_t)blocks.block_size);
+    uint64_t start = 0;
+    uint32_t start_crc = 0;
+    if (journal)
+        journal->resume_point(&start, &start_crc);
+
+    uint32_t crc;
+    uint64_t skipped;
+    if (g_opts.connections > 1 && start == 0 && p->size >= PARALLEL_MIN_SIZE &&
+        program_raw_parallel(src, p, blocks, dev, &crc, &skipped))
+    {
+        // done
+    }
+    else
+    {
+        if (start)
+        {
+            log_info("resuming at %s", human_bytes(start));
+            src.skip(start);
+        }
+
+        DeviceWriter out(dev, g_opts.skip_unchanged);
+        PartReader in(src, p->size, blocks, start, start_crc);
+        skipped = copy_part_direct(in, out, start, p->size, g_opts.skip_unchanged, journal, checkpoint_size);
+        crc = in.finish();
+    }
+
+    if (crc != p->crc32)
+        THROW_ERROR("CRC mismatch! expected 0x%08x, actual 0x%08x", p->crc32, crc);
+    if (g_opts.skip_unchanged)
+        log_info("%s unchanged, not written (%llu of %llu bytes)", human_bytes(skipped),
+                 (unsigned long long)skipped, (unsigned long long)p->size);
+    if (g_opts.verify)
+        g_verify.start(dev, p->size, p->crc32, part_name_from_type((nimg_ptype_e)p->type));
+
+    log_info("Finished programming part %s", part_name_from_type((nimg_ptype_e)p->type));
+}
+
+// read and check the header and extent table at the start of a sparse part
+static void read_sparse_header(PartReader& in, const nimg_phdr_t *p, nimg_sparse_hdr_t *sh,
+                               vector<nimg_extent_t> *extents)
+{
+    if (p->size < sizeof(*sh))
+        THROW_ERROR("sparse part too small");
+    in.read_full(sh, sizeof(*sh));
+    if (sh->n_extents > (p->size - sizeof(*sh)) / sizeof(nimg_extent_t))
+        THROW_ERROR("invalid sparse part header");
+    extents->resize(sh->n_extents);
+    in.read_full(extents->data(), sh->n_extents * sizeof(nimg_extent_t));
+    if (nimg_sparse_check(sh, extents->data(), p->size) < 0)
+        THROW_ERROR("invalid sparse part extent table");
+    log_info("sparse image size %s, %u data extents", human_bytes(sh->image_size), sh->n_extents);
+}
+
+/* Program a sparse rootfs part. The extent table at the start of the part says
+ * where the data goes on the device, everything in between is zeroed.
+ */
+static void program_sparse(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks, const string& dev)
+{
+    log_info("Program sparse part type %s (%s) to %s",
+             part_name_from_type((nimg_ptype_e)p->type), human_bytes(p->size), dev.c_str());
+
+    PartReader in(src, p->size, blocks);
+    nimg_sparse_hdr_t sh;
+    vector<nimg_extent_t> extents;
+    read_sparse_header(in, p, &sh, &extents);
+
+    int fd_out = open(dev.c_str(), g_opts.skip_unchanged ? O_RDWR : O_WRONLY);
     if (fd_out == -1)
         THROW_ERRNO("Failed to open %s for writing", dev.c_str());
 
     uint32_t crc;
-    try { crc = file_copy_crc32_progress(curl.fd, fd_out, p->size); }
+    uint32_t image_crc = 0; // of the whole image on the device, for verifying
+    uint64_t skipped = 0;
+    Writeback wb(fd_out, dev);
+    try
+    {
+        struct stat sb;
+        if (fstat(fd_out, &sb) < 0)
+            THROW_ERRNO("stat failed");
+        uint64_t dev_size = 0;
+        if (S_ISBLK(sb.st_mode) && ioctl(fd_out, BLKGETSIZE64, &dev_size) == 0 && dev_size < sh.image_size)
+            THROW_ERROR("%s is too small for a %llu byte image", dev.c_str(), (unsigned long long)sh.image_size);
+
+        uint64_t pos = 0;
+        for (size_t i = 0; i <= extents.size(); i++)
+        {
+            // zero the gap before each extent, and after the last one
+            uint64_t next = (i < extents.size()) ? extents[i].offset : sh.image_size;
+            if (g_opts.skip_unchanged && range_is_zero(fd_out, pos, next - pos))
+                skipped += next - pos;
+            else
+                zero_range(fd_out, sb, pos, next - pos);
+            image_crc = xcrc32_combine(image_crc, 0, next - pos); // zeros have a CRC32 of 0
+            if (i == extents.size())
+                break;
+
+            if (lseek(fd_out, extents[i].offset, SEEK_SET) == (off_t)-1)
+                THROW_ERRNO("seek failed");
+            uint32_t extent_crc = 0;
+            skipped += copy_part_data(in, fd_out, extents[i].len, g_opts.skip_unchanged, &wb,
+                                      g_opts.verify ? &extent_crc : nullptr);
+            image_crc = xcrc32_combine(image_crc, extent_crc, extents[i].len);
+            pos = extents[i].offset + extents[i].len;
+        }
+        crc = in.finish();
+        wb.sync();
+    }
     catch (exception& e) { close(fd_out); throw; }
     close(fd_out);
 
     if (crc != p->crc32)
         THROW_ERROR("CRC mismatch! expected 0x%08x, actual 0x%08x", p->crc32, crc);
+    if (g_opts.skip_unchanged)
+        log_info("%s unchanged, not written (%llu of %llu bytes)", human_bytes(skipped),
+                 (unsigned long long)skipped, (unsigned long long)sh.image_size);
+    if (g_opts.verify)
+        g_verify.start(dev, sh.image_size, image_crc, part_name_from_type((nimg_ptype_e)p->type));
 
     log_info("Finished programming part %s", part_name_from_type((nimg_ptype_e)p->type));
 }
 
-static void program_boot_tar(const CPipe& curl, const nimg_phdr_t *p, const string& bootdir)
+// Decompresses the frames of a compressed rootfs part on a pool of threads,
+// and writes each one to its position on the output device with pwrite, or
+// submits it to a FanOutWriter. At most max_queued compressed frames are buffered at once.
+class FrameDecoder
 {
-    log_info("Program part type %s (%s) to %s",
-             part_name_from_type((nimg_ptype_e)p->type), human_bytes(p->size), bootdir.c_str());
+    private:
+        struct Frame
+        {
+            uint32_t index;
+            vector<uint8_t> data;
+        };
+
+        nimg_comp_e comp;
+        int fd_out = -1;
+        Writeback *wb = nullptr;
+        FanOutWriter *fan = nullptr;
+        const nimg_frames_hdr_t& fh;
+        bool skip_unchanged;
+        size_t max_queued;
+
+        std::mutex lock;
+        std::condition_variable cond;
+        std::deque<Frame> queue;
+        size_t in_flight = 0; // frames queued or being decoded
+        bool done = false;
+        string error;
+        uint64_t skipped = 0;
+        vector<uint32_t> frame_crcs; // of the decompressed frames, for verifying
+        vector<std::thread> threads;
+
+        void worker(void)
+        {
+            vector<uint8_t> out(fh.frame_size), cmp(skip_unchanged ? fh.frame_size : 0);
+            std::unique_lock<std::mutex> lk(lock);
+            while (true)
+            {
+                cond.wait(lk, [this]{ return !queue.empty() || done || error.length(); });
+                if (queue.empty() || error.length())
+                    break;
+                Frame f = std::move(queue.front());
+                queue.pop_front();
+                lk.unlock();
+
+                const uint64_t off = (uint64_t)f.index * fh.frame_size;
+                const size_t len = min((uint64_t)fh.frame_size, fh.image_size - off);
+                string err;
+                uint64_t frame_skipped = 0;
+                if (decompress_frame(comp, f.data.data(), f.data.size(), out.data(), len) < 0)
+                    err = PError("frame %u failed to decompress", f.index).what();
+                else
+                {
+                    // each frame has its own slot, so no locking needed
+                    if (!frame_crcs.empty())
+                        xcrc32(&frame_crcs[f.index], out.data(), len);
+                    if (fan)
+                    {
+                        // FanOutWriter buffers are only buf_size, frames may be bigger
+                        try
+                        {
+                            for (size_t pos = 0; pos < len; )
+                            {
+                                size_t n = min(len - pos, PartWriter::buf_size);
+                                uint8_t *b = fan->get_buffer();
+                                memcpy(b, out.data() + pos, n);
+                                fan->submit(b, n, off + pos);
+                                pos += n;
+                            }
+                        }
+                        catch (exception& e) { err = e.what(); }
+                    }
+                    else if (skip_unchanged && pread(fd_out, cmp.data(), len, off) == (ssize_t)len &&
+                             !memcmp(out.data(), cmp.data(), len))
+                        frame_skipped = len;
+                    else
+                    {
+                        size_t pos = 0;
+                        while (pos < len)
+                        {
+                            ssize_t n = pwrite(fd_out, out.data() + pos, len - pos, off + pos);
+                            if (n <= 0)
+                            {
+                                err = PError("write failed: %s", strerror(errno)).what();
+                                break;
+                            }
+                            pos += n;
+                        }
+                        wb->wrote(off, pos);
+                    }
+                }
+
+                lk.lock();
+                if (err.length() && error.empty())
+                    error = err;
+                skipped += frame_skipped;
+                in_flight--;
+                cond.notify_all();
+            }
+        }
+
+        void start(void)
+        {
+            unsigned n_threads = max(std::thread::hardware_concurrency(), 1U);
+            max_queued = 2 * n_threads;
+            log_debug("decompressing with %u threads", n_threads);
+            for (unsigned i = 0; i < n_threads; i++)
+                threads.emplace_back(&FrameDecoder::worker, this);
+        }
+
+    public:
+        // with track_crc, the CRC32 of every decompressed frame is kept for image_crc()
+        FrameDecoder(nimg_comp_e comp_, int fd_out_, Writeback& wb_, const nimg_frames_hdr_t& fh_, bool skip_unchanged_,
+                     bool track_crc)
+            : comp(comp_), fd_out(fd_out_), wb(&wb_), fh(fh_), skip_unchanged(skip_unchanged_),
+              frame_crcs(track_crc ? fh_.n_frames : 0)
+        {
+            start();
+        }
+
+        // write to several devices, call fan.flush() after finish()
+        FrameDecoder(nimg_comp_e comp_, FanOutWriter& fan_, const nimg_frames_hdr_t& fh_, bool track_crc)
+            : comp(comp_), fan(&fan_), fh(fh_), skip_unchanged(false), frame_crcs(track_crc ? fh_.n_frames : 0)
+        {
+            start();
+        }
 
+        ~FrameDecoder(void)
+        {
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                done = true;
+                if (error.empty())
+                    error = "aborted";
+            }
+            cond.notify_all();
+            for (auto& t : threads)
+                if (t.joinable())
+                    t.join();
+        }
+
+        // get a buffer for the next compressed frame, waiting if too many are queued
+        Frame get_frame(uint32_t index, size_t size)
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            cond.wait(lk, [this]{ return in_flight < max_queued || error.length(); });
+            if (error.length())
+                throw PError(error);
+            return Frame{ index, vector<uint8_t>(size) };
+        }
+
+        void submit(Frame&& f)
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            queue.push_back(std::move(f));
+            in_flight++;
+            cond.notify_all();
+        }
+
+        // wait for everything to be written, throw if anything failed.
+        // Returns the number of bytes which were skipped because they were unchanged
+        uint64_t finish(void)
+        {
+            {
+                std::unique_lock<std::mutex> lk(lock);
+                done = true;
+                cond.notify_all();
+                cond.wait(lk, [this]{ return in_flight == 0 || error.length(); });
+            }
+            cond.notify_all();
+            for (auto& t : threads)
+                t.join();
+            if (error.length())
+                throw PError(error);
+            return skipped;
+        }
+
+        // CRC32 of the whole decompressed image, after finish()
+        uint32_t image_crc(void) const
+        {
+            uint32_t crc = 0;
+            for (uint32_t i = 0; i < frame_crcs.size(); i++)
+                crc = xcrc32_combine(crc, frame_crcs[i], min((uint64_t)fh.frame_size, fh.image_size - (uint64_t)i * fh.frame_size));
+            return crc;
+        }
+};
+
+// read and check the header and frame size table at the start of a compressed rootfs part
+static void read_frames_header(PartReader& in, const nimg_phdr_t *p, nimg_frames_hdr_t *fh,
+                               vector<uint32_t> *frame_sizes)
+{
+    if (p->size < sizeof(*fh))
+        THROW_ERROR("compressed part too small");
+    in.read_full(fh, sizeof(*fh));
+    if (fh->n_frames > (p->size - sizeof(*fh)) / sizeof(uint32_t))
+        THROW_ERROR("invalid compressed part header");
+    frame_sizes->resize(fh->n_frames);
+    in.read_full(frame_sizes->data(), fh->n_frames * sizeof(uint32_t));
+    if (nimg_frames_check(fh, frame_sizes->data(), p->size) < 0)
+        THROW_ERROR("invalid compressed part frame table");
+    log_info("image size %s in %u frames", human_bytes(fh->image_size), fh->n_frames);
+}
+
+/* Program a compressed rootfs part. Frames are read from the image (and the CRC
+ * checked) by this thread, then decompressed and written by a FrameDecoder.
+ */
+static void program_frames(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks, const string& dev)
+{
+    const nimg_comp_e comp = part_compression((nimg_ptype_e)p->type);
+    log_info("Program %s compressed part type %s (%s) to %s", compression_name(comp),
+             part_name_from_type((nimg_ptype_e)p->type), human_bytes(p->size), dev.c_str());
+
+    PartReader in(src, p->size, blocks);
+    nimg_frames_hdr_t fh;
+    vector<uint32_t> frame_sizes;
+    read_frames_header(in, p, &fh, &frame_sizes);
+
+    int fd_out = open(dev.c_str(), g_opts.skip_unchanged ? O_RDWR : O_WRONLY);
+    if (fd_out == -1)
+        THROW_ERRNO("Failed to open %s for writing", dev.c_str());
+
+    uint32_t crc, image_crc;
+    uint64_t skipped;
+    Writeback wb(fd_out, dev);
+    try
+    {
+        FrameDecoder dec(comp, fd_out, wb, fh, g_opts.skip_unchanged, g_opts.verify);
+        for (uint32_t i = 0; i < fh.n_frames; i++)
+        {
+            auto f = dec.get_frame(i, frame_sizes[i]);
+            in.read_full(f.data.data(), f.data.size());
+            dec.submit(std::move(f));
+        }
+        skipped = dec.finish();
+        image_crc = dec.image_crc();
+        crc = in.finish();
+        wb.sync();
+    }
+    catch (exception& e) { close(fd_out); throw; }
+    close(fd_out);
+
+    if (crc != p->crc32)
+        THROW_ERROR("CRC mismatch! expected 0x%08x, actual 0x%08x", p->crc32, crc);
+    if (g_opts.skip_unchanged)
+        log_info("%s unchanged, not written (%llu of %llu bytes)", human_bytes(skipped),
+                 (unsigned long long)skipped, (unsigned long long)fh.image_size);
+    if (g_opts.verify)
+        g_verify.start(dev, fh.image_size, image_crc, part_name_from_type((nimg_ptype_e)p->type));
+
+    log_info("Finished programming part %s", part_name_from_type((nimg_ptype_e)p->type));
+}
+
+// Collects the output of a decompressor into large aligned buffers and writes
+// them to a PartWriter. output() is a codec_output_fn called from C, so it
+// stores errors rather than throwing them.
+class DecodeWriter
+{
+    private:
+        PartWriter& out;
+        const bool skip_unchanged;
+        uint8_t *buf = nullptr;
+        size_t len = 0;     // bytes in buf
+
+        void write_buf(void)
+        {
+            uint8_t *b = buf;
+            buf = nullptr;
+            if (g_opts.verify)
+                xcrc32(&crc, b, len);
+            if (skip_unchanged && out.unchanged(b, len, offset))
+            {
+                out.release(b);
+                skipped += len;
+            }
+            else
+                out.submit(b, len, offset);
+            offset += len;
+            len = 0;
+        }
+
+    public:
+        uint64_t offset = 0;    // bytes written (or skipped) so far
+        uint64_t skipped = 0;
+        uint32_t crc = 0;       // CRC32 of the output with -v, for verifying
+        string error;
+
+        DecodeWriter(PartWriter& out_, bool skip_unchanged_) : out(out_), skip_unchanged(skip_unchanged_) {}
+
+        ~DecodeWriter(void)
+        {
+            if (buf)
+                out.release(buf);
+        }
+
+        static int output(void *arg, const uint8_t *data, size_t count)
+        {
+            DecodeWriter *w = static_cast<DecodeWriter*>(arg);
+            try
+            {
+                while (count > 0)
+                {
+                    if (!w->buf)
+                        w->buf = w->out.get_buffer();
+                    size_t n = min(count, PartWriter::buf_size - w->len);
+                    memcpy(w->buf + w->len, data, n);
+                    w->len += n;
+                    data += n;
+                    count -= n;
+                    if (w->len == PartWriter::buf_size)
+                        w->write_buf();
+                }
+            }
+            catch (exception& e)
+            {
+                w->error = e.what();
+                return -1;
+            }
+            return 0;
+        }
+
+        // write the last partial buffer and wait for everything to be written
+        void finish(void)
+        {
+            if (len)
+                write_buf();
+            out.flush();
+        }
+};
+
+/* Program a compressed raw part by decompressing it in this process, if there's a
+ * library for its compression type. Returns false if there isn't.
+ */
+static bool program_decompress(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks, const string& dev)
+{
+    const nimg_comp_e comp = part_compression((nimg_ptype_e)p->type);
+    DeviceWriter out(dev, g_opts.skip_unchanged);
+    DecodeWriter w(out, g_opts.skip_unchanged);
+    std::unique_ptr<codec_t, void(*)(codec_t*)> dec(decompressor_new(comp, DecodeWriter::output, &w), codec_free);
+    if (!dec)
+        return false;
+    log_debug("decompressing with built-in %s, writing with %s", compression_name(comp), out.backend());
+
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    PartReader in(src, p->size, blocks);
+    while (in.remaining())
+    {
+        const uint8_t *data;
+        size_t n = in.get(&data, in.remaining());
+        if (codec_update(dec.get(), data, n) < 0)
+            THROW_ERROR("%s", w.error.length() ? w.error.c_str() : "failed to decompress image");
+    }
+    if (codec_finish(dec.get()) < 0)
+        THROW_ERROR("%s", w.error.length() ? w.error.c_str() : "failed to decompress image");
+    w.finish();
+    uint32_t crc = in.finish();
+
+    if (crc != p->crc32)
+        THROW_ERROR("CRC mismatch! expected 0x%08x, actual 0x%08x", p->crc32, crc);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    double sec = (ts_end.tv_sec - ts_start.tv_sec) + (ts_end.tv_nsec - ts_start.tv_nsec) / 1e9;
+    log_info("decompressed to %s (%llu bytes) in %.1f seconds", human_bytes(w.offset),
+             (unsigned long long)w.offset, sec);
+    if (sec > 0)
+        log_info("average write speed %s/s", human_bytes((size_t)(w.offset / sec)));
+    if (g_opts.skip_unchanged)
+        log_info("%s unchanged, not written (%llu of %llu bytes)", human_bytes(w.skipped),
+                 (unsigned long long)w.skipped, (unsigned long long)w.offset);
+    if (g_opts.verify)
+        g_verify.start(dev, w.offset, w.crc, part_name_from_type((nimg_ptype_e)p->type));
+    return true;
+}
+
+/* Program a delta rootfs part. The new image is rebuilt in order from runs of
+ * blocks copied from base_dev (the active rootfs bank) and runs stored in the
+ * part, and written to dev. Every run and the whole new image are checked
+ * against their CRC32s, so a base which isn't the image the delta was made
+ * from is detected.
+ */
+static void program_delta(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks,
+                          const string& base_dev, const string& dev)
+{
+    log_info("Program delta part type %s (%s) to %s, based on %s",
+             part_name_from_type((nimg_ptype_e)p->type), human_bytes(p->size), dev.c_str(), base_dev.c_str());
+
+    PartReader in(src, p->size, blocks);
+    nimg_delta_hdr_t dh;
+    if (p->size < sizeof(dh))
+        THROW_ERROR("delta part too small");
+    in.read_full(&dh, sizeof(dh));
+    if (dh.n_ops > (p->size - sizeof(dh)) / sizeof(nimg_delta_op_t))
+        THROW_ERROR("invalid delta part header");
+    vector<nimg_delta_op_t> ops(dh.n_ops);
+    in.read_full(ops.data(), dh.n_ops * sizeof(nimg_delta_op_t));
+    if (nimg_delta_check(&dh, ops.data(), p->size) < 0)
+        THROW_ERROR("invalid delta part op table");
+    log_info("image size %s in %u runs", human_bytes(dh.image_size), dh.n_ops);
+
+    int base_fd = open(base_dev.c_str(), O_RDONLY | O_CLOEXEC);
+    if (base_fd == -1)
+        THROW_ERRNO("Failed to open %s for reading", base_dev.c_str());
+    uint64_t copied = 0;
+    uint32_t crc, image_crc = 0;
+    DeviceWriter out(dev, g_opts.skip_unchanged);
+    DecodeWriter w(out, g_opts.skip_unchanged);
+    try
+    {
+        struct stat sb;
+        uint64_t base_size = 0;
+        if (fstat(base_fd, &sb) < 0)
+            THROW_ERRNO("stat failed");
+        if (S_ISBLK(sb.st_mode))
+        {
+            if (ioctl(base_fd, BLKGETSIZE64, &base_size) != 0)
+                THROW_ERRNO("failed to get the size of %s", base_dev.c_str());
+        }
+        else
+            base_size = sb.st_size;
+        if (base_size < dh.base_size)
+            THROW_ERROR("%s is smaller than the %llu byte base image of the delta", base_dev.c_str(),
+                        (unsigned long long)dh.base_size);
+        posix_fadvise(base_fd, 0, dh.base_size, POSIX_FADV_SEQUENTIAL);
+
+        vector<uint8_t> buf(DeviceWriter::buf_size);
+        uint64_t block = 0;
+        for (uint32_t i = 0; i < dh.n_ops; i++)
+        {
+            const nimg_delta_op_t& op = ops[i];
+            const bool stored = (op.src_offset == NIMG_DELTA_STORED);
+            uint64_t len = nimg_delta_op_len(&dh, block, op.n_blocks);
+            uint32_t op_crc = 0;
+            for (uint64_t done = 0; done < len; )
+            {
+                const uint8_t *data = buf.data();
+                size_t n;
+                if (stored)
+                    n = in.get(&data, min(len - done, (uint64_t)SIZE_MAX));
+                else
+                {
+                    ssize_t r = pread(base_fd, buf.data(), min(len - done, (uint64_t)buf.size()), op.src_offset + done);
+                    if (r < 0 && errno == EINTR)
+                        continue;
+                    if (r <= 0)
+                        THROW_ERRNO("failed to read %s", base_dev.c_str());
+                    n = r;
+                }
+                xcrc32(&op_crc, data, n);
+                if (DecodeWriter::output(&w, data, n) < 0)
+                    THROW_ERROR("%s", w.error.c_str());
+                done += n;
+            }
+            if (op_crc != op.crc32)
+            {
+                if (stored)
+                    THROW_ERROR("delta part data is corrupt (run %u)", i);
+                THROW_ERROR("%s doesn't match the base image of the delta part (run %u at offset %llu)",
+                            base_dev.c_str(), i, (unsigned long long)op.src_offset);
+            }
+            image_crc = xcrc32_combine(image_crc, op_crc, len);
+            if (!stored)
+                copied += len;
+            block += op.n_blocks;
+        }
+        w.finish();
+        crc = in.finish();
+        // the base is the running rootfs device, don't leave a second copy of it cached
+        posix_fadvise(base_fd, 0, dh.base_size, POSIX_FADV_DONTNEED);
+    }
+    catch (exception& e) { close(base_fd); throw; }
+    close(base_fd);
+
+    if (crc != p->crc32)
+        THROW_ERROR("CRC mismatch! expected 0x%08x, actual 0x%08x", p->crc32, crc);
+    if (image_crc != dh.image_crc32)
+        THROW_ERROR("rebuilt image CRC mismatch! expected 0x%08x, actual 0x%08x", dh.image_crc32, image_crc);
+
+    log_info("%s copied from %s", human_bytes(copied), base_dev.c_str());
+    if (g_opts.skip_unchanged)
+        log_info("%s unchanged, not written (%llu of %llu bytes)", human_bytes(w.skipped),
+                 (unsigned long long)w.skipped, (unsigned long long)dh.image_size);
+    if (g_opts.verify)
+        g_verify.start(dev, dh.image_size, dh.image_crc32, part_name_from_type((nimg_ptype_e)p->type));
+    log_info("Finished programming part %s", part_name_from_type((nimg_ptype_e)p->type));
+}
+
+/* Extract a boot tar part with a forked tar process. Used when there's no library
+ * to decompress it.
+ */
+static void program_boot_tar_exec(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks, const string& bootdir)
+{
     int pfd[2];
     if (pipe2(pfd, O_CLOEXEC) == -1)
         THROW_ERRNO("pipe failed");
@@ -143,14 +1163,14 @@ static void program_boot_tar(const CPipe& curl, const nimg_phdr_t *p, const stri
     // main process
     close(pfd[0]); // close read end of pipe
     uint32_t crc;
-    try { crc = file_copy_crc32_progress(curl.fd, pfd[1], p->size); }
+    try { crc = file_copy_crc32_progress(src, pfd[1], p->size, blocks); }
     catch (exception& e)
     {
         close(pfd[1]);
         kill(tar_pid, SIGKILL);
         int wstatus;
         waitpid(tar_pid, &wstatus, 0);
-        throw PError("%s\nFailed to program boot files! YOUR BOARD MAY NOT BOOT!", e.what());
+        throw;
     }
 
     close(pfd[1]);
@@ -159,11 +1179,160 @@ static void program_boot_tar(const CPipe& curl, const nimg_phdr_t *p, const stri
 
     if (crc != p->crc32)
         THROW_ERROR("CRC mismatch! expected 0x%08x, actual 0x%08x", p->crc32, crc);
+}
+
+/* Extract a boot tar part in this process, decompressing it if needed. Returns
+ * false if there's no library for its compression type.
+ * For indexed parts, the file index is compared with the files already in bootdir
+ * first, and only the files which changed are written.
+ */
+static bool program_boot_tar_native(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks,
+                                    const string& bootdir)
+{
+    const nimg_comp_e comp = boot_tar_compression((nimg_ptype_e)p->type);
+    const bool indexed = nimg_ptype_is_indexed((nimg_ptype_e)p->type);
+
+    TarExtractor tar(bootdir);
+    std::unique_ptr<codec_t, void(*)(codec_t*)> dec(nullptr, codec_free);
+    if (comp != NIMG_COMP_NONE)
+    {
+        dec.reset(decompressor_new(comp, TarExtractor::output, &tar));
+        if (!dec && indexed)
+            THROW_ERROR("%s support is needed to extract indexed boot files", compression_name(comp));
+        if (!dec)
+            return false;
+    }
+
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    PartReader in(src, p->size, blocks);
+    if (indexed)
+    {
+        nimg_fileidx_hdr_t ih;
+        if (p->size < sizeof(ih))
+            THROW_ERROR("boot tar part too small");
+        in.read_full(&ih, sizeof(ih));
+        if (ih.size < sizeof(ih) || ih.size > p->size || ih.size > NIMG_FILEIDX_SIZE_MAX)
+            THROW_ERROR("invalid boot tar file index header");
+        vector<uint8_t> entries(ih.size - sizeof(ih));
+        in.read_full(entries.data(), entries.size());
+        if (nimg_fileidx_check(&ih, entries.data(), p->size) < 0)
+            THROW_ERROR("invalid boot tar file index");
+        unsigned n = tar.skip_unchanged(entries.data(), ih.n_files);
+        log_info("%u of %u files in %s are unchanged", n, ih.n_files, bootdir.c_str());
+    }
+    while (in.remaining())
+    {
+        const uint8_t *data;
+        size_t n = in.get(&data, in.remaining());
+        if (!dec)
+            tar.feed(data, n);
+        else if (codec_update(dec.get(), data, n) < 0)
+            THROW_ERROR("%s", tar.error.length() ? tar.error.c_str() : "failed to decompress boot files");
+    }
+    if (dec && codec_finish(dec.get()) < 0)
+        THROW_ERROR("%s", tar.error.length() ? tar.error.c_str() : "failed to decompress boot files");
+    tar.finish();
+    uint32_t crc = in.finish();
+    if (crc != p->crc32)
+        THROW_ERROR("CRC mismatch! expected 0x%08x, actual 0x%08x", p->crc32, crc);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    double sec = (ts_end.tv_sec - ts_start.tv_sec) + (ts_end.tv_nsec - ts_start.tv_nsec) / 1e9;
+    log_info("extracted %u files (%s) in %.1f seconds", tar.n_files, human_bytes(tar.total_bytes), sec);
+    if (indexed)
+        log_info("%u unchanged files skipped", tar.n_unchanged);
+    return true;
+}
+
+/* Program a boot tar part. A marker file in bootdir shows that it's being updated,
+ * and is only removed after all of the files have been synced. If the update is
+ * interrupted, the marker is left so that a partially written /boot can be detected.
+ */
+static void program_boot_tar(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks, const string& bootdir)
+{
+    log_info("Program part type %s (%s) to %s",
+             part_name_from_type((nimg_ptype_e)p->type), human_bytes(p->size), bootdir.c_str());
+
+    try
+    {
+        mark_dir_incomplete(bootdir);
+        if (!program_boot_tar_native(src, p, blocks, bootdir))
+            program_boot_tar_exec(src, p, blocks, bootdir);
+        mark_dir_complete(bootdir);
+    }
+    catch (exception& e)
+    {
+        throw PError("%s\nFailed to program boot files! YOUR BOARD MAY NOT BOOT!", e.what());
+    }
 
     log_info("Finished programming part %s", part_name_from_type((nimg_ptype_e)p->type));
 }
 
-static void program_boot_img(const CPipe& curl, const nimg_phdr_t *p)
+/* Program a compressed raw part by piping it through a forked decompressor
+ * process, which writes to dev. Used when there's no library for the compression type.
+ */
+static void program_decompress_exec(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks,
+                                    const string& dev, const char *decompressor)
+{
+    int pfd[2];
+    if (pipe2(pfd, O_CLOEXEC) == -1)
+        THROW_ERRNO("pipe failed");
+
+    pid_t dec_pid = fork();
+    if (dec_pid == -1)
+        THROW_ERRNO("fork failed");
+
+    if (dec_pid == 0)
+    {
+        // child process, open the device for writing as stdout and exec our decompressor
+        dup2(pfd[0], STDIN_FILENO); // redirect stdin to read end of pipe
+        int dev_fd = open(dev.c_str(), O_WRONLY | O_CLOEXEC);
+        if (dev_fd < 1)
+        {
+            fprintf(stderr, "Failed to open %s for writing: %s\n", dev.c_str(), strerror(errno));
+            _exit(98);
+        }
+        dup2(dev_fd, STDOUT_FILENO); // redirect stdout to device we just opened
+
+        do_exec(vector<const char*>{decompressor, "-dc", NULL});
+    }
+
+    // main process
+    log_debug("spawned child decompressor process PID %d", dec_pid);
+    close(pfd[0]); // close read end of pipe
+    uint32_t crc;
+    try { crc = file_copy_crc32_progress(src, pfd[1], p->size, blocks); }
+    catch (exception& e)
+    {
+        close(pfd[1]);
+        kill(dec_pid, SIGKILL);
+        int wstatus;
+        waitpid(dec_pid, &wstatus, 0);
+        throw;
+    }
+
+    close(pfd[1]);
+    CPipe dec_cp = { .pid = dec_pid, .fd = -1, .running = true};
+    cpipe_wait(dec_cp, true);
+    if (crc != p->crc32)
+        THROW_ERROR("CRC mismatch! expected 0x%08x, actual 0x%08x", p->crc32, crc);
+
+    // the decompressor wrote through the page cache, flush just this device
+    int dev_fd = open(dev.c_str(), O_WRONLY | O_CLOEXEC);
+    if (dev_fd == -1)
+        THROW_ERRNO("Failed to open %s", dev.c_str());
+    try { Writeback(dev_fd, dev).sync(); }
+    catch (exception& e) { close(dev_fd); throw; }
+    close(dev_fd);
+
+    // we never see the decompressed data, so there's nothing to compare with
+    if (g_opts.verify)
+        log_warn("can't verify %s, it was decompressed by %s", dev.c_str(), decompressor);
+}
+
+static void program_boot_img(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks, Journal *journal)
 {
     struct mntent bootmnt = {};
     bool was_mounted = find_mntent(g_opts.boot_dev, &bootmnt);
@@ -182,79 +1351,37 @@ static void program_boot_img(const CPipe& curl, const nimg_phdr_t *p)
         if (p->type == NIMG_PTYPE_BOOT_IMG)
         {
             // directly flash uncompressed image
-            program_raw(curl, p, g_opts.boot_dev);
+            program_raw(src, p, blocks, g_opts.boot_dev, journal);
         }
         else
         {
-            // image is compressed, fork to decompressor and write
-            const char *decompressor = NULL;
-            switch (p->type)
-            {
-                case NIMG_PTYPE_BOOT_IMG_GZ:
-                    decompressor = "gzip";
-                    break;
-                case NIMG_PTYPE_BOOT_IMG_XZ:
-                    decompressor = "xz";
-                    break;
-                case NIMG_PTYPE_BOOT_IMG_ZSTD:
-                    decompressor = "zstd";
-                    break;
-                default:
-                    break;
-            }
-            if (!decompressor) // if this fails, the switch above is incomplete
+            const nimg_comp_e comp = part_compression((nimg_ptype_e)p->type);
+            const char *decompressor = compression_name(comp);
+            if (comp == NIMG_COMP_NONE) // if this fails, part_compression is incomplete
                 throw PError("BUG! No decompressor found for part type %s", part_name_from_type((nimg_ptype_e)p->type));
 
             log_info("Program compressed raw part type %s (%s) to %s",
                      part_name_from_type((nimg_ptype_e)p->type), human_bytes(p->size), g_opts.boot_dev.c_str());
 
-            int pfd[2];
-            if (pipe2(pfd, O_CLOEXEC) == -1)
-                THROW_ERRNO("pipe failed");
-
-            pid_t dec_pid = fork();
-            if (dec_pid == -1)
-                THROW_ERRNO("fork failed");
-
-            if (dec_pid == 0)
+            try
             {
-                // child process, open the device for writing as stdout and exec our decompressor
-                dup2(pfd[0], STDIN_FILENO); // redirect stdin to read end of pipe
-                int dev_fd = open(g_opts.boot_dev.c_str(), O_WRONLY | O_CLOEXEC);
-                if (dev_fd < 1)
-                {
-                    fprintf(stderr, "Failed to open %s for writing: %s\n", g_opts.boot_dev.c_str(), strerror(errno));
-                    _exit(98);
-                }
-                dup2(dev_fd, STDOUT_FILENO); // redirect stdout to device we just opened
-
-                do_exec(vector<const char*>{decompressor, "-dc", NULL});
+                if (!program_decompress(src, p, blocks, g_opts.boot_dev))
+                    program_decompress_exec(src, p, blocks, g_opts.boot_dev, decompressor);
             }
-
-            // main process
-            log_debug("spawned child decompressor process PID %d", dec_pid);
-            close(pfd[0]); // close read end of pipe
-            uint32_t crc;
-            try { crc = file_copy_crc32_progress(curl.fd, pfd[1], p->size); }
             catch (exception& e)
             {
-                close(pfd[1]);
-                kill(dec_pid, SIGKILL);
-                int wstatus;
-                waitpid(dec_pid, &wstatus, 0);
                 throw PError("%s\nFailed to program boot image! YOUR BOARD MAY NOT BOOT!", e.what());
             }
-
-            close(pfd[1]);
-            CPipe dec_cp = { .pid = dec_pid, .fd = -1, .running = true};
-            cpipe_wait(dec_cp, true);
-            if (crc != p->crc32)
-                THROW_ERROR("CRC mismatch! expected 0x%08x, actual 0x%08x", p->crc32, crc);
             log_info("Finished programming part %s", part_name_from_type((nimg_ptype_e)p->type));
         }
     }
     catch (exception& e) { err_msg += e.what(); }
 
+    // mounting may write to the filesystem (e.g. the FAT dirty flag), so the
+    // readback has to be done first
+    if (was_mounted && err_msg.empty() && !g_verify.wait())
+        err_msg = "verification failed, YOUR BOARD MAY NOT BOOT!";
+
     // try to remount
     if (was_mounted)
     {
@@ -284,33 +1411,242 @@ static void program_boot_img(const CPipe& curl, const nimg_phdr_t *p)
     log_info("Finished programming boot image");
 }
 
+// target sets (-o) which failed while writing an earlier part, they're skipped from then on
+static vector<bool> targets_failed;
+
+size_t failed_targets(void)
+{
+    size_t n = 0;
+    for (bool f : targets_failed)
+        n += f;
+    return n;
+}
+
+static bool is_mounted(const string& dev)
+{
+    struct mntent m = {};
+    if (!find_mntent(dev, &m))
+        return false;
+    free(m.mnt_fsname);
+    free(m.mnt_dir);
+    free(m.mnt_type);
+    free(m.mnt_opts);
+    return true;
+}
+
+/* Program a part to every target set given with -o at once. The part is downloaded
+ * and checked once and written to all the devices by a FanOutWriter. Only part types
+ * which are written to a block device in this process are supported, so not delta
+ * parts (which need a base), boot tarballs (which need a mounted filesystem), or
+ * boot images without a built-in decompressor.
+ */
+static void program_fanout(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks)
+{
+    const nimg_ptype_e type = static_cast<nimg_ptype_e>(p->type);
+    const nimg_comp_e comp = part_compression(type);
+    bool boot;
+    switch (type)
+    {
+        case NIMG_PTYPE_BOOT_IMG:
+        case NIMG_PTYPE_BOOT_IMG_GZ:
+        case NIMG_PTYPE_BOOT_IMG_XZ:
+        case NIMG_PTYPE_BOOT_IMG_ZSTD:
+            boot = true;
+            break;
+        case NIMG_PTYPE_ROOTFS:
+        case NIMG_PTYPE_ROOTFS_RW:
+        case NIMG_PTYPE_ROOTFS_SPARSE:
+        case NIMG_PTYPE_ROOTFS_RW_SPARSE:
+        case NIMG_PTYPE_ROOTFS_GZ:
+        case NIMG_PTYPE_ROOTFS_XZ:
+        case NIMG_PTYPE_ROOTFS_ZSTD:
+        case NIMG_PTYPE_ROOTFS_RW_GZ:
+        case NIMG_PTYPE_ROOTFS_RW_XZ:
+        case NIMG_PTYPE_ROOTFS_RW_ZSTD:
+            boot = false;
+            break;
+        default:
+            THROW_ERROR("part type %s can't be written to several devices (-o)", part_name_from_type(type));
+    }
+
+    targets_failed.resize(g_opts.targets.size());
+    vector<size_t> sets;    // indexes in g_opts.targets
+    stringvec devs;
+    for (size_t i = 0; i < g_opts.targets.size(); i++)
+    {
+        if (targets_failed[i])
+            continue;
+        const string& dev = boot ? g_opts.targets[i].boot : g_opts.targets[i].rootfs;
+        if (dev.empty())
+            THROW_ERROR("no boot device given for %s, needed for part type %s",
+                        g_opts.targets[i].rootfs.c_str(), part_name_from_type(type));
+        if (is_mounted(dev))
+            THROW_ERROR("%s is mounted, not writing to it", dev.c_str());
+        sets.push_back(i);
+        devs.push_back(dev);
+    }
+    if (devs.empty())
+        THROW_ERROR("writing failed on all target devices");
+    log_info("Program part type %s (%s) to %zu devices: %s", part_name_from_type(type), human_bytes(p->size),
+             devs.size(), join_words(devs, " ").c_str());
+
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    FanOutWriter fan(devs);
+    PartReader in(src, p->size, blocks);
+    uint64_t image_size = p->size;  // bytes written to each device
+    uint32_t image_crc = p->crc32;  // of the data on each device, for verifying
+    if (comp == NIMG_COMP_NONE && type != NIMG_PTYPE_ROOTFS_SPARSE && type != NIMG_PTYPE_ROOTFS_RW_SPARSE)
+        copy_part_direct(in, fan, 0, p->size, false, nullptr, 0);
+    else if (boot)
+    {
+        DecodeWriter w(fan, false);
+        std::unique_ptr<codec_t, void(*)(codec_t*)> dec(decompressor_new(comp, DecodeWriter::output, &w), codec_free);
+        if (!dec)
+            THROW_ERROR("no built-in %s decompressor, part type %s can't be written to several devices (-o)",
+                        compression_name(comp), part_name_from_type(type));
+        while (in.remaining())
+        {
+            const uint8_t *data;
+            size_t n = in.get(&data, in.remaining());
+            if (codec_update(dec.get(), data, n) < 0)
+                THROW_ERROR("%s", w.error.length() ? w.error.c_str() : "failed to decompress image");
+        }
+        if (codec_finish(dec.get()) < 0)
+            THROW_ERROR("%s", w.error.length() ? w.error.c_str() : "failed to decompress image");
+        w.finish();
+        image_size = w.offset;
+        image_crc = w.crc;
+    }
+    else if (comp == NIMG_COMP_NONE)
+    {
+        nimg_sparse_hdr_t sh;
+        vector<nimg_extent_t> extents;
+        read_sparse_header(in, p, &sh, &extents);
+        uint64_t pos = 0;
+        image_crc = 0;
+        for (size_t i = 0; i <= extents.size(); i++)
+        {
+            uint64_t next = (i < extents.size()) ? extents[i].offset : sh.image_size;
+            fan.zero(pos, next - pos);
+            image_crc = xcrc32_combine(image_crc, 0, next - pos);
+            if (i == extents.size())
+                break;
+
+            for (uint64_t off = 0; off < extents[i].len; )
+            {
+                size_t n = min(PartWriter::buf_size, extents[i].len - off);
+                uint8_t *buf = fan.get_buffer();
+                try { in.read_full(buf, n); }
+                catch (exception& e) { fan.release(buf); throw; }
+                if (g_opts.verify)
+                {
+                    uint32_t c = 0;
+                    xcrc32(&c, buf, n);
+                    image_crc = xcrc32_combine(image_crc, c, n);
+                }
+                fan.submit(buf, n, extents[i].offset + off);
+                off += n;
+            }
+            pos = extents[i].offset + extents[i].len;
+        }
+        fan.flush();
+        image_size = sh.image_size;
+    }
+    else
+    {
+        nimg_frames_hdr_t fh;
+        vector<uint32_t> frame_sizes;
+        read_frames_header(in, p, &fh, &frame_sizes);
+        FrameDecoder dec(comp, fan, fh, g_opts.verify);
+        for (uint32_t i = 0; i < fh.n_frames; i++)
+        {
+            auto f = dec.get_frame(i, frame_sizes[i]);
+            in.read_full(f.data.data(), f.data.size());
+            dec.submit(std::move(f));
+        }
+        dec.finish();
+        fan.flush();
+        image_size = fh.image_size;
+        image_crc = dec.image_crc();
+    }
+    uint32_t crc = in.finish();
+    if (crc != p->crc32)
+        THROW_ERROR("CRC mismatch! expected 0x%08x, actual 0x%08x", p->crc32, crc);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    double sec = (ts_end.tv_sec - ts_start.tv_sec) + (ts_end.tv_nsec - ts_start.tv_nsec) / 1e9;
+    if (sec > 0)
+        log_info("wrote %s to each device in %.1f seconds", human_bytes(image_size), sec);
+
+    for (size_t k = 0; k < sets.size(); k++)
+    {
+        if (fan.failed(k))
+        {
+            log_error("not writing any more parts to %s", devs[k].c_str());
+            targets_failed[sets[k]] = true;
+        }
+        else if (g_opts.verify)
+            g_verify.start(devs[k], image_size, image_crc, part_name_from_type(type));
+    }
+    log_info("Finished programming part %s", part_name_from_type(type));
+}
+
 // program a partition with the given header and check the CRC
 // throw an exception if anything goes wrong
-void program_part(CPipe& curl, const nimg_phdr_t *p, const stringvec& cmdline)
+void program_part(ImageSource& src, const nimg_phdr_t *p, const PartBlocks& blocks, const stringvec& cmdline,
+                  Journal *journal)
 {
     nimg_ptype_e type = static_cast<nimg_ptype_e>(p->type);
     if (type > NIMG_PTYPE_LAST)
         THROW_ERROR("invalid part type %u", type);
 
     log_info("program part type %s", part_name_from_type(type));
+    if (!g_opts.targets.empty())
+    {
+        program_fanout(src, p, blocks);
+        return;
+    }
     switch (type)
     {
         case NIMG_PTYPE_BOOT_IMG:
         case NIMG_PTYPE_BOOT_IMG_GZ:
         case NIMG_PTYPE_BOOT_IMG_XZ:
         case NIMG_PTYPE_BOOT_IMG_ZSTD:
-            program_boot_img(curl, p);
+            program_boot_img(src, p, blocks, journal);
             break;
 
         case NIMG_PTYPE_ROOTFS:
         case NIMG_PTYPE_ROOTFS_RW:
-            program_raw(curl, p, _get_inactive_dev(cmdline));
+            program_raw(src, p, blocks, _get_inactive_dev(cmdline), journal);
+            break;
+
+        case NIMG_PTYPE_ROOTFS_SPARSE:
+        case NIMG_PTYPE_ROOTFS_RW_SPARSE:
+            program_sparse(src, p, blocks, _get_inactive_dev(cmdline));
+            break;
+
+        case NIMG_PTYPE_ROOTFS_GZ:
+        case NIMG_PTYPE_ROOTFS_XZ:
+        case NIMG_PTYPE_ROOTFS_ZSTD:
+        case NIMG_PTYPE_ROOTFS_RW_GZ:
+        case NIMG_PTYPE_ROOTFS_RW_XZ:
+        case NIMG_PTYPE_ROOTFS_RW_ZSTD:
+            program_frames(src, p, blocks, _get_inactive_dev(cmdline));
+            break;
+
+        case NIMG_PTYPE_ROOTFS_DELTA:
+            program_delta(src, p, blocks, _get_active_dev(cmdline), _get_inactive_dev(cmdline));
             break;
 
         case NIMG_PTYPE_BOOT_TAR:
         case NIMG_PTYPE_BOOT_TARGZ:
         case NIMG_PTYPE_BOOT_TARXZ:
-            program_boot_tar(curl, p, get_boot_dir());
+        case NIMG_PTYPE_BOOT_TAR_IDX:
+        case NIMG_PTYPE_BOOT_TARGZ_IDX:
+        case NIMG_PTYPE_BOOT_TARXZ_IDX:
+            program_boot_tar(src, p, blocks, get_boot_dir());
             break;
 
         default:
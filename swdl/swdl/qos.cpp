@@ -0,0 +1,170 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "newbs-swdl.h"
+
+// from linux/ioprio.h, which older kernel headers don't export
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_WHO_PROCESS  1
+
+IoQos g_qos;
+
+double monotonic_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void TokenBucket::set_rate(uint64_t bytes_per_sec)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    const double t = monotonic_sec();
+    if (rate > 0)
+        tokens = min(burst, tokens + (t - last) * rate);
+    else
+        tokens = 0;
+    last = t;
+    rate = bytes_per_sec;
+    // allow a quarter second of data at once, but at least one buffer
+    burst = max(rate / 4, 1048576.0);
+}
+
+void TokenBucket::take(size_t n)
+{
+    double wait;
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        if (rate == 0)
+            return;
+        const double t = monotonic_sec();
+        tokens = min(burst, tokens + (t - last) * rate);
+        last = t;
+        // go into debt rather than waiting for all n bytes worth of tokens, so that
+        // concurrent callers queue up behind each other
+        tokens -= n;
+        if (tokens >= 0)
+            return;
+        wait = -tokens / rate;
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+}
+
+void IoQos::configure(uint64_t max_rate_, bool background)
+{
+    max_rate = max_rate_;
+    adaptive = background;
+    reads.set_rate(max_rate);
+    writes.set_rate(max_rate);
+    if (max_rate)
+        log_info("Limiting downloads and device writes to %s/s", human_bytes(max_rate));
+
+    if (background)
+    {
+        // threads, curl and decompressor children started later inherit both of these.
+        // The idle I/O class only has an effect with the BFQ scheduler, the throttling
+        // in write_latency() works with any scheduler
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+            log_warn("failed to set idle I/O priority: %s", strerror(errno));
+        if (setpriority(PRIO_PROCESS, 0, 19) < 0)
+            log_warn("failed to set CPU niceness: %s", strerror(errno));
+        log_info("Running in the background: idle I/O priority, nice 19, adaptive write throttling");
+        sample_start = monotonic_sec();
+    }
+}
+
+void IoQos::write(size_t n)
+{
+    writes.take(n);
+    if (!adaptive)
+        return;
+
+    std::lock_guard<std::mutex> lk(lock);
+    sample_bytes += n;
+    const double t = monotonic_sec(), elapsed = t - sample_start;
+    if (elapsed >= 0.5)
+    {
+        const double rate = sample_bytes / elapsed;
+        observed = observed ? (observed * 0.7 + rate * 0.3) : rate;
+        if (!throttle)
+            peak = max(peak, observed);
+        sample_bytes = 0;
+        sample_start = t;
+    }
+}
+
+void IoQos::write_latency(size_t n, double sec, bool buffered)
+{
+    // small writes are dominated by syscall overhead rather than the device
+    if (!adaptive || n < 262144)
+        return;
+
+    std::lock_guard<std::mutex> lk(lock);
+    const double lat = sec * 1048576 / n; // seconds per MiB
+    const double t = monotonic_sec();
+    double& base = base_lat[buffered];
+    if (base == 0 || lat < base)
+        base = lat;
+
+    // buffered writes normally don't wait for the device at all, so their baseline is
+    // about 0 and any wait longer than 5ms per MiB counts as congestion
+    uint64_t new_throttle = throttle;
+    if (lat > base * spike_factor && lat > 0.005)
+    {
+        // the device is congested: halve the write rate, at most every 200ms so that
+        // one spike seen by several writes in flight only counts once
+        if (t - last_change < 0.2)
+            return;
+        double cur = throttle ? throttle : (observed ? observed : n / sec);
+        if (max_rate)
+            cur = min(cur, (double)max_rate);
+        if (!throttle)
+            peak = max(peak, cur);
+        new_throttle = max((uint64_t)(cur / 2), min_rate);
+    }
+    else if (throttle)
+    {
+        // back to normal: speed up again slowly, and stop throttling at the cap or
+        // the rate we had before throttling
+        if (t - last_change < 1.0)
+            return;
+        new_throttle = throttle + max(throttle / 8, min_rate);
+        if ((max_rate && new_throttle >= max_rate) || (!max_rate && new_throttle >= peak))
+            new_throttle = 0;
+    }
+    if (new_throttle == throttle)
+        return;
+
+    last_change = t;
+    throttle = new_throttle;
+    if (throttle)
+        log_debug("write latency %.1f ms/MB (normally %.1f), throttling writes to %lluKB/s",
+                  lat * 1000, base * 1000, (unsigned long long)(throttle / 1024));
+    else
+        log_debug("write latency back to normal, stopped throttling");
+    writes.set_rate(throttle ? throttle : max_rate);
+}
@@ -0,0 +1,662 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "newbs-swdl.h"
+
+// files up to this size are collected in memory and written by the pool
+#define SMALL_FILE_MAX ((size_t)1 << 20)
+// large files are written in batches of this size
+#define WRITE_BATCH_SIZE ((size_t)1 << 20)
+
+// number of files to open at once when comparing them with a file index
+#define COMPARE_BATCH 256
+
+// created in a directory while it's being updated, and removed once everything is synced
+#define INCOMPLETE_MARKER ".newbs-swdl-incomplete"
+
+// make path relative to the extraction directory with tar_clean_path, the same way
+// mknImage does for file indexes. Returns false for paths which could escape it
+static bool clean_path(string& path)
+{
+    char *clean = tar_clean_path(path.c_str());
+    if (!clean)
+        return false;
+    path = clean;
+    free(clean);
+    return true;
+}
+
+// thrown for a member whose path goes through a symlink, which could point anywhere
+class UnsafePath : public PError
+{
+    public:
+        explicit UnsafePath(const PError& e) : PError(e) {}
+};
+
+// the directory containing a tar member, and the member's name in it
+struct ParentDir
+{
+    int fd = -1;
+    bool owned = false; // fd isn't the extraction directory itself
+    string name;
+
+    ParentDir(void) {}
+    ParentDir(const ParentDir&) = delete;
+    ~ParentDir(void)
+    {
+        if (owned)
+            close(fd);
+    }
+};
+
+// Open the directory containing path, which is relative to dirfd and already cleaned by
+// clean_path. Every directory on the way is opened with O_NOFOLLOW, so a symlink from the
+// archive (or one already in the directory) can't send a later member outside of it. This
+// is what openat2's RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS does, but works on kernels
+// before 5.6. With create, missing directories are made like mkdir -p.
+static void open_parent(int dirfd, const string& path, bool create, ParentDir& p)
+{
+    p.fd = dirfd;
+    size_t start = 0;
+    for (size_t slash = path.find('/'); slash != string::npos; start = slash + 1, slash = path.find('/', start))
+    {
+        const string comp = path.substr(start, slash - start);
+        int next = openat(p.fd, comp.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next == -1 && errno == ENOENT && create)
+        {
+            if (mkdirat(p.fd, comp.c_str(), 0755) != 0 && errno != EEXIST)
+                THROW_ERRNO("failed to create directory %s", path.substr(0, slash).c_str());
+            next = openat(p.fd, comp.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (next == -1)
+        {
+            int err = errno;
+            struct stat sb;
+            if ((err == ENOTDIR || err == ELOOP) && fstatat(p.fd, comp.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+                S_ISLNK(sb.st_mode))
+                throw UnsafePath(PError("%s is a symlink", path.substr(0, slash).c_str()));
+            errno = err;
+            THROW_ERRNO("failed to open directory %s", path.substr(0, slash).c_str());
+        }
+        if (p.owned)
+            close(p.fd);
+        p.fd = next;
+        p.owned = true;
+    }
+    p.name = path.substr(start);
+}
+
+// create (or truncate) a file for writing. An existing symlink is replaced rather than followed
+static int create_file(int dirfd, const string& path, mode_t mode)
+{
+    ParentDir p;
+    open_parent(dirfd, path, true, p);
+    for (int tries = 0; tries < 2; tries++)
+    {
+        int fd = openat(p.fd, p.name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, mode & 07777);
+        if (fd != -1)
+            return fd;
+        if (errno == ELOOP)
+            unlinkat(p.fd, p.name.c_str(), 0);
+        else
+            break;
+    }
+    THROW_ERRNO("failed to create %s", path.c_str());
+}
+
+static void write_file_data(int fd, const uint8_t *data, size_t len, const string& path)
+{
+    g_qos.write(len);
+    const size_t total = len;
+    const double start = monotonic_sec();
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            THROW_ERRNO("failed to write %s", path.c_str());
+        data += n;
+        len -= n;
+    }
+    // buffered writes only block when the kernel throttles dirty pages
+    g_qos.write_latency(total, monotonic_sec() - start, true);
+}
+
+// set the mode and mtime of a file from the archive and close it. The mode and
+// time are best effort, e.g. vfat can't store permissions
+static void close_file_attrs(int fd, mode_t mode, int64_t mtime, const string& path)
+{
+    fchmod(fd, mode & 07777);
+    struct timespec ts[2] = { { .tv_sec = mtime, .tv_nsec = 0 }, { .tv_sec = mtime, .tv_nsec = 0 } };
+    futimens(fd, ts);
+    if (close(fd) != 0)
+        THROW_ERRNO("failed to write %s", path.c_str());
+}
+
+struct TarExtractor::Pool
+{
+    // limit on the data of small files waiting to be written
+    static const size_t max_queued = 16 << 20;
+
+    int dirfd;
+    vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<FileJob> jobs;
+    size_t queued_bytes = 0;
+    unsigned busy = 0;
+    bool stop = false;
+    string error;
+
+    Pool(int dirfd_) : dirfd(dirfd_)
+    {
+        unsigned n_threads = min(max(std::thread::hardware_concurrency(), 1U), 4U);
+        for (unsigned i = 0; i < n_threads; i++)
+            threads.emplace_back(&Pool::worker, this);
+    }
+
+    ~Pool(void)
+    {
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            jobs.clear();
+            stop = true;
+        }
+        cond.notify_all();
+        for (auto& t : threads)
+            t.join();
+    }
+
+    void write_job(const FileJob& j)
+    {
+        int fd = create_file(dirfd, j.path, j.mode);
+        try
+        {
+            if (j.data.size())
+            {
+                fallocate(fd, 0, 0, j.data.size());
+                write_file_data(fd, j.data.data(), j.data.size(), j.path);
+            }
+        }
+        catch (exception& e) { close(fd); throw; }
+        close_file_attrs(fd, j.mode, j.mtime, j.path);
+    }
+
+    void worker(void)
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        while (true)
+        {
+            cond.wait(lk, [this]{ return !jobs.empty() || stop; });
+            if (jobs.empty())
+                break;
+            FileJob j = std::move(jobs.front());
+            jobs.pop_front();
+            busy++;
+            lk.unlock();
+
+            string err;
+            try { write_job(j); }
+            catch (UnsafePath& e) { log_warn("skipping tar member %s: %s", j.path.c_str(), e.what()); }
+            catch (exception& e) { err = e.what(); }
+
+            lk.lock();
+            busy--;
+            queued_bytes -= j.data.size();
+            if (err.length() && error.empty())
+                error = err;
+            cond.notify_all();
+        }
+    }
+
+    void submit(FileJob&& j)
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        cond.wait(lk, [this]{ return queued_bytes < max_queued || error.length(); });
+        if (error.length())
+            throw PError(error);
+        queued_bytes += j.data.size();
+        jobs.push_back(std::move(j));
+        cond.notify_all();
+    }
+
+    // wait until every queued file is written, throws if any failed
+    void drain(void)
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        cond.wait(lk, [this]{ return (jobs.empty() && !busy) || error.length(); });
+        if (error.length())
+            throw PError(error);
+    }
+};
+
+TarExtractor::TarExtractor(const string& dir_) : dir(dir_), parser(nullptr, tar_parser_free)
+{
+    static const tar_callbacks_t callbacks = { on_begin, on_data, on_end };
+    parser.reset(tar_parser_new(&callbacks, this));
+    dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1)
+        THROW_ERRNO("failed to open %s", dir.c_str());
+    pool.reset(new Pool(dirfd));
+}
+
+TarExtractor::~TarExtractor(void)
+{
+    pool.reset();
+    if (fd != -1)
+        close(fd);
+    close(dirfd);
+}
+
+unsigned TarExtractor::skip_unchanged(const uint8_t *entries, uint32_t n_files_)
+{
+    struct IndexFile
+    {
+        string path;
+        uint64_t size;
+        uint32_t crc;
+    };
+    vector<IndexFile> files;
+    files.reserve(n_files_);
+    for (uint32_t i = 0; i < n_files_; i++)
+    {
+        nimg_fileidx_entry_t e;
+        memcpy(&e, entries, sizeof(e));
+        entries += sizeof(e);
+        string path(reinterpret_cast<const char*>(entries), e.name_len);
+        entries += e.name_len;
+        if (clean_path(path) && path.length())
+            files.push_back({ path, e.size, e.crc32 });
+    }
+
+    // a path that's in the archive more than once is always extracted, the
+    // index can't say which of its versions ends up in the directory
+    std::sort(files.begin(), files.end(), [](const IndexFile& a, const IndexFile& b){ return a.path < b.path; });
+    vector<const IndexFile*> candidates;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if ((i > 0 && files[i].path == files[i-1].path) || (i + 1 < files.size() && files[i].path == files[i+1].path))
+            continue;
+        candidates.push_back(&files[i]);
+    }
+
+    // checksum the existing files with the same size, in batches to limit the number of open files
+    unchanged.clear();
+    for (size_t b = 0; b < candidates.size(); b += COMPARE_BATCH)
+    {
+        vector<crc32_range_t> ranges;
+        vector<const IndexFile*> opened;
+        for (size_t i = b; i < min(candidates.size(), b + COMPARE_BATCH); i++)
+        {
+            const IndexFile *f = candidates[i];
+            ParentDir p;
+            try { open_parent(dirfd, f->path, false, p); }
+            catch (exception&) { continue; } // extracting it will report the problem
+            struct stat sb;
+            if (fstatat(p.fd, p.name.c_str(), &sb, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(sb.st_mode) ||
+                (uint64_t)sb.st_size != f->size)
+                continue;
+            if (f->size == 0)
+            {
+                unchanged.push_back(f->path);
+                continue;
+            }
+            int ffd = openat(p.fd, p.name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (ffd == -1)
+                continue;
+            ranges.push_back({ .fd = ffd, .buf = nullptr, .offset = 0, .len = f->size, .crc = 0, .err = 0 });
+            opened.push_back(f);
+        }
+
+        crc32_ranges_parallel(ranges.data(), ranges.size(), crc32_default_threads());
+        for (size_t i = 0; i < ranges.size(); i++)
+        {
+            if (ranges[i].err == 0 && ranges[i].crc == opened[i]->crc)
+                unchanged.push_back(opened[i]->path);
+            close(ranges[i].fd);
+        }
+    }
+    std::sort(unchanged.begin(), unchanged.end());
+    return unchanged.size();
+}
+
+void TarExtractor::feed(const uint8_t *data, size_t len)
+{
+    check(tar_parser_feed(parser.get(), data, len));
+}
+
+// rethrow an exception from a callback, which can't go through the C parser
+void TarExtractor::check(tar_err_e err)
+{
+    if (err == TAR_ERR_CALLBACK && cb_error)
+    {
+        std::exception_ptr e = cb_error;
+        cb_error = nullptr;
+        std::rethrow_exception(e);
+    }
+    if (err != TAR_OK)
+        THROW_ERROR("%s", tar_err_str(err));
+}
+
+int TarExtractor::on_begin(void *arg, const tar_entry_t *e)
+{
+    TarExtractor *t = static_cast<TarExtractor*>(arg);
+    try
+    {
+        t->entry_type = e->type;
+        t->begin_entry(e->path, e->link, e->size, e->mode, e->mtime);
+    }
+    catch (...)
+    {
+        t->cb_error = std::current_exception();
+        return -1;
+    }
+    return 0;
+}
+
+int TarExtractor::on_data(void *arg, const uint8_t *data, size_t len)
+{
+    TarExtractor *t = static_cast<TarExtractor*>(arg);
+    try { t->entry_data(data, len); }
+    catch (...)
+    {
+        t->cb_error = std::current_exception();
+        return -1;
+    }
+    return 0;
+}
+
+int TarExtractor::on_end(void *arg)
+{
+    TarExtractor *t = static_cast<TarExtractor*>(arg);
+    try { t->end_entry(); }
+    catch (...)
+    {
+        t->cb_error = std::current_exception();
+        return -1;
+    }
+    return 0;
+}
+
+int TarExtractor::output(void *arg, const uint8_t *data, size_t len)
+{
+    TarExtractor *t = static_cast<TarExtractor*>(arg);
+    try { t->feed(data, len); }
+    catch (exception& e)
+    {
+        t->error = e.what();
+        return -1;
+    }
+    return 0;
+}
+
+void TarExtractor::begin_entry(const string& path_, const string& link_, uint64_t size, mode_t mode, int64_t mtime)
+{
+    string path = path_, link = link_;
+    sink = SINK_SKIP;
+    if (!clean_path(path))
+    {
+        log_warn("skipping tar member with unsafe path %s", path_.c_str());
+        return;
+    }
+    if (path.empty())
+        return; // the extraction directory itself
+
+    try { create_entry(path, link, size, mode, mtime); }
+    catch (UnsafePath& e)
+    {
+        // GNU tar refuses these too, rather than following a symlink from the archive
+        log_warn("skipping tar member %s: %s", path.c_str(), e.what());
+        sink = SINK_SKIP;
+    }
+}
+
+// Small files are written by the pool in any order, so wait for it before touching a
+// path which is still queued, or is a parent or child of one. Otherwise the result
+// would depend on thread timing instead of the last member of the archive winning.
+void TarExtractor::wait_queued(const string& path)
+{
+    bool conflict = queued.count(path) > 0;
+    for (size_t slash = path.find('/'); !conflict && slash != string::npos; slash = path.find('/', slash + 1))
+        conflict = queued.count(path.substr(0, slash)) > 0;
+    if (!conflict)
+    {
+        auto it = queued.lower_bound(path + "/");
+        conflict = (it != queued.end() && !it->compare(0, path.length() + 1, path + "/"));
+    }
+    if (conflict)
+        drain_pool();
+}
+
+void TarExtractor::drain_pool(void)
+{
+    pool->drain();
+    queued.clear();
+}
+
+void TarExtractor::create_entry(const string& path, const string& link_, uint64_t size, mode_t mode, int64_t mtime)
+{
+    string link = link_;
+    wait_queued(path);
+    const bool regular = (entry_type == '0' || entry_type == '\0' || entry_type == '7');
+    auto it = std::lower_bound(unchanged.begin(), unchanged.end(), path);
+    if (it != unchanged.end() && *it == path)
+    {
+        if (!regular)
+        {
+            // something else replaces the file, so it has to be written after all
+            unchanged.erase(it);
+        }
+        else
+        {
+            log_debug("%s is unchanged", path.c_str());
+            n_unchanged++;
+            // the contents are the same, the mode and mtime may not be
+            ParentDir p;
+            open_parent(dirfd, path, false, p);
+            fchmodat(p.fd, p.name.c_str(), mode & 07777, 0);
+            struct timespec ts[2] = { { .tv_sec = mtime, .tv_nsec = 0 }, { .tv_sec = mtime, .tv_nsec = 0 } };
+            utimensat(p.fd, p.name.c_str(), ts, AT_SYMLINK_NOFOLLOW);
+            return;
+        }
+    }
+
+    job.path = path;
+    job.mode = mode;
+    job.mtime = mtime;
+    job.data.clear();
+
+    switch (entry_type)
+    {
+        case '0':
+        case '\0':
+        case '7':
+            log_debug("extracting %s (%llu bytes)", path.c_str(), (unsigned long long)size);
+            n_files++;
+            total_bytes += size;
+            if (size <= SMALL_FILE_MAX)
+            {
+                job.data.reserve(size);
+                sink = SINK_SMALL;
+            }
+            else
+            {
+                fd = create_file(dirfd, path, mode);
+                // preallocate so the file isn't fragmented, not supported everywhere
+                fallocate(fd, 0, 0, size);
+                wbuf.reserve(WRITE_BATCH_SIZE);
+                sink = SINK_LARGE;
+            }
+            break;
+
+        case '5':
+        {
+            log_debug("creating directory %s", path.c_str());
+            ParentDir p;
+            open_parent(dirfd, path, true, p);
+            if (mkdirat(p.fd, p.name.c_str(), mode & 07777) != 0 && errno != EEXIST)
+                THROW_ERRNO("failed to create directory %s", path.c_str());
+            break;
+        }
+
+        case '2':
+        {
+            log_debug("creating symlink %s -> %s", path.c_str(), link.c_str());
+            ParentDir p;
+            open_parent(dirfd, path, true, p);
+            unlinkat(p.fd, p.name.c_str(), 0);
+            if (symlinkat(link.c_str(), p.fd, p.name.c_str()) != 0)
+                THROW_ERRNO("failed to create symlink %s", path.c_str());
+            break;
+        }
+
+        case '1':
+        {
+            if (!clean_path(link))
+            {
+                log_warn("skipping hard link %s with unsafe target %s", path.c_str(), link_.c_str());
+                break;
+            }
+            log_debug("creating hard link %s -> %s", path.c_str(), link.c_str());
+            // the target may still be queued
+            drain_pool();
+            ParentDir p, target;
+            open_parent(dirfd, path, true, p);
+            open_parent(dirfd, link, false, target);
+            unlinkat(p.fd, p.name.c_str(), 0);
+            if (linkat(target.fd, target.name.c_str(), p.fd, p.name.c_str(), 0) != 0)
+                THROW_ERRNO("failed to create hard link %s", path.c_str());
+            break;
+        }
+
+        default:
+            log_warn("skipping tar member %s of unsupported type '%c'", path.c_str(), entry_type);
+            break;
+    }
+}
+
+void TarExtractor::entry_data(const uint8_t *data, size_t len)
+{
+    switch (sink)
+    {
+        case SINK_SKIP:
+            break;
+        case SINK_SMALL:
+            job.data.insert(job.data.end(), data, data + len);
+            break;
+        case SINK_LARGE:
+            while (len > 0)
+            {
+                size_t n = min(len, WRITE_BATCH_SIZE - wbuf.size());
+                wbuf.insert(wbuf.end(), data, data + n);
+                data += n;
+                len -= n;
+                if (wbuf.size() == WRITE_BATCH_SIZE)
+                    flush_wbuf();
+            }
+            break;
+    }
+}
+
+void TarExtractor::end_entry(void)
+{
+    switch (sink)
+    {
+        case SINK_SKIP:
+            break;
+        case SINK_SMALL:
+            queued.insert(job.path);
+            pool->submit(std::move(job));
+            job = FileJob();
+            break;
+        case SINK_LARGE:
+            flush_wbuf();
+            close_file();
+            break;
+    }
+    sink = SINK_SKIP;
+}
+
+void TarExtractor::flush_wbuf(void)
+{
+    write_file_data(fd, wbuf.data(), wbuf.size(), job.path);
+    wbuf.clear();
+}
+
+void TarExtractor::close_file(void)
+{
+    int f = fd;
+    fd = -1;
+    close_file_attrs(f, job.mode, job.mtime, job.path);
+}
+
+void TarExtractor::finish(void)
+{
+    check(tar_parser_finish(parser.get()));
+    drain_pool();
+}
+
+// Mark dir as being updated with a marker file, which is only removed by
+// mark_dir_complete after everything in dir is written and synced. If the update
+// is interrupted, the marker is left behind so a half-written dir can be detected.
+void mark_dir_incomplete(const string& dir)
+{
+    int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1)
+        THROW_ERRNO("failed to open %s", dir.c_str());
+    if (faccessat(dfd, INCOMPLETE_MARKER, F_OK, 0) == 0)
+        log_warn("the previous update of %s was interrupted", dir.c_str());
+
+    int fd = openat(dfd, INCOMPLETE_MARKER, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = (fd != -1) && (fsync(fd) == 0) && (fsync(dfd) == 0);
+    int err = errno;
+    if (fd != -1)
+        close(fd);
+    close(dfd);
+    errno = err;
+    if (!ok)
+        THROW_ERRNO("failed to create %s/%s", dir.c_str(), INCOMPLETE_MARKER);
+}
+
+// sync everything written to dir's filesystem, then remove the marker file
+void mark_dir_complete(const string& dir)
+{
+    int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1)
+        THROW_ERRNO("failed to open %s", dir.c_str());
+    bool ok = (syncfs(dfd) == 0) &&
+              (unlinkat(dfd, INCOMPLETE_MARKER, 0) == 0 || errno == ENOENT) &&
+              (fsync(dfd) == 0);
+    int err = errno;
+    close(dfd);
+    errno = err;
+    if (!ok)
+        THROW_ERRNO("failed to finish updating %s", dir.c_str());
+}
@@ -0,0 +1,105 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "newbs-swdl.h"
+
+Verifier g_verify;
+
+void Verifier::start(const string& dev, uint64_t len, uint32_t crc, const string& what)
+{
+    checks.emplace_back();
+    Check& c = checks.back();
+    c.dev = dev;
+    c.what = what;
+    c.len = len;
+    c.crc = crc;
+    c.thread = std::thread(&Verifier::run, &c);
+}
+
+bool Verifier::wait(void)
+{
+    for (auto& c : checks)
+    {
+        c.thread.join();
+        if (c.error.length())
+        {
+            log_error("verifying %s failed: %s", c.what.c_str(), c.error.c_str());
+            n_failed++;
+        }
+    }
+    checks.clear();
+    return n_failed == 0;
+}
+
+void Verifier::run(Check *c)
+{
+    const double start = monotonic_sec();
+    int fd = open(c->dev.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        c->error = PError("failed to open %s: %s", c->dev.c_str(), strerror(errno)).what();
+        return;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || !(S_ISBLK(sb.st_mode) || S_ISREG(sb.st_mode)))
+    {
+        // e.g. /dev/null in SWDL_TEST builds
+        log_warn("can't read back %s from %s, not verifying it", c->what.c_str(), c->dev.c_str());
+        close(fd);
+        return;
+    }
+
+    // Read as much as possible with O_DIRECT, the unaligned end (or everything, if
+    // O_DIRECT isn't supported) through the page cache after dropping it, which
+    // works because the data was synced when the part was finished
+    int fd_direct = open(c->dev.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+    const uint64_t direct_len = (fd_direct != -1) ? c->len - c->len % 4096 : 0;
+    posix_fadvise(fd, direct_len, c->len - direct_len, POSIX_FADV_DONTNEED);
+
+    crc32_range_t ranges[2] = {
+        { .fd = fd_direct, .buf = NULL, .offset = 0, .len = direct_len, .crc = 0, .err = 0 },
+        { .fd = fd, .buf = NULL, .offset = direct_len, .len = c->len - direct_len, .crc = 0, .err = 0 },
+    };
+    int ret = crc32_ranges_parallel(ranges, 2, n_threads);
+    if (fd_direct != -1)
+        close(fd_direct);
+    close(fd);
+
+    if (ret < 0)
+    {
+        int err = ranges[0].err ? ranges[0].err : ranges[1].err;
+        c->error = PError("failed to read back %s: %s", c->dev.c_str(),
+                          (err > 0) ? strerror(err) : "unexpected end of device").what();
+        return;
+    }
+    uint32_t crc = xcrc32_combine(ranges[0].crc, ranges[1].crc, ranges[1].len);
+    if (crc != c->crc)
+    {
+        c->error = PError("data read back from %s doesn't match what was written! expected CRC 0x%08x, "
+                          "actual 0x%08x", c->dev.c_str(), c->crc, crc).what();
+        return;
+    }
+    log_info("verified %s on %s (%llu bytes) in %.1f seconds", c->what.c_str(), c->dev.c_str(),
+             (unsigned long long)c->len, monotonic_sec() - start);
+}
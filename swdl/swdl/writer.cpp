@@ -0,0 +1,697 @@
+/*******************************************************************************
+ * Copyright (C) 2018-2019 Allen Wild <allenwild93@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include "newbs-swdl.h"
+
+#if defined(HAVE_IO_URING) && defined(__NR_io_uring_setup)
+#define USE_IO_URING 1
+#endif
+
+#ifdef USE_IO_URING
+// Just enough of io_uring to keep a few writes in flight. liburing isn't
+// needed for this, and often isn't available on the target.
+struct DeviceWriter::Uring
+{
+    int fd = -1;
+    void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+    size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    struct io_uring_cqe *cqes;
+
+    ~Uring(void)
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED)
+            munmap(sq_ptr, sq_size);
+        if (fd != -1)
+            close(fd);
+    }
+
+    // returns false if io_uring isn't available
+    bool setup(unsigned entries)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0)
+        {
+            log_debug("io_uring_setup failed: %s", strerror(errno));
+            fd = -1;
+            return false;
+        }
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_size = cq_size = max(sq_size, cq_size);
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+            return false;
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ptr = sq_ptr;
+        else if ((cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+            return false;
+        void *p = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (p == MAP_FAILED)
+            return false;
+        sqes = static_cast<struct io_uring_sqe*>(p);
+
+        uint8_t *sq = static_cast<uint8_t*>(sq_ptr), *cq = static_cast<uint8_t*>(cq_ptr);
+        sq_tail  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask  = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head  = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail  = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask  = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes     = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete)
+    {
+        int ret;
+        do {
+            ret = syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                          min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    // queue and submit one writev. The caller never has more writes in flight than entries
+    void write(int file_fd, const struct iovec *iov, uint64_t offset, uint64_t user_data)
+    {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = file_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(iov);
+        sqe->len = 1;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        if (enter(1, 0) < 0)
+            THROW_ERRNO("io_uring_enter failed");
+    }
+
+    // wait for at least one completion, and call fn(user_data, res, waited) for each.
+    // waited is set for the first one if we had to wait for it, so it completed just now
+    template<typename Fn>
+    void reap(Fn fn)
+    {
+        unsigned head = *cq_head;
+        bool waited = false;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            if (enter(0, 1) < 0)
+                THROW_ERRNO("io_uring_enter failed");
+            waited = true;
+        }
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            fn(cqe->user_data, cqe->res, waited);
+            waited = false;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+};
+#else
+struct DeviceWriter::Uring
+{
+    bool setup(unsigned) { return false; }
+};
+#endif
+
+void Writeback::range(uint64_t start, uint64_t end, unsigned flags)
+{
+    if (sync_file_range(fd, start, end - start, flags) != 0)
+    {
+        // e.g. pipes or /dev/null. Write errors are reported by the fsync in sync()
+        log_debug("sync_file_range on %s failed, disabling writeback control: %s", path.c_str(), strerror(errno));
+        enabled = false;
+    }
+}
+
+void Writeback::wrote(uint64_t offset, uint64_t len)
+{
+    g_qos.write(len);
+    std::lock_guard<std::mutex> lk(lock);
+    if (!enabled || !len)
+        return;
+    cur_start = min(cur_start, offset);
+    cur_end = max(cur_end, offset + len);
+    cur_bytes += len;
+    if (cur_bytes < window)
+        return;
+
+    // start writing out this window, then wait for the previous one. Holding the
+    // lock while waiting also makes any other writer threads wait
+    range(cur_start, cur_end, SYNC_FILE_RANGE_WRITE);
+    if (enabled && prev_end > prev_start)
+    {
+        const double t = monotonic_sec();
+        range(prev_start, prev_end, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        g_qos.write_latency(window, monotonic_sec() - t, true);
+        // the window is clean now, so it can be dropped from the page cache
+        if (enabled)
+            posix_fadvise(fd, prev_start, prev_end - prev_start, POSIX_FADV_DONTNEED);
+    }
+    prev_start = cur_start;
+    prev_end = cur_end;
+    cur_start = UINT64_MAX;
+    cur_end = cur_bytes = 0;
+}
+
+void Writeback::sync(void)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    // EINVAL means fsync isn't supported (e.g. /dev/null in SWDL_TEST builds)
+    if (fsync(fd) < 0 && errno != EINVAL)
+        THROW_ERRNO("fsync %s failed", path.c_str());
+    // Everything is clean now, drop all of it from the page cache. This also covers
+    // data written by child processes (decompressors), which we don't see
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+DeviceWriter::DeviceWriter(const string& dev, bool read_back) : path(dev)
+{
+    const int flags = (read_back ? O_RDWR : O_WRONLY) | O_CLOEXEC;
+    fd = open(dev.c_str(), flags);
+    if (fd == -1)
+        THROW_ERRNO("Failed to open %s for writing", dev.c_str());
+    wb.reset(new Writeback(fd, dev));
+
+    // O_DIRECT keeps gigabytes of image data out of the page cache, so there's
+    // nothing left to flush at the end and other processes keep their cache
+    fd_direct = open(dev.c_str(), flags | O_DIRECT);
+    if (fd_direct == -1)
+        log_debug("O_DIRECT not supported for %s, using buffered writes: %s", dev.c_str(), strerror(errno));
+
+    for (unsigned i = 0; i < n_bufs; i++)
+    {
+        void *p;
+        if (posix_memalign(&p, align, buf_size) != 0)
+        {
+            cleanup();
+            THROW_ERROR("failed to allocate write buffers");
+        }
+        bufs.push_back(static_cast<uint8_t*>(p));
+        free_bufs.push_back(i);
+    }
+    iovs.resize(n_bufs);
+    lens.resize(n_bufs);
+    offsets.resize(n_bufs);
+    start_times.resize(n_bufs);
+
+    if (fd_direct != -1)
+    {
+        ring.reset(new Uring);
+        if (!ring->setup(n_bufs))
+            ring.reset();
+    }
+    log_debug("writing %s with %s", dev.c_str(), backend());
+}
+
+DeviceWriter::~DeviceWriter(void)
+{
+    // the kernel may still be using our buffers
+    try { drain(); }
+    catch (exception& e) { /* already failing */ }
+    cleanup();
+}
+
+void DeviceWriter::cleanup(void)
+{
+    ring.reset();
+    for (auto b : bufs)
+        free(b);
+    bufs.clear();
+    free(cmp_buf);
+    cmp_buf = nullptr;
+    if (fd_direct != -1)
+        close(fd_direct);
+    if (fd != -1)
+        close(fd);
+    fd = fd_direct = -1;
+}
+
+const char* DeviceWriter::backend(void) const
+{
+    if (ring)
+        return "io_uring + O_DIRECT";
+    if (fd_direct != -1)
+        return "pwrite + O_DIRECT";
+    return "pwrite";
+}
+
+void DeviceWriter::set_error(const string& msg)
+{
+    if (error.empty())
+        error = msg;
+}
+
+// synchronous write, used without io_uring and for unaligned data
+void DeviceWriter::write_sync(int wfd, const uint8_t *buf, size_t len, uint64_t offset)
+{
+    for (size_t done = 0; done < len; )
+    {
+        ssize_t n = pwrite(wfd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            THROW_ERRNO("write to %s failed", path.c_str());
+        done += n;
+    }
+    if (wfd == fd)
+        wb->wrote(offset, len);
+}
+
+void DeviceWriter::reap(void)
+{
+#ifdef USE_IO_URING
+    ring->reap([this](uint64_t i, int res, bool waited) {
+        if (res < 0)
+            set_error(PError("write to %s failed: %s", path.c_str(), strerror(-res)).what());
+        else if ((size_t)res < lens[i])
+        {
+            // short write, finish it synchronously
+            try { write_sync(fd_direct, bufs[i] + res, lens[i] - res, offsets[i] + res); }
+            catch (exception& e) { set_error(e.what()); }
+        }
+        else if (waited)
+        {
+            // completions found already done may have finished any time since we last
+            // looked, e.g. while the caller was throttled, so only time the ones we waited for
+            g_qos.write_latency(lens[i], monotonic_sec() - start_times[i], false);
+        }
+        free_bufs.push_back(i);
+        in_flight--;
+    });
+#endif
+}
+
+void DeviceWriter::drain(void)
+{
+    while (in_flight > 0)
+        reap();
+}
+
+uint8_t* DeviceWriter::get_buffer(void)
+{
+    while (free_bufs.empty())
+        reap();
+    if (error.length())
+        throw PError(error);
+    unsigned i = free_bufs.back();
+    free_bufs.pop_back();
+    return bufs[i];
+}
+
+unsigned DeviceWriter::buf_index(const uint8_t *buf) const
+{
+    for (unsigned i = 0; i < bufs.size(); i++)
+        if (bufs[i] == buf)
+            return i;
+    throw PError("BUG! %p isn't a DeviceWriter buffer", static_cast<const void*>(buf));
+}
+
+void DeviceWriter::release(uint8_t *buf)
+{
+    free_bufs.push_back(buf_index(buf));
+}
+
+void DeviceWriter::submit(uint8_t *buf, size_t len, uint64_t offset)
+{
+    unsigned i = buf_index(buf);
+    if (error.length())
+    {
+        free_bufs.push_back(i);
+        throw PError(error);
+    }
+    total += len;
+
+    if (fd_direct == -1 || len % align || offset % align)
+    {
+        // O_DIRECT needs aligned offsets and sizes. This only happens at the
+        // end of a part, so wait for everything before it and write through the cache
+        drain();
+        try { write_sync(fd, buf, len, offset); }
+        catch (exception& e) { free_bufs.push_back(i); throw; }
+        free_bufs.push_back(i);
+        return;
+    }
+
+    // buffered writes are accounted for by Writeback, direct writes here
+    g_qos.write(len);
+
+#ifdef USE_IO_URING
+    if (ring)
+    {
+        iovs[i].iov_base = buf;
+        iovs[i].iov_len = len;
+        lens[i] = len;
+        offsets[i] = offset;
+        start_times[i] = monotonic_sec();
+        in_flight++;
+        try { ring->write(fd_direct, &iovs[i], offset, i); }
+        catch (exception& e) { in_flight--; free_bufs.push_back(i); throw; }
+        return;
+    }
+#endif
+
+    const double t = monotonic_sec();
+    try { write_sync(fd_direct, buf, len, offset); }
+    catch (exception& e) { free_bufs.push_back(i); throw; }
+    free_bufs.push_back(i);
+    g_qos.write_latency(len, monotonic_sec() - t, false);
+}
+
+bool DeviceWriter::unchanged(const uint8_t *buf, size_t len, uint64_t offset)
+{
+    // read back with O_DIRECT too when possible, so that comparing doesn't fill the page cache
+    if (cmp_buf == nullptr && posix_memalign(reinterpret_cast<void**>(&cmp_buf), align, buf_size) != 0)
+        THROW_ERROR("failed to allocate compare buffer");
+    assert(len <= buf_size);
+    int rfd = (fd_direct != -1 && !(len % align) && !(offset % align)) ? fd_direct : fd;
+    return pread(rfd, cmp_buf, len, offset) == (ssize_t)len && !memcmp(buf, cmp_buf, len);
+}
+
+void DeviceWriter::flush(void)
+{
+    drain();
+    if (error.length())
+        throw PError(error);
+    // O_DIRECT bypasses the page cache, but not a volatile cache in the device itself
+    wb->sync();
+}
+
+// zero len bytes of fd starting at offset, as cheaply as the target allows.
+// Block devices use BLKZEROOUT, which lets the kernel unmap the range instead of writing
+// it when the device supports that. Regular files get a hole punched, and are extended
+// if the range is past their end. Other things (e.g. /dev/null in SWDL_TEST builds) are skipped.
+void zero_range(int fd, const struct stat& sb, uint64_t offset, uint64_t len)
+{
+    if (len == 0)
+        return;
+    if (S_ISBLK(sb.st_mode))
+    {
+        uint64_t range[2] = { offset, len };
+        if (ioctl(fd, BLKZEROOUT, range) == 0)
+            return;
+        if (errno != EOPNOTSUPP && errno != EINVAL && errno != ENOTTY)
+            THROW_ERRNO("BLKZEROOUT failed");
+    }
+    else if (S_ISREG(sb.st_mode))
+    {
+        // sb may be out of date, the file could have been extended since
+        struct stat cur;
+        if (fstat(fd, &cur) == 0 && (uint64_t)cur.st_size < offset + len && ftruncate(fd, offset + len) < 0)
+            THROW_ERRNO("failed to extend file");
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+            return;
+        if (errno != EOPNOTSUPP)
+            THROW_ERRNO("fallocate failed");
+    }
+    else
+        return;
+
+    // fall back to writing zeros
+    static const uint8_t zeros[65536] = {0};
+    for (uint64_t done = 0; done < len; )
+    {
+        ssize_t n = pwrite(fd, zeros, min(sizeof(zeros), len - done), offset + done);
+        if (n <= 0)
+            THROW_ERRNO("write failed");
+        done += n;
+    }
+}
+
+struct FanOutWriter::Target
+{
+    string dev;
+    int fd = -1, fd_direct = -1;
+    struct stat sb;
+    std::unique_ptr<Writeback> wb;  // for buffered writes
+    std::deque<Op> ops;             // the op at the front is being written
+    string error;
+    bool reported = false;
+    std::thread thread;
+};
+
+FanOutWriter::FanOutWriter(const vector<string>& devs)
+{
+    for (unsigned i = 0; i < n_bufs; i++)
+    {
+        void *p;
+        if (posix_memalign(&p, align, buf_size) != 0)
+        {
+            for (auto b : bufs)
+                free(b);
+            THROW_ERROR("failed to allocate write buffers");
+        }
+        bufs.push_back(static_cast<uint8_t*>(p));
+        free_bufs.push_back(i);
+    }
+    refs.resize(n_bufs);
+
+    // a device which can't be opened fails now, the others are still written
+    for (const auto& dev : devs)
+    {
+        std::unique_ptr<Target> t(new Target);
+        t->dev = dev;
+        t->fd = open(dev.c_str(), O_WRONLY | O_CLOEXEC);
+        if (t->fd == -1 || fstat(t->fd, &t->sb) < 0)
+            t->error = PError("Failed to open %s for writing: %s", dev.c_str(), strerror(errno)).what();
+        else
+        {
+            t->wb.reset(new Writeback(t->fd, dev));
+            t->fd_direct = open(dev.c_str(), O_WRONLY | O_CLOEXEC | O_DIRECT);
+        }
+        targets.push_back(std::move(t));
+    }
+    for (auto& t : targets)
+        t->thread = std::thread(&FanOutWriter::worker, this, t.get());
+    log_debug("writing to %zu devices, up to %s behind each other", devs.size(), human_bytes(n_bufs * buf_size));
+}
+
+FanOutWriter::~FanOutWriter(void)
+{
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        stop = true;
+    }
+    cond.notify_all();
+    for (auto& t : targets)
+    {
+        if (t->thread.joinable())
+            t->thread.join();
+        if (t->fd_direct != -1)
+            close(t->fd_direct);
+        if (t->fd != -1)
+            close(t->fd);
+    }
+    for (auto b : bufs)
+        free(b);
+}
+
+unsigned FanOutWriter::buf_index(const uint8_t *buf) const
+{
+    for (unsigned i = 0; i < bufs.size(); i++)
+        if (bufs[i] == buf)
+            return i;
+    throw PError("BUG! %p isn't a FanOutWriter buffer", static_cast<const void*>(buf));
+}
+
+// drop one reference to buffer i, with the lock held
+void FanOutWriter::put(unsigned i)
+{
+    if (--refs[i] == 0)
+    {
+        free_bufs.push_back(i);
+        cond.notify_all();
+    }
+}
+
+// queue op for every device which hasn't failed, with the lock held
+void FanOutWriter::queue(const Op& op)
+{
+    for (auto& t : targets)
+    {
+        if (t->error.length())
+            continue;
+        t->ops.push_back(op);
+        if (op.buf >= 0)
+            refs[op.buf]++;
+    }
+    cond.notify_all();
+}
+
+void FanOutWriter::worker(Target *t)
+{
+    std::unique_lock<std::mutex> lk(lock);
+    while (true)
+    {
+        cond.wait(lk, [&]{ return !t->ops.empty() || stop; });
+        if (t->ops.empty())
+            break;
+        const Op op = t->ops.front();
+        const bool ok = t->error.empty();
+        lk.unlock();
+
+        string err;
+        if (ok)
+        {
+            try
+            {
+                if (op.buf < 0)
+                    zero_range(t->fd, t->sb, op.offset, op.len);
+                else
+                {
+                    const bool direct = (t->fd_direct != -1) && !(op.len % align) && !(op.offset % align);
+                    const uint8_t *data = bufs[op.buf];
+                    for (size_t done = 0; done < op.len; )
+                    {
+                        ssize_t n = pwrite(direct ? t->fd_direct : t->fd, data + done, op.len - done, op.offset + done);
+                        if (n < 0 && errno == EINTR)
+                            continue;
+                        if (n <= 0)
+                            THROW_ERRNO("write to %s failed", t->dev.c_str());
+                        done += n;
+                    }
+                    if (!direct)
+                        t->wb->wrote(op.offset, op.len);
+                }
+            }
+            catch (exception& e) { err = e.what(); }
+        }
+
+        lk.lock();
+        if (err.length() && t->error.empty())
+            t->error = err;
+        t->ops.pop_front();
+        if (op.buf >= 0)
+            put(op.buf);
+        cond.notify_all();
+    }
+}
+
+uint8_t* FanOutWriter::get_buffer(void)
+{
+    std::unique_lock<std::mutex> lk(lock);
+    cond.wait(lk, [this]{ return !free_bufs.empty(); });
+    bool any_ok = false;
+    for (auto& t : targets)
+        any_ok = any_ok || t->error.empty();
+    if (!any_ok)
+        throw PError("writing failed on all devices, the first error was: %s", targets[0]->error.c_str());
+    unsigned i = free_bufs.back();
+    free_bufs.pop_back();
+    return bufs[i];
+}
+
+void FanOutWriter::release(uint8_t *buf)
+{
+    unsigned i = buf_index(buf);
+    std::lock_guard<std::mutex> lk(lock);
+    free_bufs.push_back(i);
+    cond.notify_all();
+}
+
+void FanOutWriter::submit(uint8_t *buf, size_t len, uint64_t offset)
+{
+    unsigned i = buf_index(buf);
+    // the network and the device bandwidth are the limits, not the number of devices
+    g_qos.write(len);
+    std::lock_guard<std::mutex> lk(lock);
+    refs[i] = 1; // held until everything's queued
+    queue(Op{ (int)i, len, offset });
+    put(i);
+}
+
+void FanOutWriter::zero(uint64_t offset, uint64_t len)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    queue(Op{ -1, (size_t)len, offset });
+}
+
+void FanOutWriter::flush(void)
+{
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        cond.wait(lk, [this]{
+            for (auto& t : targets)
+                if (!t->ops.empty())
+                    return false;
+            return true;
+        });
+    }
+
+    // no more writes are queued, so the lock isn't needed for the rest
+    size_t n_failed = 0;
+    for (auto& t : targets)
+    {
+        if (t->error.empty())
+        {
+            try { t->wb->sync(); }
+            catch (exception& e) { t->error = e.what(); }
+        }
+        if (t->error.length())
+        {
+            if (!t->reported)
+                log_error("%s", t->error.c_str());
+            t->reported = true;
+            n_failed++;
+        }
+    }
+    if (n_failed == targets.size())
+        THROW_ERROR("writing failed on all %zu devices", targets.size());
+}
+
+bool FanOutWriter::failed(size_t i) const
+{
+    return targets[i]->error.length() > 0;
+}
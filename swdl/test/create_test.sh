@@ -0,0 +1,59 @@
+#!/bin/bash
+# Check that mknImage create -p (compressing all parts at once) writes the same
+# image as compressing them one at a time, for each compression type, including
+# when -j leaves each part fewer compression threads than the serial path uses.
+#
+# usage: create_test.sh BINDIR
+# BINDIR contains mknImage. Set KEEP_TMP=1 to keep the images.
+
+set -u
+
+BINDIR=$(cd "${1:-${BINDIR:-bin}}" && pwd)
+MKNIMAGE="$BINDIR/mknImage"
+
+TMP=$(mktemp -d)
+cleanup()
+{
+    [[ -n "${KEEP_TMP:-}" ]] && echo "kept $TMP" || rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+FAILED=0
+fail()
+{
+    echo "FAIL: $*"
+    FAILED=1
+}
+
+# compressible data, a few MB per part
+for i in 0 1 2; do
+    head -c $((1 << 20)) /dev/urandom | base64 >"$TMP/part$i.bin"
+done
+
+for comp in gz xz zstd; do
+    parts=()
+    for i in 0 1 2; do
+        parts+=("boot_img_$comp:$TMP/part$i.bin")
+    done
+
+    if ! "$MKNIMAGE" create -a -o "$TMP/serial.img" "${parts[@]}" >"$TMP/out" 2>&1; then
+        # no library or command for this compression type
+        echo "$comp: skipped, mknImage can't compress it"
+        continue
+    fi
+    for jobs in 1 4; do
+        echo "$comp: -j $jobs create -p"
+        if ! "$MKNIMAGE" -j $jobs create -a -p -o "$TMP/parallel.img" "${parts[@]}" >"$TMP/out" 2>&1; then
+            fail "$comp: -j $jobs create -p failed"
+            sed 's/^/    /' "$TMP/out"
+        elif ! cmp -s "$TMP/serial.img" "$TMP/parallel.img"; then
+            fail "$comp: -j $jobs create -p image differs from the serial image"
+        fi
+    done
+done
+
+if [[ $FAILED -ne 0 ]]; then
+    echo "create tests FAILED"
+    exit 1
+fi
+echo "create tests passed"
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+# Loopback HTTP server for testing newbs-swdl's built-in HTTP client.
+#
+# usage: http_server.py DIR PORT_FILE REQUEST_LOG
+#
+# Serves the files in DIR on 127.0.0.1, on a free port which is written to
+# PORT_FILE once the server is listening. Range requests are supported. Every
+# request is logged to REQUEST_LOG as "PATH RANGE AUTHORIZATION", with "-" for
+# missing headers. A prefix on the path changes what happens to a request for
+# /PREFIX/NAME:
+#   drop      the first request for NAME is cut off halfway through the body
+#   stall     the first request for NAME stops sending at 80% of the body
+#   rel       redirect with a relative Location, to the same path with ?moved
+#   https     redirect to https://, which only curl can follow
+#   otherhost redirect to the same file on localhost instead of 127.0.0.1
+
+import os
+import re
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+root, port_file, log_file = sys.argv[1:4]
+log_lock = threading.Lock()
+done_once = set()
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, fmt, *args):
+        pass
+
+    def redirect(self, location):
+        self.send_response(302)
+        self.send_header("Location", location)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def first_time(self, key):
+        with log_lock:
+            if key in done_once:
+                return False
+            done_once.add(key)
+            return True
+
+    def do_GET(self):
+        with log_lock:
+            with open(log_file, "a") as f:
+                f.write("%s %s %s\n" % (self.path, self.headers.get("Range", "-").replace(" ", ""),
+                                        self.headers.get("Authorization", "-").replace(" ", "_")))
+
+        path, _, query = self.path.partition("?")
+        parts = path.strip("/").split("/")
+        prefix = parts[0] if len(parts) > 1 else ""
+        name = parts[-1]
+        host_port = "%s:%d" % self.server.server_address
+
+        if prefix == "rel" and query != "moved":
+            return self.redirect(name + "?moved")
+        if prefix == "https":
+            return self.redirect("https://%s/%s" % (host_port, name))
+        if prefix == "otherhost":
+            return self.redirect("http://localhost:%d/%s" % (self.server.server_address[1], name))
+
+        file_path = os.path.join(root, name)
+        if not os.path.isfile(file_path):
+            self.send_error(404)
+            return
+        size = os.path.getsize(file_path)
+        start, end = 0, size - 1
+        m = re.match(r"bytes=(\d+)-(\d*)$", self.headers.get("Range", ""))
+        if m:
+            start = int(m.group(1))
+            if m.group(2):
+                end = min(int(m.group(2)), size - 1)
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, size))
+        else:
+            self.send_response(200)
+        self.send_header("Content-Length", str(end - start + 1))
+        self.send_header("Connection", "close")
+        self.end_headers()
+
+        # where to stop early, for the first full request with drop or stall
+        cut = None
+        if not m and prefix in ("drop", "stall") and self.first_time(prefix + name):
+            cut = size // 2 if prefix == "drop" else size * 8 // 10
+
+        with open(file_path, "rb") as f:
+            f.seek(start)
+            left = end - start + 1
+            sent = 0
+            while left > 0:
+                n = min(left, 1 << 20)
+                if cut is not None:
+                    n = min(n, cut - sent)
+                    if n == 0:
+                        break
+                data = f.read(n)
+                try:
+                    self.wfile.write(data)
+                except OSError:
+                    return
+                sent += len(data)
+                left -= len(data)
+        self.wfile.flush()
+        if cut is not None and prefix == "stall":
+            # keep the connection open without sending anything, until the client is killed
+            time.sleep(60)
+        self.close_connection = True
+
+
+server = ThreadingHTTPServer(("127.0.0.1", 0), Handler)
+server.daemon_threads = True
+with open(port_file + ".tmp", "w") as f:
+    f.write("%d\n" % server.server_address[1])
+os.rename(port_file + ".tmp", port_file)
+server.serve_forever()
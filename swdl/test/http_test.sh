@@ -0,0 +1,122 @@
+#!/bin/bash
+# Loopback tests for newbs-swdl's built-in HTTP client: plain downloads, resuming
+# after a dropped connection, resuming from a journal after being killed, parallel
+# downloads with -P, and redirects. Only for SWDL_TEST builds, which write rootfs
+# parts to /dev/null rather than a real device.
+#
+# usage: http_test.sh BINDIR
+# BINDIR contains newbs-swdl and mknImage. Set KEEP_TMP=1 to keep the logs.
+
+set -u
+
+BINDIR=$(cd "${1:-${BINDIR:-bin}}" && pwd)
+SRCDIR=$(cd "$(dirname "$0")" && pwd)
+SWDL="$BINDIR/newbs-swdl"
+MKNIMAGE="$BINDIR/mknImage"
+
+TMP=$(mktemp -d)
+SERVER_PID=
+cleanup()
+{
+    [[ -n "$SERVER_PID" ]] && kill "$SERVER_PID" 2>/dev/null
+    [[ -n "${KEEP_TMP:-}" ]] && echo "kept $TMP" || rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+FAILED=0
+fail()
+{
+    echo "FAIL: $*"
+    FAILED=1
+}
+
+# run newbs-swdl with the test cmdline.txt, output goes to $TMP/out
+swdl()
+{
+    "$SWDL" -T -D -c "$TMP/cmdline.txt" "$@" >"$TMP/out" 2>&1
+}
+
+expect_success()
+{
+    if ! grep -q "completed SUCCESS" "$TMP/out"; then
+        fail "$1"
+        sed 's/^/    /' "$TMP/out"
+    fi
+}
+
+expect_log()
+{
+    if ! grep -q -- "$2" "$1"; then
+        fail "expected '$2' in $(basename "$1")"
+    fi
+}
+
+echo "root=/dev/mmcblk0p2 rootwait" >"$TMP/cmdline.txt"
+
+# big enough for -P and a journal checkpoint (every 64 MB)
+mkdir "$TMP/www"
+head -c $((100 << 20)) /dev/urandom >"$TMP/rootfs.bin"
+"$MKNIMAGE" create -o "$TMP/www/img.nimg" rootfs:"$TMP/rootfs.bin" >/dev/null 2>&1 || { echo "mknImage create failed"; exit 1; }
+
+python3 "$SRCDIR/http_server.py" "$TMP/www" "$TMP/port" "$TMP/requests" &
+SERVER_PID=$!
+for i in $(seq 50); do
+    [[ -f "$TMP/port" ]] && break
+    sleep 0.1
+done
+[[ -f "$TMP/port" ]] || { echo "HTTP server didn't start"; exit 1; }
+URL="http://127.0.0.1:$(cat "$TMP/port")"
+
+echo "plain download"
+swdl "$URL/img.nimg"
+expect_success "plain download"
+expect_log "$TMP/out" "built-in HTTP client"
+
+echo "dropped connection"
+: >"$TMP/requests"
+swdl "$URL/drop/img.nimg"
+expect_success "dropped connection"
+expect_log "$TMP/out" "resuming download at byte"
+expect_log "$TMP/requests" "/drop/img.nimg bytes=[0-9]*-"
+
+echo "journal resume after SIGKILL"
+: >"$TMP/requests"
+"$SWDL" -T -D -c "$TMP/cmdline.txt" -j "$TMP/journal" "$URL/stall/img.nimg" >"$TMP/out" 2>&1 &
+SWDL_PID=$!
+for i in $(seq 300); do
+    grep -q "journal: part 0 offset [1-9]" "$TMP/out" && break
+    sleep 0.1
+done
+{ kill -9 "$SWDL_PID"; wait "$SWDL_PID"; } 2>/dev/null
+expect_log "$TMP/out" "journal: part 0 offset [1-9]"
+: >"$TMP/requests"
+swdl -j "$TMP/journal" "$URL/img.nimg"
+expect_success "journal resume"
+expect_log "$TMP/out" "resuming interrupted download at part 0"
+expect_log "$TMP/requests" "/img.nimg bytes=[1-9][0-9]*-"
+[[ -e "$TMP/journal" ]] && fail "journal wasn't removed after success"
+
+echo "parallel download (-P)"
+: >"$TMP/requests"
+swdl -P 4 "$URL/img.nimg"
+expect_success "parallel download"
+expect_log "$TMP/out" "parallel regions"
+[[ $(grep -c "bytes=[0-9]*-[0-9]" "$TMP/requests") -ge 4 ]] || fail "expected 4 range requests for -P 4"
+
+echo "relative redirect"
+swdl "$URL/rel/img.nimg"
+expect_success "relative redirect"
+expect_log "$TMP/out" "redirected to $URL/rel/img.nimg?moved"
+
+echo "credentials aren't sent to other hosts"
+: >"$TMP/requests"
+swdl -u user:secret "$URL/otherhost/img.nimg"
+expect_success "redirect to another host"
+expect_log "$TMP/requests" "^/otherhost/img.nimg - Basic_"
+expect_log "$TMP/requests" "^/img.nimg - -$"
+
+if [[ $FAILED -ne 0 ]]; then
+    echo "HTTP tests FAILED"
+    exit 1
+fi
+echo "HTTP tests passed"